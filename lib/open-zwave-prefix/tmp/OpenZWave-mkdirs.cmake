@@ -0,0 +1,22 @@
+# Distributed under the OSI-approved BSD 3-Clause License.  See accompanying
+# file Copyright.txt or https://cmake.org/licensing for details.
+
+cmake_minimum_required(VERSION 3.5)
+
+file(MAKE_DIRECTORY
+  "/root/repo/lib/open-zwave"
+  "/root/repo/lib/open-zwave-prefix/src/OpenZWave-build"
+  "/root/repo/lib/open-zwave-prefix"
+  "/root/repo/lib/open-zwave-prefix/tmp"
+  "/root/repo/lib/open-zwave-prefix/src/OpenZWave-stamp"
+  "/root/repo/lib/open-zwave-prefix/src"
+  "/root/repo/lib/open-zwave-prefix/src/OpenZWave-stamp"
+)
+
+set(configSubDirs )
+foreach(subDir IN LISTS configSubDirs)
+    file(MAKE_DIRECTORY "/root/repo/lib/open-zwave-prefix/src/OpenZWave-stamp/${subDir}")
+endforeach()
+if(cfgdir)
+  file(MAKE_DIRECTORY "/root/repo/lib/open-zwave-prefix/src/OpenZWave-stamp${cfgdir}") # cfgdir has leading slash
+endif()
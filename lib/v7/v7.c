@@ -16614,6 +16614,18 @@ restart:
       }
     }
 
+    /*
+     * the interrupt flag is not cleared here, so catch blocks are interrupted
+     * as well and the exception unwinds the entire script. Finally blocks
+     * that run for the exception are left alone, they rethrow it when done.
+     * Ops that leave a block are always executed, otherwise the exception
+     * would land in the block that was being left again.
+     */
+    if (v7->interrupted && !v7->is_thrown && op != OP_TRY_POP &&
+        op != OP_AFTER_FINALLY) {
+      BTRY(v7_throwf(v7, INTERNAL_ERROR, "Interrupted"));
+    }
+
     r.need_inc_ops = 1;
 #ifdef V7_BCODE_TRACE
     {
@@ -17668,6 +17680,14 @@ V7_PRIVATE enum v7_err b_exec(struct v7 *v7, const char *src, size_t src_len,
 
   (void) filename;
 
+  /*
+   * a pending interrupt only applies to the top-level execution that was
+   * running when it was requested
+   */
+  if (v7->act_bcodes.len == 0) {
+    v7->interrupted = 0;
+  }
+
 #if V7_ENABLE_STACK_TRACKING
   v7_stack_track_start(v7, &stack_track_ctx);
 #endif
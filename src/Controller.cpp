@@ -2,6 +2,9 @@
 #include <fstream>
 #include <algorithm>
 #include <future>
+#include <atomic>
+#include <cstdio>
+#include <unordered_set>
 
 #include <sys/types.h>
 #include <dirent.h>
@@ -17,6 +20,65 @@
 	#include <cassert>
 #endif // _DEBUG
 
+v7_val_t micasa_v7_mk_json( struct v7* v7_, const nlohmann::json& data_ ) {
+	// NOTE The values that are being constructed are not reachable until they're attached to their parent, so this
+	// function should only be called while the garbage collector is inhibited, which v7 does for cfunctions. Array
+	// elements are set by index because determining the length of a (non-dense) v7 array requires a full scan.
+	v7_val_t result;
+	switch( data_.type() ) {
+		case nlohmann::json::value_t::object: {
+			result = v7_mk_object( v7_ );
+			for ( auto dataIt = data_.begin(); dataIt != data_.end(); dataIt++ ) {
+				v7_set( v7_, result, dataIt.key().c_str(), dataIt.key().size(), micasa_v7_mk_json( v7_, dataIt.value() ) );
+			}
+			break;
+		}
+		case nlohmann::json::value_t::array: {
+			result = v7_mk_array( v7_ );
+			unsigned long index = 0;
+			for ( auto dataIt = data_.begin(); dataIt != data_.end(); dataIt++ ) {
+				v7_array_set( v7_, result, index++, micasa_v7_mk_json( v7_, *dataIt ) );
+			}
+			break;
+		}
+		case nlohmann::json::value_t::string: {
+			const std::string& value = data_.get_ref<const std::string&>();
+			result = v7_mk_string( v7_, value.c_str(), value.size(), 1 );
+			break;
+		}
+		case nlohmann::json::value_t::number_integer:
+		case nlohmann::json::value_t::number_unsigned:
+		case nlohmann::json::value_t::number_float:
+			result = v7_mk_number( v7_, data_.get<double>() );
+			break;
+		case nlohmann::json::value_t::boolean:
+			result = v7_mk_boolean( v7_, data_.get<bool>() ? 1 : 0 );
+			break;
+		default:
+			result = v7_mk_null();
+			break;
+	}
+	return result;
+};
+
+v7_err micasa_v7_event_device( struct v7* v7_, v7_val_t* res_ ) {
+	micasa::Controller* controller = static_cast<micasa::Controller*>( v7_get_user_data( v7_, v7_get_global( v7_ ) ) );
+
+	// The device property of an event is resolved when it's accessed for the first time, after which the getter is
+	// replaced by the resolved value.
+	v7_val_t event = v7_get_this( v7_ );
+	unsigned int deviceId = (unsigned int)(uintptr_t)v7_get_user_data( v7_, event );
+	std::shared_ptr<micasa::Device> device = controller->getDeviceById( deviceId );
+	if ( device == nullptr ) {
+		*res_ = v7_mk_undefined();
+	} else {
+		*res_ = micasa_v7_mk_json( v7_, device->getJson() );
+	}
+	v7_def( v7_, event, "device", ~0, V7_DESC_GETTER( 0 ) | V7_DESC_WRITABLE( 1 ), *res_ );
+
+	return V7_OK;
+};
+
 v7_err micasa_v7_update_device( struct v7* v7_, v7_val_t* res_ ) {
 	micasa::Controller* controller = static_cast<micasa::Controller*>( v7_get_user_data( v7_, v7_get_global( v7_ ) ) );
 
@@ -85,10 +147,7 @@ v7_err micasa_v7_get_device( struct v7* v7_, v7_val_t* res_ ) {
 		return v7_throwf( v7_, "Error", "Invalid device." );
 	}
 
-	v7_err js_error = v7_parse_json( v7_, device->getJson().dump().c_str(), res_ );
-	if ( V7_OK != js_error ) {
-		return v7_throwf( v7_, "Error", "Internal error." );
-	}
+	*res_ = micasa_v7_mk_json( v7_, device->getJson() );
 
 	return V7_OK;
 };
@@ -132,30 +191,25 @@ v7_err micasa_v7_get_data( struct v7* v7_, v7_val_t* res_ ) {
 		group = v7_get_string( v7_, &arg3, NULL );
 	}
 
-	v7_err js_error;
 	switch( device->getType() ) {
 		case micasa::Device::Type::COUNTER: {
-			js_error = v7_parse_json( v7_, std::static_pointer_cast<micasa::Counter>( device )->getData( range, interval, group ).dump().c_str(), res_ );
+			*res_ = micasa_v7_mk_json( v7_, std::static_pointer_cast<micasa::Counter>( device )->getData( range, interval, group ) );
 			break;
 		}
 		case micasa::Device::Type::LEVEL: {
-			js_error = v7_parse_json( v7_, std::static_pointer_cast<micasa::Level>( device )->getData( range, interval, group ).dump().c_str(), res_ );
+			*res_ = micasa_v7_mk_json( v7_, std::static_pointer_cast<micasa::Level>( device )->getData( range, interval, group ) );
 			break;
 		}
 		case micasa::Device::Type::SWITCH: {
-			js_error = v7_parse_json( v7_, std::static_pointer_cast<micasa::Switch>( device )->getData( range, interval ).dump().c_str(), res_ );
+			*res_ = micasa_v7_mk_json( v7_, std::static_pointer_cast<micasa::Switch>( device )->getData( range, interval ) );
 			break;
 		}
 		case micasa::Device::Type::TEXT: {
-			js_error = v7_parse_json( v7_, std::static_pointer_cast<micasa::Text>( device )->getData( range, interval ).dump().c_str(), res_ );
+			*res_ = micasa_v7_mk_json( v7_, std::static_pointer_cast<micasa::Text>( device )->getData( range, interval ) );
 			break;
 		}
 	}
 
-	if ( V7_OK != js_error ) {
-		return v7_throwf( v7_, "Error", "Internal error." );
-	}
-
 	return V7_OK;
 };
 
@@ -163,13 +217,13 @@ v7_err micasa_v7_include( struct v7* v7_, v7_val_t* res_ ) {
 	micasa::Controller* controller = static_cast<micasa::Controller*>( v7_get_user_data( v7_, v7_get_global( v7_ ) ) );
 
 	v7_val_t arg0 = v7_arg( v7_, 0 );
-	std::string script;
+	std::shared_ptr<const std::string> script;
 	if (
 		v7_is_string( arg0 )
-		&& controller->_js_include( v7_get_string( v7_, &arg0, NULL ), script )
+		&& ( script = controller->_js_include( v7_get_string( v7_, &arg0, NULL ) ) ) != nullptr
 	) {
 		v7_val_t js_result;
-		return v7_exec( v7_, script.c_str(), &js_result );
+		return v7_exec_buf( v7_, script->c_str(), script->size(), &js_result );
 	} else {
 		return v7_throwf( v7_, "Error", "Invalid script name." );
 	}
@@ -202,42 +256,95 @@ namespace micasa {
 	extern std::unique_ptr<Settings<>> g_settings;
 	extern std::unique_ptr<WebServer> g_webServer;
 
-	Controller::Controller() :
-		m_running( false )
+	// NOTE threads that are executing scripts never wait for room in one of the event queues, because the consumer of
+	// the scripts stage might be waiting for these scripts to complete.
+	static thread_local bool s_executingScripts = false;
+
+	const std::map<Controller::EventQueuePolicy, std::string> Controller::EventQueuePolicyText = {
+		{ Controller::EventQueuePolicy::BLOCK, "block" },
+		{ Controller::EventQueuePolicy::DROP_OLDEST, "drop_oldest" },
+		{ Controller::EventQueuePolicy::DROP_NEWEST, "drop_newest" }
+	};
+
+	Controller::Controller( const unsigned int scriptContexts_ ) :
+		m_running( false ),
+		m_index( std::make_shared<t_index>() ),
+		m_jsGeneration( 0 ),
+		m_scriptJobs( 0 ),
+		m_retiredScriptsSize( 0 ),
+		m_scriptRoutesLoaded( false ),
+		m_linkRoutesLoaded( false ),
+		m_deviceJsonVersion( 0 ),
+		m_startupPending( 0 ),
+		m_sequence( duration_cast<microseconds>( system_clock::now().time_since_epoch() ).count() ),
+		m_sequenceStart( m_sequence ),
+		m_changelogFloor( m_sequence )
 	{
 #ifdef _DEBUG
 		assert( g_database && "Global Database instance should be created before global Controller instance." );
 #endif // _DEBUG
 
-		std::lock_guard<std::mutex> lock( this->m_jsMutex );
-
-		this->m_v7_js = v7_create();
-		v7_val_t root = v7_get_global( this->m_v7_js );
-		v7_set_user_data( this->m_v7_js, root, this );
-
-		v7_val_t userDataObj;
-		if ( V7_OK != v7_parse_json( this->m_v7_js, g_settings->get( CONTROLLER_SETTING_USERDATA, "{}" ).c_str(), &userDataObj ) ) {
+		// The userdata is shared between all script contexts. It is stored in the controller and copied into the
+		// context that runs a script.
+		try {
+			this->m_userData = json::parse( g_settings->get( CONTROLLER_SETTING_USERDATA, "{}" ) );
+		} catch( ... ) {
 			Logger::log( Logger::LogLevel::ERROR, this, "Syntax error in userdata." );
-			if ( V7_OK != v7_parse_json( this->m_v7_js, "{}", &userDataObj ) ) {
-				Logger::log( Logger::LogLevel::ERROR, this, "Syntax error in default userdata." );
-			}
 		}
-		v7_def( this->m_v7_js, root, "userdata", ~0, V7_PROPERTY_NON_CONFIGURABLE, userDataObj );
+		if ( ! this->m_userData.is_object() ) {
+			this->m_userData = json::object();
+		}
+
+		// Scripts that run longer than the time limit are interrupted and scripts that leave the context with more
+		// heap in use than the heap limit are disabled.
+		this->m_scriptTimeLimit = g_settings->get<unsigned long>( CONTROLLER_SETTING_SCRIPT_TIME_LIMIT_MSEC, CONTROLLER_SCRIPT_DEFAULT_TIME_LIMIT_MSEC );
+		this->m_scriptHeapLimit = g_settings->get<long>( CONTROLLER_SETTING_SCRIPT_HEAP_LIMIT_BYTES, CONTROLLER_SCRIPT_DEFAULT_HEAP_LIMIT_BYTES );
+
+		// Device events are processed by a number of stages, each with it's own bounded queue and consumer, so that
+		// a slow consumer doesn't hold up the plugin that reported the event or any of the other stages. Links and
+		// scripts can change the state of devices so by default their events are never dropped.
+		this->m_eventQueueSize = std::max( 1UL, g_settings->get<unsigned long>( CONTROLLER_SETTING_EVENT_QUEUE_SIZE, CONTROLLER_EVENT_QUEUE_DEFAULT_SIZE ) );
+		this->m_eventQueueOverloadDepth = std::max( 1UL, this->m_eventQueueSize * std::min( 100UL, g_settings->get<unsigned long>( CONTROLLER_SETTING_EVENT_QUEUE_OVERLOAD_PERCENTAGE, CONTROLLER_EVENT_QUEUE_DEFAULT_OVERLOAD_PERCENTAGE ) ) / 100 );
+		this->_addEventStage( "links", EventQueuePolicy::BLOCK, [this]( const t_event& event_ ) {
+			if ( ( event_.source & Device::UpdateSource::LINK ) != Device::UpdateSource::LINK ) {
+				this->_runLinks( event_.device, event_.value.is_string() ? event_.value.get<std::string>() : event_.value.dump() );
+			}
+		} );
+		this->_addEventStage( "scripts", EventQueuePolicy::BLOCK, [this]( const t_event& event_ ) {
+			if ( ( event_.source & Device::UpdateSource::SCRIPT ) != Device::UpdateSource::SCRIPT ) {
 
-		v7_set_method( this->m_v7_js, root, "updateDevice", &micasa_v7_update_device );
-		v7_set_method( this->m_v7_js, root, "getDevice", &micasa_v7_get_device );
-		v7_set_method( this->m_v7_js, root, "getData", &micasa_v7_get_data );
-		v7_set_method( this->m_v7_js, root, "include", &micasa_v7_include );
-		v7_set_method( this->m_v7_js, root, "log", &micasa_v7_log );
+				// The scripts are fetched from the in-memory routing table so no queries are executed on the event
+				// path. The device property of the event is only populated when a script accesses it.
+				auto scripts = this->_getScriptRoutes( event_.device->getId() );
+				if ( scripts.size() > 0 ) {
+					json event;
+					event["value"] = event_.value;
+					this->_runScripts( "event", event, scripts, "device_" + std::to_string( event_.device->getId() ), event_.device->getId() );
+				}
+			}
+		} );
+		this->_addEventStage( "websocket", EventQueuePolicy::DROP_OLDEST, [this]( const t_event& event_ ) {
+			json data = {
+				{ "id", event_.device->getId() },
+				{ "plugin_id", event_.device->getPlugin()->getId() },
+				{ "value", event_.formatted },
+				{ "source", Device::resolveUpdateSource( event_.source ) },
+				{ "sequence", event_.sequence }
+			};
+			g_webServer->broadcast( "device_update", data, event_.device->getPlugin()->getId(), event_.device->getId() );
+		} );
+		this->_addEventStage( "plugins", EventQueuePolicy::DROP_OLDEST, [this]( const t_event& event_ ) {
+			for ( auto const& plugin : this->getDevicePlugins( event_.device ) ) {
+				plugin->afterUpdateDevice( event_.device, event_.source, plugin == event_.device->getPlugin() );
+			}
+		} );
 
-		v7_def( this->m_v7_js, root, "SOURCE_PLUGIN", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( this->m_v7_js, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) ) );
-		v7_def( this->m_v7_js, root, "SOURCE_TIMER", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( this->m_v7_js, Device::resolveUpdateSource( Device::UpdateSource::TIMER ) ) );
-		v7_def( this->m_v7_js, root, "SOURCE_SCRIPT", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( this->m_v7_js, Device::resolveUpdateSource( Device::UpdateSource::SCRIPT ) ) );
-		v7_def( this->m_v7_js, root, "SOURCE_API", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( this->m_v7_js, Device::resolveUpdateSource( Device::UpdateSource::API ) ) );
-		v7_def( this->m_v7_js, root, "SOURCE_LINK", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( this->m_v7_js, Device::resolveUpdateSource( Device::UpdateSource::LINK ) ) );
-		v7_def( this->m_v7_js, root, "SOURCE_SYSTEM", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( this->m_v7_js, Device::resolveUpdateSource( Device::UpdateSource::SYSTEM ) ) );
-		v7_def( this->m_v7_js, root, "SOURCE_USER", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( this->m_v7_js, Device::resolveUpdateSource( Device::UpdateSource::USER ) ) );
-		v7_def( this->m_v7_js, root, "SOURCE_EVENT", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( this->m_v7_js, Device::resolveUpdateSource( Device::UpdateSource::EVENT ) ) );
+		std::lock_guard<std::mutex> lock( this->m_jsMutex );
+		for ( unsigned int i = 0; i < std::max( 1U, scriptContexts_ ); i++ ) {
+			v7* context = this->_createScriptContext();
+			this->m_jsContexts.push_back( context );
+			this->m_jsIdleContexts.push_back( context );
+		}
 	};
 
 	Controller::~Controller() {
@@ -248,8 +355,14 @@ namespace micasa {
 #endif // _WITH_LIBUDEV
 #endif // _DEBUG
 
-		// Release the v7 javascript environment.
-		v7_destroy( this->m_v7_js );
+		// Release the v7 javascript environments.
+		std::lock_guard<std::mutex> lock( this->m_jsMutex );
+#ifdef _DEBUG
+		assert( this->m_jsIdleContexts.size() == this->m_jsContexts.size() && "All script contexts should be idle when the global Controller instance is destroyed." );
+#endif // _DEBUG
+		for ( auto& context : this->m_jsContexts ) {
+			v7_destroy( context );
+		}
 	};
 
 	void Controller::start() {
@@ -258,12 +371,16 @@ namespace micasa {
 		// Fetch all the plugins from the database to initialize our local map of plugin instances. NOTE parents
 		// always have a higher id than clients, so the query order should make sure parents are created first and are
 		// present when childs are created.
-		std::unique_lock<std::recursive_mutex> pluginsLock( this->m_pluginsMutex );
+		std::unique_lock<std::mutex> pluginsLock( this->m_pluginsMutex );
+		auto begin = steady_clock::now();
 		std::vector<std::map<std::string, std::string>> pluginsData = g_database->getQuery(
 			"SELECT `id`, `plugin_id`, `reference`, `type`, `enabled` "
 			"FROM `plugins` "
 			"ORDER BY `id` ASC"
 		);
+		this->addStartupTiming( "database", "plugins", begin );
+
+		std::vector<std::shared_ptr<Plugin>> parents;
 		for ( auto& pluginData : pluginsData ) {
 			std::shared_ptr<Plugin> parent;
 			if ( pluginData["plugin_id"].size() > 0 ) {
@@ -278,35 +395,55 @@ namespace micasa {
 				pluginData["reference"],
 				parent
 			);
+			begin = steady_clock::now();
 			plugin->init();
-			this->m_plugins[pluginData["reference"]] = plugin;
+			this->_updateIndex( [this,plugin]( t_index& index_ ) {
+				this->_indexPlugin( index_, plugin );
+				for ( auto const &device : plugin->getAllDevices() ) {
+					this->_indexDevice( index_, device );
+				}
+			} );
+			this->addStartupTiming( "init", plugin->getName(), begin, plugin->getId() );
 
 			// Only parent plugin is started automatically. The plugin itself should take care of starting it's
-			// children (for instance, right after declarePlugin). Starting the plugin is done in a separate thread
-			// to work around the pluginsMutex being locked.
+			// children (for instance, right after declarePlugin), which guarantees that children are never started
+			// before their parent.
 			if (
 				pluginData["enabled"] == "1"
 				&& parent == nullptr
 			) {
-				this->m_scheduler.schedule( 0, 1, this, [plugin]( std::shared_ptr<Scheduler::Task<>> ) {
-					plugin->start();
-				} );
+				parents.push_back( plugin );
 			}
 		}
 		pluginsLock.unlock();
 
-		// Start a task that runs at every whole minute that processes the configured timers. The 5ms is a safe margin
-		// to make sure the whole minute has passed.
-		auto now = system_clock::now();
-		auto wait = now + ( milliseconds( 60005 ) - duration_cast<milliseconds>( now.time_since_epoch() ) % milliseconds( 60000 ) );
-		this->m_scheduler.schedule( wait, 60000, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
-			if ( this->m_running ) {
-				this->_runTimers();
-			}
-		} );
+		// The parent plugins are started concurrently, each in a separate thread from the scheduler's pool, so that a
+		// slow starter doesn't delay the others. NOTE all plugins and their devices are indexed at this point.
+		std::unique_lock<std::mutex> startupLock( this->m_startupMutex );
+		this->m_startupPending = parents.size();
+		startupLock.unlock();
+		for ( auto const &plugin : parents ) {
+			this->m_scheduler.schedule( 0, 1, this, [this,plugin]( std::shared_ptr<Scheduler::Task<>> ) {
+				auto begin = steady_clock::now();
+				plugin->start();
+				this->addStartupTiming( "start", plugin->getName(), begin, plugin->getId() );
+
+				std::unique_lock<std::mutex> startupLock( this->m_startupMutex );
+				if ( --this->m_startupPending == 0 ) {
+					startupLock.unlock();
+					this->_logStartup();
+				}
+			} );
+		}
+		if ( parents.size() == 0 ) {
+			this->_logStartup();
+		}
 
 		this->m_running = true;
 
+		// The configured timers are compiled and each timer is scheduled at the exact time it should run next.
+		this->invalidateTimers();
+
 #ifdef _WITH_LIBUDEV
 		// If libudev is available we can use it to monitor disconenct and reconnect of the z-wave device. For instance
 		// the Aeon labs z-wave stick can be disconnected to bring it closer to the node when including. NOTE that udev
@@ -343,8 +480,27 @@ namespace micasa {
 
 	void Controller::stop() {
 		Logger::log( Logger::LogLevel::VERBOSE, this, "Stopping..." );
-		this->m_scheduler.erase();
+
+		// Pending events are discarded and producers that are waiting for room in one of the event queues are
+		// released before the scheduler is stopped, because the consumers of the queues run on the scheduler.
+		std::unique_lock<std::mutex> eventsLock( this->m_eventsMutex );
 		this->m_running = false;
+		for ( auto &stage : this->m_eventStages ) {
+			stage.events.clear();
+		}
+		this->m_eventsCondition.notify_all();
+		eventsLock.unlock();
+		std::unique_lock<std::mutex> scriptQueuesLock( this->m_scriptQueuesMutex );
+		this->m_scriptQueuesCondition.notify_all();
+		scriptQueuesLock.unlock();
+
+		this->m_scheduler.erase();
+
+		eventsLock.lock();
+		for ( auto &stage : this->m_eventStages ) {
+			stage.processing = false;
+		}
+		eventsLock.unlock();
 
 #ifdef _WITH_LIBUDEV
 		if ( this->m_udev ) {
@@ -356,10 +512,9 @@ namespace micasa {
 
 		// Stopping the plugins is done asynchroniously. First all parent plugin instances are ordered to stop in a
 		// separate thread...
-		std::unique_lock<std::recursive_mutex> pluginsLock( this->m_pluginsMutex );
+		auto index = std::atomic_load( &this->m_index );
 		std::map<std::string, std::future<void>> futures;
-		for ( auto& pluginPair : this->m_plugins ) {
-			auto plugin = pluginPair.second;
+		for ( auto const &plugin : index->plugins ) {
 			if (
 				plugin->getParent() == nullptr
 				&& plugin->getState() != Plugin::State::DISABLED
@@ -369,7 +524,7 @@ namespace micasa {
 				} );
 			}
 		}
-		pluginsLock.unlock();
+		index = nullptr;
 
 		// ... then all threads are waited for to complete, skipping over plugin threads that take too long to stop.
 		for ( auto const &futuresIt : futures ) {
@@ -382,39 +537,106 @@ namespace micasa {
 #endif // _DEBUG
 		}
 
-		pluginsLock.lock();
-		this->m_plugins.clear();
+		std::unique_lock<std::mutex> pluginsLock( this->m_pluginsMutex );
+		std::unique_lock<std::mutex> indexLock( this->m_indexMutex );
+		std::atomic_store( &this->m_index, std::shared_ptr<const t_index>( std::make_shared<t_index>() ) );
+		indexLock.unlock();
 		pluginsLock.unlock();
 
 		Logger::log( Logger::LogLevel::NORMAL, this, "Stopped." );
 	};
 
+	unsigned long Controller::getVersion() const {
+		// NOTE the version of the index is bumped whenever plugins or devices are added, removed or renamed, the
+		// device json version whenever something referenced by plugins or devices changes.
+		return std::atomic_load( &this->m_index )->version + this->m_deviceJsonVersion;
+	};
+
+	unsigned long long Controller::recordDeviceChange( const unsigned int& deviceId_, bool removed_ ) {
+		// The change sequence is seeded with the current time so that it keeps increasing across restarts and a
+		// sequence from a previous run is never mistaken for one of the current run. Only the most recent changes
+		// are kept, clients with a sequence older than that need to fetch the full list of devices.
+		std::lock_guard<std::mutex> lock( this->m_changelogMutex );
+		unsigned long long sequence = ++this->m_sequence;
+		this->m_changelog.push_back( { sequence, deviceId_, removed_ } );
+		while ( this->m_changelog.size() > CONTROLLER_CHANGELOG_SIZE ) {
+			this->m_changelogFloor = this->m_changelog.front().sequence;
+			this->m_changelog.pop_front();
+		}
+		if ( removed_ ) {
+			this->m_deviceSequences.erase( deviceId_ );
+		} else {
+			this->m_deviceSequences[deviceId_] = sequence;
+		}
+		return sequence;
+	};
+
+	unsigned long long Controller::getDeviceSequence( const unsigned int& deviceId_ ) const {
+		std::lock_guard<std::mutex> lock( this->m_changelogMutex );
+		auto find = this->m_deviceSequences.find( deviceId_ );
+		if ( find != this->m_deviceSequences.end() ) {
+			return find->second;
+		}
+		return this->m_sequenceStart;
+	};
+
+	unsigned long long Controller::getSequence() const {
+		std::lock_guard<std::mutex> lock( this->m_changelogMutex );
+		return this->m_sequence;
+	};
+
+	bool Controller::getDeviceChanges( const unsigned long long& since_, std::vector<unsigned int>& changed_, std::vector<unsigned int>& removed_ ) const {
+		std::lock_guard<std::mutex> lock( this->m_changelogMutex );
+		if (
+			since_ < this->m_changelogFloor
+			|| since_ > this->m_sequence
+		) {
+			return false;
+		}
+
+		// The changelog is walked backwards so that only the most recent change of each device is reported.
+		std::unordered_set<unsigned int> seen;
+		for ( auto changeIt = this->m_changelog.rbegin(); changeIt != this->m_changelog.rend() && changeIt->sequence > since_; changeIt++ ) {
+			if ( seen.insert( changeIt->deviceId ).second ) {
+				if ( changeIt->removed ) {
+					removed_.push_back( changeIt->deviceId );
+				} else {
+					changed_.push_back( changeIt->deviceId );
+				}
+			}
+		}
+		return true;
+	};
+
 	std::shared_ptr<Plugin> Controller::getPlugin( const std::string& reference_ ) const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		try {
-			return this->m_plugins.at( reference_ );
-		} catch( std::out_of_range ex_ ) {
-			return nullptr;
+		auto index = std::atomic_load( &this->m_index );
+		auto find = index->pluginsByReference.find( reference_ );
+		if ( find != index->pluginsByReference.end() ) {
+			return find->second;
 		}
+		return nullptr;
 	};
 
 	std::shared_ptr<Plugin> Controller::getPluginById( const unsigned int& id_ ) const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		for ( auto const &pluginIt : this->m_plugins ) {
-			if ( pluginIt.second->getId() == id_ ) {
-				return pluginIt.second;
-			}
+		auto index = std::atomic_load( &this->m_index );
+		auto find = index->pluginsById.find( id_ );
+		if ( find != index->pluginsById.end() ) {
+			return find->second;
 		}
 		return nullptr;
 	};
 
 	std::vector<std::shared_ptr<Plugin>> Controller::getAllPlugins() const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		std::vector<std::shared_ptr<Plugin>> all;
-		for ( auto const &pluginIt : this->m_plugins ) {
-			all.push_back( pluginIt.second );
+		return std::atomic_load( &this->m_index )->plugins;
+	};
+
+	std::vector<std::shared_ptr<Plugin>> Controller::getChildPlugins( std::shared_ptr<const Plugin> parent_ ) const {
+		auto index = std::atomic_load( &this->m_index );
+		auto find = index->childrenByPluginId.find( parent_->getId() );
+		if ( find != index->childrenByPluginId.end() ) {
+			return find->second;
 		}
-		return all;
+		return std::vector<std::shared_ptr<Plugin>>();
 	};
 
 	std::shared_ptr<Plugin> Controller::declarePlugin( const Plugin::Type type_, const std::string reference_, const std::vector<Setting>& settings_, bool enabled_ ) {
@@ -422,10 +644,12 @@ namespace micasa {
 	};
 
 	std::shared_ptr<Plugin> Controller::declarePlugin( const Plugin::Type type_, const std::string reference_, const std::shared_ptr<Plugin> parent_, const std::vector<Setting>& settings_, bool enabled_ ) {
-		std::unique_lock<std::recursive_mutex> lock( this->m_pluginsMutex );
-		try {
-			return this->m_plugins.at( reference_ );
-		} catch( std::out_of_range ex_ ) { /* does not exists */ }
+		// NOTE the plugins mutex only serializes writers, readers use the current index snapshot without locking.
+		std::unique_lock<std::mutex> lock( this->m_pluginsMutex );
+		std::shared_ptr<Plugin> existing = this->getPlugin( reference_ );
+		if ( existing != nullptr ) {
+			return existing;
+		}
 
 		long id;
 		if ( parent_ ) {
@@ -448,7 +672,9 @@ namespace micasa {
 		}
 
 		std::shared_ptr<Plugin> plugin = Plugin::factory( type_, id, reference_, parent_ );
-		this->m_plugins[reference_] = plugin;
+		this->_updateIndex( [this,plugin]( t_index& index_ ) {
+			this->_indexPlugin( index_, plugin );
+		} );
 
 		auto settings = plugin->getSettings();
 		settings->insert( settings_ );
@@ -456,10 +682,7 @@ namespace micasa {
 			settings->commit();
 		}
 
-		json data = json::object();
-		data["event"] = "plugin_add";
-		data["data"] = plugin->getJson();
-		g_webServer->broadcast( data.dump() );
+		g_webServer->broadcast( "plugin_add", plugin->getJson(), plugin->getId() );
 
 		return plugin;
 	};
@@ -489,31 +712,35 @@ namespace micasa {
 		} );
 
 		// All children and the plugin itself are removed from the list.
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		for ( auto pluginsIt = this->m_plugins.begin(); pluginsIt != this->m_plugins.end(); ) {
-			auto plugin = pluginsIt->second;
-			if (
-				plugin == plugin_
-				|| plugin->getParent() == plugin_
-			) {
-				json data = json::object();
-				data["event"] = "plugin_remove";
-				data["data"] = {
-					{ "id", plugin->getId() }
-				};
-				g_webServer->broadcast( data.dump() );
-
-				pluginsIt = this->m_plugins.erase( pluginsIt );
-			} else {
-				pluginsIt++;
-			}
+		std::lock_guard<std::mutex> lock( this->m_pluginsMutex );
+		std::vector<std::shared_ptr<Plugin>> plugins = this->getChildPlugins( plugin_ );
+		plugins.push_back( plugin_ );
+		for ( auto const &plugin : plugins ) {
+			g_webServer->broadcast( "plugin_remove", { { "id", plugin->getId() } }, plugin->getId() );
+
+			this->_updateIndex( [this,plugin]( t_index& index_ ) {
+				this->_unindexPlugin( index_, plugin );
+				for ( auto const &device : plugin->getAllDevices() ) {
+					this->_unindexDevice( index_, device );
+					index_.subscribersByDeviceId.erase( device->getId() );
+				}
+				for ( auto subscribersIt = index_.subscribersByDeviceId.begin(); subscribersIt != index_.subscribersByDeviceId.end(); ) {
+					auto& subscribers = subscribersIt->second;
+					subscribers.erase( std::remove( subscribers.begin(), subscribers.end(), plugin ), subscribers.end() );
+					if ( subscribers.empty() ) {
+						subscribersIt = index_.subscribersByDeviceId.erase( subscribersIt );
+					} else {
+						subscribersIt++;
+					}
+				}
+			} );
 		}
 	};
 
 	std::shared_ptr<Device> Controller::getDevice( const std::string& reference_ ) const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		for ( auto const &pluginsIt : this->m_plugins ) {
-			auto device = pluginsIt.second->getDevice( reference_ );
+		auto index = std::atomic_load( &this->m_index );
+		for ( auto const &plugin : index->plugins ) {
+			auto device = plugin->getDevice( reference_ );
 			if ( device != nullptr ) {
 				return device;
 			}
@@ -522,48 +749,95 @@ namespace micasa {
 	};
 
 	std::shared_ptr<Device> Controller::getDeviceById( const unsigned int& id_ ) const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		for ( auto const &pluginsIt : this->m_plugins ) {
-			auto device = pluginsIt.second->getDeviceById( id_ );
-			if ( device != nullptr ) {
-				return device;
-			}
+		auto index = std::atomic_load( &this->m_index );
+		auto find = index->devicesById.find( id_ );
+		if ( find != index->devicesById.end() ) {
+			return find->second;
 		}
 		return nullptr;
 	};
 
 	std::shared_ptr<Device> Controller::getDeviceByName( const std::string& name_ ) const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		for ( auto const &pluginsIt : this->m_plugins ) {
-			auto device = pluginsIt.second->getDeviceByName( name_ );
-			if ( device != nullptr ) {
-				return device;
-			}
+		auto index = std::atomic_load( &this->m_index );
+		auto find = index->devicesByName.find( name_ );
+		if ( find != index->devicesByName.end() ) {
+			return find->second;
 		}
 		return nullptr;
 	};
 
 	std::shared_ptr<Device> Controller::getDeviceByLabel( const std::string& label_ ) const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		for ( auto const &pluginsIt : this->m_plugins ) {
-			auto device = pluginsIt.second->getDeviceByLabel( label_ );
-			if ( device != nullptr ) {
-				return device;
-			}
+		auto index = std::atomic_load( &this->m_index );
+		auto find = index->devicesByLabel.find( label_ );
+		if ( find != index->devicesByLabel.end() ) {
+			return find->second;
 		}
 		return nullptr;
 	};
 
 	std::vector<std::shared_ptr<Device>> Controller::getAllDevices() const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
+		auto index = std::atomic_load( &this->m_index );
 		std::vector<std::shared_ptr<Device>> result;
-		for ( auto const &pluginsIt : this->m_plugins ) {
-			auto devices = pluginsIt.second->getAllDevices();
+		for ( auto const &plugin : index->plugins ) {
+			auto devices = plugin->getAllDevices();
 			result.insert( result.end(), devices.begin(), devices.end() );
 		}
 		return result;
 	};
 
+	void Controller::indexDevice( std::shared_ptr<Device> device_ ) {
+		this->_updateIndex( [this,device_]( t_index& index_ ) {
+			this->_unindexDevice( index_, device_ );
+			this->_indexDevice( index_, device_ );
+		} );
+	};
+
+	void Controller::unindexDevice( std::shared_ptr<Device> device_ ) {
+		this->_updateIndex( [this,device_]( t_index& index_ ) {
+			this->_unindexDevice( index_, device_ );
+			index_.subscribersByDeviceId.erase( device_->getId() );
+		} );
+	};
+
+	void Controller::subscribeDevice( std::shared_ptr<Plugin> plugin_, const unsigned int& deviceId_ ) {
+		this->_updateIndex( [plugin_,deviceId_]( t_index& index_ ) {
+			auto& subscribers = index_.subscribersByDeviceId[deviceId_];
+			if ( std::find( subscribers.begin(), subscribers.end(), plugin_ ) == subscribers.end() ) {
+				subscribers.push_back( plugin_ );
+			}
+		} );
+		this->m_deviceJsonVersion++;
+	};
+
+	void Controller::unsubscribeDevice( std::shared_ptr<Plugin> plugin_, const unsigned int& deviceId_ ) {
+		this->_updateIndex( [plugin_,deviceId_]( t_index& index_ ) {
+			auto find = index_.subscribersByDeviceId.find( deviceId_ );
+			if ( find != index_.subscribersByDeviceId.end() ) {
+				find->second.erase( std::remove( find->second.begin(), find->second.end(), plugin_ ), find->second.end() );
+				if ( find->second.empty() ) {
+					index_.subscribersByDeviceId.erase( find );
+				}
+			}
+		} );
+		this->m_deviceJsonVersion++;
+	};
+
+	std::vector<std::shared_ptr<Plugin>> Controller::getDevicePlugins( std::shared_ptr<const Device> device_ ) const {
+		// The plugins that are interested in a device are the plugin that owns the device and all the plugins that
+		// subscribed to updates of the device.
+		std::vector<std::shared_ptr<Plugin>> result = { device_->getPlugin() };
+		auto index = std::atomic_load( &this->m_index );
+		auto find = index->subscribersByDeviceId.find( device_->getId() );
+		if ( find != index->subscribersByDeviceId.end() ) {
+			for ( auto const &plugin : find->second ) {
+				if ( plugin != result[0] ) {
+					result.push_back( plugin );
+				}
+			}
+		}
+		return result;
+	};
+
 	bool Controller::isScheduled( std::shared_ptr<const Device> device_ ) const {
 		return this->m_scheduler.first(
 			[device_]( const Scheduler::BaseTask& task_ ) -> bool {
@@ -588,48 +862,227 @@ namespace micasa {
 	template<class D> void Controller::newEvent( std::shared_ptr<D> device_, const Device::UpdateSource& source_ ) {
 		if ( this->m_running ) {
 
-			if ( ( source_ & Device::UpdateSource::LINK ) != Device::UpdateSource::LINK ) {
-				this->_runLinks( device_ );
+			// NOTE The event captures the value and change sequence at the time of the event and is handed off to
+			// the event stages in a separate method because this method is templated and is essentially copied for
+			// each specialization.
+			auto event = std::make_shared<t_event>();
+			event->device = device_;
+			event->source = source_;
+			auto value = device_->getValue();
+			event->value = value;
+			event->formatted = device_->formatValue( value );
+			event->sequence = this->getDeviceSequence( device_->getId() );
+			event->queued = steady_clock::now();
+			this->_queueEvent( event );
+		}
+	};
+
+	template void Controller::newEvent( std::shared_ptr<Switch> device_, const Device::UpdateSource& source_ );
+	template void Controller::newEvent( std::shared_ptr<Level> device_, const Device::UpdateSource& source_ );
+	template void Controller::newEvent( std::shared_ptr<Counter> device_, const Device::UpdateSource& source_ );
+	template void Controller::newEvent( std::shared_ptr<Text> device_, const Device::UpdateSource& source_ );
+
+	json Controller::getEventQueueJson() const {
+		std::lock_guard<std::mutex> lock( this->m_eventsMutex );
+		json result = json::array();
+		for ( auto const &stage : this->m_eventStages ) {
+			result += {
+				{ "name", stage.name },
+				{ "policy", Controller::resolveTextEventQueuePolicy( stage.policy ) },
+				{ "size", this->m_eventQueueSize },
+				{ "overload_depth", this->m_eventQueueOverloadDepth },
+				{ "depth", stage.events.size() },
+				{ "lag", stage.events.size() > 0 ? duration_cast<microseconds>( steady_clock::now() - stage.events.front()->queued ).count() / 1000. : 0. },
+				{ "processed", stage.processed },
+				{ "dropped", stage.dropped },
+				{ "average_lag", stage.processed > 0 ? stage.totalLag.count() / 1000. / stage.processed : 0. },
+				{ "max_lag", stage.maxLag.count() / 1000. }
+			};
+		}
+		return result;
+	};
+
+	void Controller::addStartupTiming( const std::string& phase_, const std::string& name_, const steady_clock::time_point& begin_, const unsigned int& pluginId_ ) {
+		t_startupTiming timing = { phase_, name_, pluginId_, begin_, steady_clock::now() };
+		Logger::logr( Logger::LogLevel::VERBOSE, this, "Startup %s %s took %.1f ms.", phase_.c_str(), name_.c_str(), duration_cast<microseconds>( timing.end - timing.begin ).count() / 1000. );
+		std::lock_guard<std::mutex> lock( this->m_startupMutex );
+		this->m_startupTimings.push_back( timing );
+	};
+
+	json Controller::getStartupJson() const {
+		std::lock_guard<std::mutex> lock( this->m_startupMutex );
+		json timeline = json::array();
+		if ( this->m_startupTimings.size() == 0 ) {
+			return { { "pending", this->m_startupPending }, { "duration", 0. }, { "timeline", timeline } };
+		}
+
+		// The offsets in the timeline are relative to the earliest recorded timing, which is usually the opening of the
+		// database.
+		auto first = this->m_startupTimings.front().begin;
+		auto last = this->m_startupTimings.front().end;
+		for ( auto const &timing : this->m_startupTimings ) {
+			first = std::min( first, timing.begin );
+			last = std::max( last, timing.end );
+		}
+		for ( auto const &timing : this->m_startupTimings ) {
+			json entry = {
+				{ "phase", timing.phase },
+				{ "name", timing.name },
+				{ "offset", duration_cast<microseconds>( timing.begin - first ).count() / 1000. },
+				{ "duration", duration_cast<microseconds>( timing.end - timing.begin ).count() / 1000. }
+			};
+			if ( timing.pluginId > 0 ) {
+				entry["plugin_id"] = timing.pluginId;
 			}
+			timeline += entry;
+		}
+		return {
+			{ "pending", this->m_startupPending },
+			{ "duration", duration_cast<microseconds>( last - first ).count() / 1000. },
+			{ "timeline", timeline }
+		};
+	};
 
-			if ( ( source_ & Device::UpdateSource::SCRIPT ) != Device::UpdateSource::SCRIPT ) {
-
-				// NOTE The processing of the event is deliberatly done in a separate method because this method is
-				// templated and is essentially copied for each specialization.
-				auto scripts = g_database->getQuery(
-					"SELECT s.`id`, s.`name`, s.`code` "
-					"FROM `scripts` s, `x_device_scripts` x "
-					"WHERE x.`script_id`=s.`id` "
-					"AND x.`device_id`=%d "
-					"AND s.`enabled`=1 "
-					"ORDER BY `id` ASC",
-					device_->getId()
-				);
-				if ( scripts.size() > 0 ) {
-					json event;
-					event["value"] = device_->getValue();
-					event["device"] = device_->getJson();
-					this->_runScripts( "event", event, scripts );
+	void Controller::_logStartup() const {
+		std::lock_guard<std::mutex> lock( this->m_startupMutex );
+		if ( this->m_startupTimings.size() == 0 ) {
+			return;
+		}
+		auto first = this->m_startupTimings.front().begin;
+		const t_startupTiming* slowest = nullptr;
+		for ( auto const &timing : this->m_startupTimings ) {
+			first = std::min( first, timing.begin );
+			if (
+				timing.phase == "start"
+				&& (
+					slowest == nullptr
+					|| timing.end - timing.begin > slowest->end - slowest->begin
+				)
+			) {
+				slowest = &timing;
+			}
+		}
+		if ( slowest != nullptr ) {
+			Logger::logr( Logger::LogLevel::NORMAL, this, "Startup completed in %.1f ms, slowest plugin was %s (%.1f ms).",
+				duration_cast<microseconds>( steady_clock::now() - first ).count() / 1000.,
+				slowest->name.c_str(),
+				duration_cast<microseconds>( slowest->end - slowest->begin ).count() / 1000.
+			);
+		} else {
+			Logger::logr( Logger::LogLevel::NORMAL, this, "Startup completed in %.1f ms.", duration_cast<microseconds>( steady_clock::now() - first ).count() / 1000. );
+		}
+	};
+
+	bool Controller::isOverloaded() const {
+		std::unique_lock<std::mutex> scriptQueuesLock( this->m_scriptQueuesMutex );
+		if ( this->m_scriptJobs >= this->m_eventQueueOverloadDepth ) {
+			return true;
+		}
+		scriptQueuesLock.unlock();
+		std::lock_guard<std::mutex> lock( this->m_eventsMutex );
+		for ( auto const &stage : this->m_eventStages ) {
+			if ( stage.events.size() >= this->m_eventQueueOverloadDepth ) {
+				return true;
+			}
+		}
+		return false;
+	};
+
+	void Controller::_addEventStage( const std::string& name_, const EventQueuePolicy& policy_, std::function<void( const t_event& event_ )>&& func_ ) {
+		t_eventStage stage;
+		stage.name = name_;
+		stage.policy = Controller::resolveTextEventQueuePolicy( g_settings->get( CONTROLLER_SETTING_EVENT_QUEUE_POLICY_PREFIX + name_, Controller::resolveTextEventQueuePolicy( policy_ ) ) );
+		stage.func = std::move( func_ );
+		stage.processing = false;
+		stage.processed = 0;
+		stage.dropped = 0;
+		stage.totalLag = microseconds::zero();
+		stage.maxLag = microseconds::zero();
+		this->m_eventStages.push_back( stage );
+	};
+
+	void Controller::_queueEvent( std::shared_ptr<const t_event> event_ ) {
+		std::unique_lock<std::mutex> lock( this->m_eventsMutex );
+		for ( unsigned int index = 0; index < this->m_eventStages.size(); index++ ) {
+			t_eventStage& stage = this->m_eventStages[index];
+
+			// If the queue of a stage is full the policy of the stage determines what happens. NOTE that the consumer
+			// of a stage can produce new events itself (a link updating another device) and should never wait for
+			// itself.
+			if ( stage.events.size() >= this->m_eventQueueSize ) {
+				if ( stage.policy == EventQueuePolicy::DROP_NEWEST ) {
+					stage.dropped++;
+					continue;
+				} else if ( stage.policy == EventQueuePolicy::DROP_OLDEST ) {
+					stage.events.pop_front();
+					stage.dropped++;
+				} else if (
+					stage.consumer != std::this_thread::get_id()
+					&& ! s_executingScripts
+				) {
+					this->m_eventsCondition.wait( lock, [this,&stage]() -> bool {
+						return stage.events.size() < this->m_eventQueueSize || ! this->m_running;
+					} );
+					if ( ! this->m_running ) {
+						return;
+					}
 				}
 			}
 
-			json device = device_->getJson();
-			json data = json::object();
-			data["event"] = "device_update";
-			data["data"] = {
-				{ "id", device_->getId() },
-				{ "plugin_id", device_->getPlugin()->getId() },
-				{ "value", device["value"] },
-				{ "source", Device::resolveUpdateSource( source_ ) }
-			};
-			g_webServer->broadcast( data.dump() );
+			stage.events.push_back( event_ );
+			if ( stage.processing ) {
+				continue; // a task is already processing this stage
+			}
+			stage.processing = true;
+
+			this->m_scheduler.schedule( 0, 1, this, [this,index]( std::shared_ptr<Scheduler::Task<>> ) {
+				std::unique_lock<std::mutex> lock( this->m_eventsMutex );
+				t_eventStage& stage = this->m_eventStages[index];
+				stage.consumer = std::this_thread::get_id();
+				while (
+					stage.events.size() > 0
+					&& this->m_running
+				) {
+					auto event = stage.events.front();
+					stage.events.pop_front();
+					auto lag = duration_cast<microseconds>( steady_clock::now() - event->queued );
+					stage.totalLag += lag;
+					stage.maxLag = std::max( stage.maxLag, lag );
+					stage.processed++;
+					this->m_eventsCondition.notify_all();
+					lock.unlock();
+
+					stage.func( *event );
+
+					lock.lock();
+				}
+				stage.consumer = std::thread::id();
+				stage.processing = false;
+			} );
 		}
 	};
 
-	template void Controller::newEvent( std::shared_ptr<Switch> device_, const Device::UpdateSource& source_ );
-	template void Controller::newEvent( std::shared_ptr<Level> device_, const Device::UpdateSource& source_ );
-	template void Controller::newEvent( std::shared_ptr<Counter> device_, const Device::UpdateSource& source_ );
-	template void Controller::newEvent( std::shared_ptr<Text> device_, const Device::UpdateSource& source_ );
+	void Controller::invalidateScriptRoutes( const int& deviceId_ ) {
+		std::lock_guard<std::mutex> lock( this->m_routesMutex );
+		this->m_deviceJsonVersion++;
+		if ( deviceId_ < 0 ) {
+			this->m_scriptRoutes.clear();
+			this->m_scriptRoutesLoaded = false;
+		} else if ( this->m_scriptRoutesLoaded ) {
+			this->_loadScriptRoutes( deviceId_ );
+		}
+	};
+
+	void Controller::invalidateLinkRoutes( const int& deviceId_ ) {
+		std::lock_guard<std::mutex> lock( this->m_routesMutex );
+		this->m_deviceJsonVersion++;
+		if ( deviceId_ < 0 ) {
+			this->m_linkRoutes.clear();
+			this->m_linkRoutesLoaded = false;
+		} else if ( this->m_linkRoutesLoaded ) {
+			this->_loadLinkRoutes( deviceId_ );
+		}
+	};
 
 #ifdef _WITH_LIBUDEV
 	void Controller::addSerialPortCallback( const std::string& name_, const t_serialPortCallback& callback_ ) {
@@ -649,6 +1102,76 @@ namespace micasa {
 	};
 #endif // _WITH_LIBUDEV
 
+	void Controller::_updateIndex( const std::function<void( t_index& index_ )>& func_ ) {
+		// The index is copied, modified and then swapped with the current index. This allows readers to use the index
+		// without having to obtain a lock. Only writers are serialized.
+		std::lock_guard<std::mutex> lock( this->m_indexMutex );
+		std::shared_ptr<t_index> index = std::make_shared<t_index>( *std::atomic_load( &this->m_index ) );
+		index->version++;
+		func_( *index );
+		std::atomic_store( &this->m_index, std::shared_ptr<const t_index>( index ) );
+	};
+
+	void Controller::_indexPlugin( t_index& index_, std::shared_ptr<Plugin> plugin_ ) const {
+		// NOTE the parent -> children adjacency is precomputed so that plugins can fetch their children without
+		// having to iterate over all plugins.
+		index_.plugins.push_back( plugin_ );
+		index_.pluginsByReference[plugin_->getReference()] = plugin_;
+		index_.pluginsById[plugin_->getId()] = plugin_;
+		if ( plugin_->getParent() != nullptr ) {
+			index_.childrenByPluginId[plugin_->getParent()->getId()].push_back( plugin_ );
+		}
+	};
+
+	void Controller::_unindexPlugin( t_index& index_, std::shared_ptr<Plugin> plugin_ ) const {
+		index_.plugins.erase( std::remove( index_.plugins.begin(), index_.plugins.end(), plugin_ ), index_.plugins.end() );
+		index_.pluginsByReference.erase( plugin_->getReference() );
+		index_.pluginsById.erase( plugin_->getId() );
+		index_.childrenByPluginId.erase( plugin_->getId() );
+		if ( plugin_->getParent() != nullptr ) {
+			auto find = index_.childrenByPluginId.find( plugin_->getParent()->getId() );
+			if ( find != index_.childrenByPluginId.end() ) {
+				auto& children = find->second;
+				children.erase( std::remove( children.begin(), children.end(), plugin_ ), children.end() );
+				if ( children.empty() ) {
+					index_.childrenByPluginId.erase( find );
+				}
+			}
+		}
+	};
+
+	void Controller::_indexDevice( t_index& index_, std::shared_ptr<Device> device_ ) const {
+		std::string name = device_->getName();
+		std::string label = device_->getLabel();
+		index_.devicesById[device_->getId()] = device_;
+		index_.devicesByName.insert( { name, device_ } );
+		index_.devicesByLabel.insert( { label, device_ } );
+		index_.deviceKeys[device_->getId()] = { name, label };
+	};
+
+	void Controller::_unindexDevice( t_index& index_, std::shared_ptr<Device> device_ ) const {
+		auto find = index_.deviceKeys.find( device_->getId() );
+		if ( find == index_.deviceKeys.end() ) {
+			return;
+		}
+		auto range = index_.devicesByName.equal_range( find->second.first );
+		for ( auto rangeIt = range.first; rangeIt != range.second; rangeIt++ ) {
+			if ( rangeIt->second == device_ ) {
+				index_.devicesByName.erase( rangeIt );
+				break;
+			}
+		}
+		range = index_.devicesByLabel.equal_range( find->second.second );
+		for ( auto rangeIt = range.first; rangeIt != range.second; rangeIt++ ) {
+			if ( rangeIt->second == device_ ) {
+				index_.devicesByLabel.erase( rangeIt );
+				break;
+			}
+		}
+		index_.devicesById.erase( device_->getId() );
+		index_.deviceKeys.erase( find );
+	};
+
 	template<class D> void Controller::_processTask( const std::shared_ptr<D> device_, const typename D::t_value value_, const Device::UpdateSource source_, const TaskOptions options_ ) {
 		if ( options_.clear ) {
 			this->m_scheduler.erase(
@@ -713,286 +1236,851 @@ namespace micasa {
 	template void Controller::_processTask( const std::shared_ptr<Text> device_, const typename Text::t_value value_, const Device::UpdateSource source_, const TaskOptions options_ );
 	template void Controller::_processTask( const std::shared_ptr<Switch> device_, const typename Switch::t_value value_, const Device::UpdateSource source_, const TaskOptions options_ );
 
-	void Controller::_runScripts( const std::string key_, const json data_, const std::vector<std::map<std::string, std::string>> scripts_ ) {
-		this->m_scheduler.schedule( 0, 1, this, [this,key_,data_,scripts_]( std::shared_ptr<Scheduler::Task<>> ) {
-			std::lock_guard<std::mutex> jsLock( this->m_jsMutex );
-
-			// Configure the v7 javascript environment with context data.
-			v7_val_t root = v7_get_global( this->m_v7_js );
-			v7_val_t dataObj;
-			if ( V7_OK != v7_parse_json( this->m_v7_js, data_.dump().c_str(), &dataObj ) ) {
-				Logger::log( Logger::LogLevel::ERROR, this, "Syntax error in scriptdata." );
-#ifdef _DEBUG
-				Logger::log( Logger::LogLevel::VERBOSE, this, data_.dump().c_str() );
-#endif // _DEBUG
+	void Controller::_runScripts( const std::string key_, const json data_, const std::vector<std::map<std::string, std::string>> scripts_, const std::string& queue_, const unsigned int& deviceId_ ) {
+		// Jobs are added to the queue they belong to, usually the queue of the device that triggered the scripts. Jobs
+		// from different queues run in parallel on the available script contexts, but jobs in the same queue are
+		// executed one after another in the order they were added, so the scripts of a device see it's events in order.
+		// The total number of pending jobs is bounded by the event queue size. When the limit is reached the caller,
+		// usually the consumer of the scripts stage, waits for room, which in turn fills the scripts stage itself.
+		std::unique_lock<std::mutex> lock( this->m_scriptQueuesMutex );
+		if ( ! s_executingScripts ) {
+			this->m_scriptQueuesCondition.wait( lock, [this]() -> bool {
+				return this->m_scriptJobs < this->m_eventQueueSize || ! this->m_running;
+			} );
+			if ( ! this->m_running ) {
 				return;
 			}
-			v7_set( this->m_v7_js, root, key_.c_str(), ~0, dataObj );
+		}
+		auto& queue = this->m_scriptQueues[queue_];
+		queue.push_back( { key_, data_, scripts_, deviceId_ } );
+		this->m_scriptJobs++;
+		if ( queue.size() > 1 ) {
+			return; // a task is already processing this queue
+		}
+
+		this->m_scheduler.schedule( 0, 1, this, [this,queue_]( std::shared_ptr<Scheduler::Task<>> ) {
+			std::unique_lock<std::mutex> queuesLock( this->m_scriptQueuesMutex );
+			while ( true ) {
+				auto find = this->m_scriptQueues.find( queue_ );
+
+				// NOTE when the controller is stopping the remaining jobs are discarded instead of being executed
+				// against plugins that are shutting down.
+				if ( ! this->m_running ) {
+					this->m_scriptJobs -= find->second.size();
+					this->m_scriptQueues.erase( find );
+					this->m_scriptQueuesCondition.notify_all();
+					break;
+				}
 
-			for ( auto scriptsIt = scripts_.begin(); scriptsIt != scripts_.end(); scriptsIt++ ) {
+				t_scriptJob job = find->second.front();
+				queuesLock.unlock();
+
+				s_executingScripts = true;
+				this->_executeScripts( job );
+				s_executingScripts = false;
+
+				// NOTE the job is removed from the queue *after* it was executed; a non-empty queue indicates that a
+				// task is processing the queue.
+				queuesLock.lock();
+				find = this->m_scriptQueues.find( queue_ );
+				find->second.pop_front();
+				this->m_scriptJobs--;
+				this->m_scriptQueuesCondition.notify_all();
+				if ( find->second.size() == 0 ) {
+					this->m_scriptQueues.erase( find );
+					break;
+				}
+			}
+		} );
+	};
 
-				v7_val_t js_result;
-				v7_err js_error = v7_exec( this->m_v7_js, (*scriptsIt).at( "code" ).c_str(), &js_result );
+	void Controller::_executeScripts( const t_scriptJob& job_ ) {
+
+		// Wait for a script context to become available.
+		std::unique_lock<std::mutex> jsLock( this->m_jsMutex );
+		this->m_jsCondition.wait( jsLock, [this]() -> bool { return this->m_jsIdleContexts.size() > 0; } );
+		v7* context = this->m_jsIdleContexts.back();
+		this->m_jsIdleContexts.pop_back();
+		jsLock.unlock();
+
+		// Configure the v7 javascript environment with context data and the current userdata. The values are built
+		// directly from their json counterparts. If the job belongs to a device, the device property is added as a
+		// getter that resolves the device when a script accesses it.
+		v7_set_gc_enabled( context, 0 );
+		v7_val_t root = v7_get_global( context );
+		v7_val_t dataObj = micasa_v7_mk_json( context, job_.data );
+		v7_set( context, root, job_.key.c_str(), ~0, dataObj );
+		if (
+			job_.deviceId > 0
+			&& v7_is_object( dataObj )
+		) {
+			v7_set_user_data( context, dataObj, (void*)(uintptr_t)job_.deviceId );
+			v7_def( context, dataObj, "device", ~0, V7_DESC_GETTER( 1 ), v7_mk_function( context, &micasa_v7_event_device ) );
+		}
 
-				bool success = true;
+		std::unique_lock<std::mutex> userDataLock( this->m_userDataMutex );
+		json userData = this->m_userData;
+		userDataLock.unlock();
+		v7_val_t userDataObj = micasa_v7_mk_json( context, userData );
+		v7_set( context, root, "userdata", ~0, userDataObj );
+		v7_set_gc_enabled( context, 1 );
 
-				switch( js_error ) {
-					case V7_SYNTAX_ERROR:
-						Logger::logr( Logger::LogLevel::ERROR, this, "Syntax error in \"%s\".", (*scriptsIt).at( "name" ).c_str() );
-						success = false;
-						break;
-					case V7_EXEC_EXCEPTION:
-						// Extract error message from result. NOTE 1 that if the buffer is too small, v7 allocates it's
-						// own memory chunk which we need to free manually. NOTE 2 these exceptions will not result in
-						// the script getting disabled, so the success flag is still true.
-						char buffer[100], *p;
-						p = v7_stringify( this->m_v7_js, js_result, buffer, sizeof( buffer ), V7_STRINGIFY_DEFAULT );
-						Logger::logr( Logger::LogLevel::ERROR, this, "Exception in in \"%s\" (%s).", (*scriptsIt).at( "name" ).c_str(), p );
-						if ( p != buffer ) {
-							free(p);
-						}
-						break;
-					case V7_AST_TOO_LARGE:
-					case V7_INTERNAL_ERROR:
-						Logger::logr( Logger::LogLevel::ERROR, this, "Internal error in in \"%s\".", (*scriptsIt).at( "name" ).c_str() );
+		auto fHeapUsed = [context]() -> long {
+			return (long)v7_heap_stat( context, V7_HEAP_STAT_HEAP_USED ) + v7_heap_stat( context, V7_HEAP_STAT_STRING_HEAP_USED );
+		};
+		bool recycle = false;
+
+		for ( auto scriptsIt = job_.scripts.begin(); scriptsIt != job_.scripts.end(); scriptsIt++ ) {
+
+			unsigned int scriptId = std::stoi( (*scriptsIt).at( "id" ) );
+			auto code = this->_getCompiledScript( scriptId, (*scriptsIt).at( "code" ) );
+
+			// A watchdog task interrupts the script if it's still running when the time limit expires. The watchdog
+			// is disarmed as soon as the script returns, so it cannot interrupt the context after it has been handed
+			// back. An interrupt that arrives just before that is cleared by v7 when the next script starts.
+			auto watchdog = std::make_shared<std::pair<std::mutex, bool>>();
+			watchdog->second = true;
+			this->m_scheduler.schedule( this->m_scriptTimeLimit, 1, context, [context,watchdog]( std::shared_ptr<Scheduler::Task<>> ) {
+				std::lock_guard<std::mutex> watchdogLock( watchdog->first );
+				if ( watchdog->second ) {
+					v7_interrupt( context );
+				}
+			} );
+
+			long heapUsed = fHeapUsed();
+			auto start = steady_clock::now();
+			v7_val_t js_result;
+			v7_err js_error = v7_exec_buf( context, code->c_str(), code->size(), &js_result );
+			auto duration = duration_cast<microseconds>( steady_clock::now() - start );
+			long heapGrowth = fHeapUsed() - heapUsed;
+
+			std::unique_lock<std::mutex> watchdogLock( watchdog->first );
+			watchdog->second = false;
+			watchdogLock.unlock();
+			this->m_scheduler.erase( [context]( const Scheduler::BaseTask& task_ ) -> bool {
+				return task_.data == context;
+			} );
+
+			std::unique_lock<std::mutex> statisticsLock( this->m_scriptStatisticsMutex );
+			auto& statistics = this->m_scriptStatistics[scriptId];
+			statistics.invocations++;
+			statistics.totalTime += duration;
+			statistics.maxTime = std::max( statistics.maxTime, duration );
+			statistics.maxHeapGrowth = std::max( statistics.maxHeapGrowth, heapGrowth );
+			statisticsLock.unlock();
+
+			// NOTE only the error that v7 throws for an interrupt means that the time limit was exceeded, any other
+			// exception was thrown by the script itself.
+			bool timeout = false;
+			if (
+				js_error == V7_EXEC_EXCEPTION
+				&& v7_is_instanceof( context, js_result, "InternalError" )
+			) {
+				v7_val_t message = v7_get( context, js_result, "message", ~0 );
+				timeout = (
+					v7_is_string( message )
+					&& std::string( v7_get_string( context, &message, NULL ) ) == "Interrupted"
+				);
+			}
+
+			bool success = true;
+
+			switch( js_error ) {
+				case V7_SYNTAX_ERROR:
+					Logger::logr( Logger::LogLevel::ERROR, this, "Syntax error in \"%s\".", (*scriptsIt).at( "name" ).c_str() );
+					success = false;
+					break;
+				case V7_EXEC_EXCEPTION:
+					if ( timeout ) {
+						Logger::logr( Logger::LogLevel::ERROR, this, "Script \"%s\" exceeded the time limit of %lu msec.", (*scriptsIt).at( "name" ).c_str(), this->m_scriptTimeLimit );
 						success = false;
 						break;
-					case V7_OK:
-						Logger::logr( Logger::LogLevel::NORMAL, this, "Script %s \"%s\" executed.", key_.c_str(), (*scriptsIt).at( "name" ).c_str() );
-						break;
+					}
+
+					// Extract error message from result. NOTE 1 that if the buffer is too small, v7 allocates it's
+					// own memory chunk which we need to free manually. NOTE 2 these exceptions will not result in
+					// the script getting disabled, so the success flag is still true.
+					char buffer[100], *p;
+					p = v7_stringify( context, js_result, buffer, sizeof( buffer ), V7_STRINGIFY_DEFAULT );
+					Logger::logr( Logger::LogLevel::ERROR, this, "Exception in in \"%s\" (%s).", (*scriptsIt).at( "name" ).c_str(), p );
+					if ( p != buffer ) {
+						free(p);
+					}
+					break;
+				case V7_AST_TOO_LARGE:
+				case V7_INTERNAL_ERROR:
+					Logger::logr( Logger::LogLevel::ERROR, this, "Internal error in in \"%s\".", (*scriptsIt).at( "name" ).c_str() );
+					success = false;
+					break;
+				case V7_OK:
+					Logger::logr( Logger::LogLevel::NORMAL, this, "Script %s \"%s\" executed.", job_.key.c_str(), (*scriptsIt).at( "name" ).c_str() );
+					break;
+			}
+
+			// The heap limit is checked after the script completes. If the heap still exceeds the limit after a full
+			// garbage collection, the memory is retained by the script and the context is replaced by a fresh one.
+			if (
+				success
+				&& fHeapUsed() > this->m_scriptHeapLimit
+			) {
+				v7_gc( context, 1 );
+				if ( fHeapUsed() > this->m_scriptHeapLimit ) {
+					Logger::logr( Logger::LogLevel::ERROR, this, "Script \"%s\" exceeded the heap limit of %ld bytes.", (*scriptsIt).at( "name" ).c_str(), this->m_scriptHeapLimit );
+					success = false;
+					recycle = true;
 				}
+			}
+
+			if ( ! success ) {
+				g_database->putQuery(
+					"UPDATE `scripts` "
+					"SET `enabled`=0 "
+					"WHERE `id`=%q",
+					(*scriptsIt).at( "id" ).c_str()
+				);
+				this->invalidateScript( scriptId );
+				this->invalidateScriptRoutes();
+
+				// NOTE the timers are reloaded by a separate task. Reloading waits for running timers, which in turn
+				// might be waiting for room in the script queues, so it should never happen inside a script job.
+				this->m_scheduler.schedule( 0, 1, this, [this,scriptId]( std::shared_ptr<Scheduler::Task<>> ) {
+					this->invalidateTimers( scriptId );
+				} );
+			}
+		}
+
+		// Remove the context data from the v7 environment.
+		v7_del( context, root, job_.key.c_str(), ~0 );
 
-				if ( ! success ) {
-					g_database->putQuery(
-						"UPDATE `scripts` "
-						"SET `enabled`=0 "
-						"WHERE `id`=%q",
-						(*scriptsIt).at( "id" ).c_str()
-					);
+		// Get the userdata from the v7 environment. The same logic applies here as V7_EXEC_EXCEPTION regarding the
+		// buffer.
+		userDataObj = v7_get( context, root, "userdata", ~0 );
+		char buffer[1024], *p;
+		p = v7_stringify( context, userDataObj, buffer, sizeof( buffer ), V7_STRINGIFY_JSON );
+		json result;
+		try {
+			result = json::parse( p );
+		} catch( ... ) { }
+		if ( p != buffer ) {
+			free( p );
+		}
+
+		// Retired scripts are kept for as long as contexts exist that might reference them. When they take up too
+		// much memory the contexts that were created before the scripts were retired are replaced, after which the
+		// retired scripts that are no longer referenced by any context are released.
+		jsLock.lock();
+		std::unique_lock<std::mutex> compiledScriptsLock( this->m_compiledScriptsMutex );
+		bool release = ( this->m_retiredScriptsSize > CONTROLLER_SCRIPT_RETIRED_MAX_BYTES );
+		unsigned long generation = release ? this->m_retiredScripts.back().generation : 0;
+		compiledScriptsLock.unlock();
+		if (
+			recycle
+			|| this->m_jsGenerations.at( context ) <= generation
+		) {
+			context = this->_replaceScriptContext( context );
+		}
+		if ( release ) {
+			for ( auto& idle : this->m_jsIdleContexts ) {
+				if ( this->m_jsGenerations.at( idle ) <= generation ) {
+					idle = this->_replaceScriptContext( idle );
 				}
 			}
+		}
+		if (
+			recycle
+			|| release
+		) {
+			unsigned long oldest = this->m_jsGeneration;
+			for ( auto const& contextGeneration : this->m_jsGenerations ) {
+				oldest = std::min( oldest, contextGeneration.second );
+			}
+			compiledScriptsLock.lock();
+			this->m_retiredScripts.erase( std::remove_if( this->m_retiredScripts.begin(), this->m_retiredScripts.end(), [&]( const t_retiredScript& retired_ ) -> bool {
+				if ( retired_.generation < oldest ) {
+					this->m_retiredScriptsSize -= retired_.code->size();
+					return true;
+				}
+				return false;
+			} ), this->m_retiredScripts.end() );
+			compiledScriptsLock.unlock();
+		}
+		this->m_jsIdleContexts.push_back( context );
+		this->m_jsCondition.notify_one();
+		jsLock.unlock();
 
-			// Remove the context data from the v7 environment.
-			v7_del( this->m_v7_js, root, key_.c_str(), ~0 );
-
-			// Get the userdata from the v7 environment and store it in settings for later use. The same logic
-			// applies here as V7_EXEC_EXCEPTION regarding the buffer.
-			v7_val_t userDataObj = v7_get( this->m_v7_js, root, "userdata", ~0 );
-			char buffer[1024], *p;
-			p = v7_stringify( this->m_v7_js, userDataObj, buffer, sizeof( buffer ), V7_STRINGIFY_JSON );
-			g_settings->put( CONTROLLER_SETTING_USERDATA, std::string( p ) );
-			if ( p != buffer ) {
-				free( p );
+		if ( ! result.is_object() ) {
+			Logger::log( Logger::LogLevel::ERROR, this, "Invalid userdata, changes are discarded." );
+			return;
+		}
+
+		// Merge the changes made by the scripts into the shared userdata. Only the top-level keys that were added,
+		// changed or removed by the scripts are touched, so that concurrently running scripts that modify different
+		// keys do not overwrite each other. If the same key is changed concurrently the last script to finish wins.
+		bool dirty = false;
+		userDataLock.lock();
+		for ( auto resultIt = result.begin(); resultIt != result.end(); resultIt++ ) {
+			auto find = userData.find( resultIt.key() );
+			if (
+				find == userData.end()
+				|| *find != resultIt.value()
+			) {
+				this->m_userData[resultIt.key()] = resultIt.value();
+				dirty = true;
 			}
+		}
+		for ( auto userDataIt = userData.begin(); userDataIt != userData.end(); userDataIt++ ) {
+			if ( result.find( userDataIt.key() ) == result.end() ) {
+				this->m_userData.erase( userDataIt.key() );
+				dirty = true;
+			}
+		}
+		if ( dirty ) {
+			g_settings->put( CONTROLLER_SETTING_USERDATA, this->m_userData.dump() );
 			g_settings->commit();
-		} );
+		}
 	};
 
-	void Controller::_runTimers() {
-		auto timers = g_database->getQuery(
-			"SELECT DISTINCT `id`, `cron`, `name` "
-			"FROM `timers` "
-			"WHERE `enabled`=1 "
-			"ORDER BY `id` ASC"
-		);
-		for ( auto timerIt = timers.begin(); timerIt != timers.end(); timerIt++ ) {
-			try {
-				bool run = true;
+	void Controller::invalidateScript( const unsigned int& scriptId_ ) {
+		std::lock_guard<std::mutex> lock( this->m_compiledScriptsMutex );
+		auto find = this->m_compiledScripts.find( scriptId_ );
+		if ( find != this->m_compiledScripts.end() ) {
+			this->_retireScript( find->second.code );
+			this->m_compiledScripts.erase( find );
+		}
 
-				// Split the cron string into exactly 5 fields; m h dom mon dow.
-				std::vector<std::pair<unsigned int, unsigned int>> extremes = { { 0, 59 }, { 0, 23 }, { 1, 31 }, { 1, 12 }, { 1, 7 } };
-				auto fields = stringSplit( (*timerIt)["cron"], ' ' );
-				if ( fields.size() != 5 ) {
-					throw std::runtime_error( "invalid number of cron fields" );
-				}
-				for ( unsigned int field = 0; field <= 4; field++ ) {
+		// The name of the script might have changed so all the resolved includes are cleared.
+		this->m_includes.clear();
+	};
 
-					// Determine the values that are valid for each field by parsing the field and
-					// filling an array with valid values.
-					std::vector<std::string> subexpressions;
-					if ( fields[field].find( "," ) != std::string::npos ) {
-						subexpressions = stringSplit( fields[field], ',' );
-					} else {
-						subexpressions.push_back( fields[field] );
-					}
+	json Controller::getScriptStatistics( const unsigned int& scriptId_ ) const {
+		std::lock_guard<std::mutex> lock( this->m_scriptStatisticsMutex );
+		json result = {
+			{ "invocations", 0 },
+			{ "total_time", 0 },
+			{ "average_time", 0 },
+			{ "max_time", 0 },
+			{ "max_heap_growth", 0 }
+		};
+		auto find = this->m_scriptStatistics.find( scriptId_ );
+		if ( find != this->m_scriptStatistics.end() ) {
+			result["invocations"] = find->second.invocations;
+			result["total_time"] = find->second.totalTime.count() / 1000.;
+			result["average_time"] = find->second.totalTime.count() / 1000. / find->second.invocations;
+			result["max_time"] = find->second.maxTime.count() / 1000.;
+			result["max_heap_growth"] = find->second.maxHeapGrowth;
+		}
+		return result;
+	};
 
-					std::vector<unsigned int> rangeitems;
+	std::shared_ptr<const std::string> Controller::_getCompiledScript( const unsigned int& scriptId_, const std::string& code_ ) {
+		std::lock_guard<std::mutex> lock( this->m_compiledScriptsMutex );
+		return this->_compileScript( scriptId_, code_ );
+	};
 
-					for ( auto& subexpression : subexpressions ) {
-						unsigned int start = extremes[field].first;
-						unsigned int end = extremes[field].second;
-						unsigned int modulo = 0;
+	std::shared_ptr<const std::string> Controller::_compileScript( const unsigned int& scriptId_, const std::string& code_ ) {
+		// NOTE Only call this method with held lock on compiled scripts mutex.
+		size_t hash = std::hash<std::string>()( code_ );
+		auto find = this->m_compiledScripts.find( scriptId_ );
+		if (
+			find != this->m_compiledScripts.end()
+			&& find->second.hash == hash
+		) {
+			return find->second.code;
+		}
 
-						if ( subexpression.find( "/" ) != std::string::npos ) {
-							auto parts = stringSplit( subexpression, '/' );
-							if ( parts.size() != 2 ) {
-								throw std::runtime_error( "invalid cron field devider" );
-							}
-							modulo = std::stoi( parts[1] );
-							subexpression = parts[0];
-						}
+		// The script is compiled into a binary AST which v7 can execute directly from memory without parsing. If the
+		// script cannot be compiled the source itself is cached, so that executing it results in the appropriate
+		// error.
+		std::shared_ptr<const std::string> code;
+		char* buffer = NULL;
+		size_t size = 0;
+		FILE* stream = open_memstream( &buffer, &size );
+		if (
+			stream != NULL
+			&& V7_OK == v7_compile( code_.c_str(), 1, 0, stream )
+		) {
+			fclose( stream );
+			code = std::make_shared<const std::string>( buffer, size );
+		} else {
+			if ( stream != NULL ) {
+				fclose( stream );
+			}
+			code = std::make_shared<const std::string>( code_ );
+		}
+		free( buffer );
 
-						if ( subexpression.find( "-" ) != std::string::npos ) {
-							auto parts = stringSplit( subexpression, '-' );
-							if ( parts.size() != 2 ) {
-								throw std::runtime_error( "invalid cron field range" );
-							}
-							start = std::stoi( parts[0] );
-							end = std::stoi( parts[1] );
-						} else if (
-							subexpression != "*"
-							&& modulo == 0
-						) {
-							start = std::stoi( subexpression );
-							end = start;
-						}
+		if ( find != this->m_compiledScripts.end() ) {
+			this->_retireScript( find->second.code );
+		}
+		this->m_compiledScripts[scriptId_] = { hash, code };
+		return code;
+	};
 
-						for ( unsigned int index = start; index <= end; index++ ) {
-							if ( modulo > 0 ) {
-								int remainder = index % modulo;
-								if ( subexpression == "*" ) {
-									if ( 0 == remainder ) {
-										rangeitems.push_back( index );
-									}
-								} else if ( remainder == std::stoi( subexpression ) ) {
-									rangeitems.push_back( index );
-								}
-							} else {
-								rangeitems.push_back( index );
-							}
-						}
-					}
+	void Controller::_retireScript( std::shared_ptr<const std::string> code_ ) {
+		// NOTE Only call this method with held lock on compiled scripts mutex. v7 references the compiled AST
+		// directly when executing it, and functions that were declared by a script keep referencing it after
+		// execution. Therefore previously compiled versions are retained until all the contexts that existed at the
+		// time of retirement have been replaced.
+		this->m_retiredScripts.push_back( { this->m_jsGeneration, code_ } );
+		this->m_retiredScriptsSize += code_->size();
+	};
 
-					time_t rawtime;
-					time( &rawtime );
-					struct tm* timeinfo;
-					timeinfo = localtime( &rawtime );
+	v7* Controller::_replaceScriptContext( v7* context_ ) {
+		// NOTE Only call this method with held lock on js mutex.
+		auto find = std::find( this->m_jsContexts.begin(), this->m_jsContexts.end(), context_ );
+		this->m_jsGenerations.erase( context_ );
+		v7_destroy( context_ );
+		*find = this->_createScriptContext();
+		return *find;
+	};
 
-					unsigned int current;
-					switch( field ) {
-						case 0: current = timeinfo->tm_min; break;
-						case 1: current = timeinfo->tm_hour; break;
-						case 2: current = timeinfo->tm_mday; break;
-						case 3: current = timeinfo->tm_mon + 1; break;
-						case 4: current = timeinfo->tm_wday == 0 ? 7 : timeinfo->tm_wday; break;
-					}
+	v7* Controller::_createScriptContext() {
+		// NOTE Only call this method with held lock on js mutex.
+		v7* context = v7_create();
+		this->m_jsGenerations[context] = ++this->m_jsGeneration;
+		v7_val_t root = v7_get_global( context );
+		v7_set_user_data( context, root, this );
 
-					if ( std::find( rangeitems.begin(), rangeitems.end(), current ) == rangeitems.end() ) {
-						run = false;
-					}
+		v7_val_t userDataObj;
+		if ( V7_OK != v7_parse_json( context, "{}", &userDataObj ) ) {
+			Logger::log( Logger::LogLevel::ERROR, this, "Syntax error in default userdata." );
+		}
+		v7_def( context, root, "userdata", ~0, V7_PROPERTY_NON_CONFIGURABLE, userDataObj );
+
+		v7_set_method( context, root, "updateDevice", &micasa_v7_update_device );
+		v7_set_method( context, root, "getDevice", &micasa_v7_get_device );
+		v7_set_method( context, root, "getData", &micasa_v7_get_data );
+		v7_set_method( context, root, "include", &micasa_v7_include );
+		v7_set_method( context, root, "log", &micasa_v7_log );
+
+		v7_def( context, root, "SOURCE_PLUGIN", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( context, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) ) );
+		v7_def( context, root, "SOURCE_TIMER", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( context, Device::resolveUpdateSource( Device::UpdateSource::TIMER ) ) );
+		v7_def( context, root, "SOURCE_SCRIPT", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( context, Device::resolveUpdateSource( Device::UpdateSource::SCRIPT ) ) );
+		v7_def( context, root, "SOURCE_API", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( context, Device::resolveUpdateSource( Device::UpdateSource::API ) ) );
+		v7_def( context, root, "SOURCE_LINK", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( context, Device::resolveUpdateSource( Device::UpdateSource::LINK ) ) );
+		v7_def( context, root, "SOURCE_SYSTEM", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( context, Device::resolveUpdateSource( Device::UpdateSource::SYSTEM ) ) );
+		v7_def( context, root, "SOURCE_USER", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( context, Device::resolveUpdateSource( Device::UpdateSource::USER ) ) );
+		v7_def( context, root, "SOURCE_EVENT", ~0, V7_PROPERTY_NON_CONFIGURABLE, v7_mk_number( context, Device::resolveUpdateSource( Device::UpdateSource::EVENT ) ) );
+
+		return context;
+	};
+
+	void Controller::invalidateTimers( const int& scriptId_ ) {
+		// NOTE a negative script id reloads all timers, otherwise only the timers that run the script are reloaded.
+		this->m_deviceJsonVersion++;
+
+		// First all current timers are marked inactive so that timers that are currently running will not schedule
+		// themselves again, after which the pending tasks are removed from the scheduler.
+		std::unique_lock<std::mutex> timersLock( this->m_timersMutex );
+		std::vector<void*> timers;
+		for ( auto timerIt = this->m_timers.begin(); timerIt != this->m_timers.end(); ) {
+			if (
+				scriptId_ < 0
+				|| std::find_if( (*timerIt)->scripts.begin(), (*timerIt)->scripts.end(), [&scriptId_]( const std::map<std::string, std::string>& script_ ) -> bool {
+					return script_.at( "id" ) == std::to_string( scriptId_ );
+				} ) != (*timerIt)->scripts.end()
+			) {
+				(*timerIt)->active = false;
+				timers.push_back( timerIt->get() );
+				timerIt = this->m_timers.erase( timerIt );
+			} else {
+				timerIt++;
+			}
+		}
+		timersLock.unlock();
+		if (
+			scriptId_ > -1
+			&& timers.size() == 0
+		) {
+			return;
+		}
+
+		if ( timers.size() > 0 ) {
+			this->m_scheduler.erase( [&timers]( const Scheduler::BaseTask& task_ ) -> bool {
+				return std::find( timers.begin(), timers.end(), task_.data ) != timers.end();
+			} );
+		}
+
+		timersLock.lock();
+		std::vector<std::map<std::string, std::string>> timersData;
+		if ( scriptId_ < 0 ) {
+			timersData = g_database->getQuery(
+				"SELECT DISTINCT `id`, `cron`, `name` "
+				"FROM `timers` "
+				"WHERE `enabled`=1 "
+				"ORDER BY `id` ASC"
+			);
+		} else {
+			timersData = g_database->getQuery(
+				"SELECT DISTINCT t.`id`, t.`cron`, t.`name` "
+				"FROM `timers` t, `x_timer_scripts` x "
+				"WHERE x.`timer_id`=t.`id` "
+				"AND x.`script_id`=%d "
+				"AND t.`enabled`=1 "
+				"ORDER BY t.`id` ASC",
+				scriptId_
+			);
+		}
+		for ( auto timerIt = timersData.begin(); timerIt != timersData.end(); timerIt++ ) {
+			std::shared_ptr<t_timer> timer = std::make_shared<t_timer>();
+			timer->id = std::stoi( (*timerIt)["id"] );
+			timer->name = (*timerIt)["name"];
+			timer->data = (*timerIt);
+			timer->active = true;
+			try {
+				timer->cron = this->_compileCron( (*timerIt)["cron"] );
+			} catch( const std::exception& ex_ ) {
 
-					// If this field didn't match there's no need to investigate the other fields.
-					if ( ! run ) {
+				// Something went wrong while parsing the cron string. The timer is marked as disabled.
+				Logger::logr( Logger::LogLevel::ERROR, this, "Invalid cron for timer %s (%s).", timer->name.c_str(), ex_.what() );
+				g_database->putQuery(
+					"UPDATE `timers` "
+					"SET `enabled`=0 "
+					"WHERE `id`=%d",
+					timer->id
+				);
+				this->m_deviceJsonVersion++;
+				continue;
+			}
+
+			timer->scripts = g_database->getQuery(
+				"SELECT s.`id`, s.`name`, s.`code` "
+				"FROM `x_timer_scripts` x, `scripts` s "
+				"WHERE x.`script_id`=s.`id` "
+				"AND x.`timer_id`=%d "
+				"AND s.`enabled`=1 "
+				"ORDER BY s.`id` ASC",
+				timer->id
+			);
+			auto devices = g_database->getQuery(
+				"SELECT `device_id`, `value` "
+				"FROM `x_timer_devices` "
+				"WHERE `timer_id`=%d "
+				"ORDER BY `device_id` ASC",
+				timer->id
+			);
+			for ( auto& device : devices ) {
+				timer->devices.push_back( { std::stoi( device["device_id"] ), device["value"] } );
+			}
+
+			this->m_timers.push_back( timer );
+			this->_scheduleTimer( timer );
+		}
+	};
+
+	void Controller::_scheduleTimer( std::shared_ptr<t_timer> timer_ ) {
+		// NOTE Only call this method with held lock on timers mutex.
+		system_clock::time_point next;
+		try {
+			next = this->_nextCronTime( timer_->cron, system_clock::now() );
+		} catch( const std::exception& ex_ ) {
+			Logger::logr( Logger::LogLevel::WARNING, this, "Timer %s will never run (%s).", timer_->name.c_str(), ex_.what() );
+			return;
+		}
+		this->m_scheduler.schedule( next, 0, 1, timer_.get(), [this,timer_]( std::shared_ptr<Scheduler::Task<>> ) {
+			std::unique_lock<std::mutex> timersLock( this->m_timersMutex );
+			if ( ! timer_->active ) {
+				return;
+			}
+			this->_scheduleTimer( timer_ );
+			timersLock.unlock();
+
+			if ( this->m_running ) {
+				this->_runTimer( timer_ );
+			}
+		} );
+	};
+
+	void Controller::_runTimer( std::shared_ptr<t_timer> timer_ ) {
+
+		// First run the scripts that are associated with this timer.
+		if ( timer_->scripts.size() > 0 ) {
+			this->_runScripts( "timer", timer_->data, timer_->scripts, "timer_" + std::to_string( timer_->id ) );
+		}
+
+		// Then update the devices that are associated with this timer.
+		for ( auto devicesIt = timer_->devices.begin(); devicesIt != timer_->devices.end(); devicesIt++ ) {
+			auto device = this->getDeviceById( devicesIt->first );
+			if (
+				device
+				&& device->isEnabled()
+			) {
+				TaskOptions options = { 0, 0, 1, 0, false, false };
+				switch( device->getType() ) {
+					case Device::Type::COUNTER:
+						this->_processTask<Counter>( std::static_pointer_cast<Counter>( device ), std::stoi( devicesIt->second ), Device::UpdateSource::TIMER, options );
+						break;
+					case Device::Type::LEVEL:
+						this->_processTask<Level>( std::static_pointer_cast<Level>( device ), std::stod( devicesIt->second ), Device::UpdateSource::TIMER, options );
+						break;
+					case Device::Type::SWITCH:
+						this->_processTask<Switch>( std::static_pointer_cast<Switch>( device ), devicesIt->second, Device::UpdateSource::TIMER, options );
+						break;
+					case Device::Type::TEXT:
+						this->_processTask<Text>( std::static_pointer_cast<Text>( device ), devicesIt->second, Device::UpdateSource::TIMER, options );
 						break;
+				}
+			}
+		}
+	};
+
+	Controller::t_cron Controller::_compileCron( const std::string& cron_ ) const {
+		t_cron result;
+
+		// Split the cron string into exactly 5 fields; m h dom mon dow.
+		std::vector<std::pair<unsigned int, unsigned int>> extremes = { { 0, 59 }, { 0, 23 }, { 1, 31 }, { 1, 12 }, { 1, 7 } };
+		auto fields = stringSplit( cron_, ' ' );
+		if ( fields.size() != 5 ) {
+			throw std::runtime_error( "invalid number of cron fields" );
+		}
+		for ( unsigned int field = 0; field <= 4; field++ ) {
+
+			// Determine the values that are valid for each field by parsing the field and setting the bits for each
+			// valid value.
+			std::vector<std::string> subexpressions;
+			if ( fields[field].find( "," ) != std::string::npos ) {
+				subexpressions = stringSplit( fields[field], ',' );
+			} else {
+				subexpressions.push_back( fields[field] );
+			}
+
+			for ( auto& subexpression : subexpressions ) {
+				unsigned int start = extremes[field].first;
+				unsigned int end = extremes[field].second;
+				unsigned int modulo = 0;
+
+				if ( subexpression.find( "/" ) != std::string::npos ) {
+					auto parts = stringSplit( subexpression, '/' );
+					if ( parts.size() != 2 ) {
+						throw std::runtime_error( "invalid cron field devider" );
 					}
+					modulo = std::stoi( parts[1] );
+					subexpression = parts[0];
 				}
 
-				if ( run ) {
-
-					// First run the scripts that are associated with this timer.
-					json data = (*timerIt);
-					auto scripts = g_database->getQuery(
-						"SELECT s.`id`, s.`name`, s.`code` "
-						"FROM `x_timer_scripts` x, `scripts` s "
-						"WHERE x.`script_id`=s.`id` "
-						"AND x.`timer_id`=%q "
-						"AND s.`enabled`=1 "
-						"ORDER BY s.`id` ASC",
-						(*timerIt)["id"].c_str()
-					);
-					if ( scripts.size() > 0 ) {
-						this->_runScripts( "timer", data, scripts );
+				if ( subexpression.find( "-" ) != std::string::npos ) {
+					auto parts = stringSplit( subexpression, '-' );
+					if ( parts.size() != 2 ) {
+						throw std::runtime_error( "invalid cron field range" );
 					}
+					start = std::stoi( parts[0] );
+					end = std::stoi( parts[1] );
+				} else if (
+					subexpression != "*"
+					&& modulo == 0
+				) {
+					start = std::stoi( subexpression );
+					end = start;
+				}
 
-					// Then update the devices that are associated with this timer.
-					auto devices = g_database->getQuery(
-						"SELECT x.`device_id`, x.`value` "
-						"FROM `x_timer_devices` x, `devices` d "
-						"WHERE x.`device_id`=d.`id` "
-						"AND x.`timer_id`=%q "
-						"AND d.`enabled`=1 "
-						"ORDER BY d.`id` ASC",
-						(*timerIt)["id"].c_str()
-					);
-					if ( devices.size() > 0 ) {
-						for ( auto devicesIt = devices.begin(); devicesIt != devices.end(); devicesIt++ ) {
-							auto device = this->getDeviceById( std::stoi( (*devicesIt)["device_id"] ) );
-							if ( device ) {
-								TaskOptions options = { 0, 0, 1, 0, false, false };
-								switch( device->getType() ) {
-									case Device::Type::COUNTER:
-										this->_processTask<Counter>( std::static_pointer_cast<Counter>( device ), std::stoi( (*devicesIt)["value"] ), Device::UpdateSource::TIMER, options );
-										break;
-									case Device::Type::LEVEL:
-										this->_processTask<Level>( std::static_pointer_cast<Level>( device ), std::stod( (*devicesIt)["value"] ), Device::UpdateSource::TIMER, options );
-										break;
-									case Device::Type::SWITCH:
-										this->_processTask<Switch>( std::static_pointer_cast<Switch>( device ), (*devicesIt)["value"], Device::UpdateSource::TIMER, options );
-										break;
-									case Device::Type::TEXT:
-										this->_processTask<Text>( std::static_pointer_cast<Text>( device ), (*devicesIt)["value"], Device::UpdateSource::TIMER, options );
-										break;
-								}
+				// NOTE a day of week of 0 is accepted as an alternative for sunday (7).
+				if (
+					( start < extremes[field].first && ! ( field == 4 && start == 0 ) )
+					|| end > extremes[field].second
+				) {
+					throw std::runtime_error( "invalid cron field value" );
+				}
+
+				for ( unsigned int index = start; index <= end; index++ ) {
+					if ( modulo > 0 ) {
+						unsigned int remainder = index % modulo;
+						if ( subexpression == "*" ) {
+							if ( 0 != remainder ) {
+								continue;
 							}
+						} else if ( remainder != (unsigned int)std::stoi( subexpression ) ) {
+							continue;
 						}
 					}
+					switch( field ) {
+						case 0: result.minutes.set( index ); break;
+						case 1: result.hours.set( index ); break;
+						case 2: result.days.set( index ); break;
+						case 3: result.months.set( index ); break;
+						case 4: result.weekdays.set( index == 0 ? 7 : index ); break;
+					}
 				}
+			}
+		}
 
-			} catch( std::exception ex_ ) {
+		return result;
+	};
 
-				// Something went wrong while parsing the cron string. The timer is marked as disabled.
-				Logger::logr( Logger::LogLevel::ERROR, this, "Invalid cron for timer %s (%s).", (*timerIt).at( "name" ).c_str(), ex_.what() );
-				g_database->putQuery(
-					"UPDATE `timers` "
-					"SET `enabled`=0 "
-					"WHERE `id`=%q",
-					(*timerIt).at( "id" ).c_str()
-				);
+	system_clock::time_point Controller::_nextCronTime( const t_cron& cron_, const system_clock::time_point& after_ ) const {
+		// The search starts at the first whole minute after the supplied time. Instead of checking every minute, the
+		// largest field that doesn't match is advanced and all smaller fields are reset. The mktime function is used
+		// to normalize the time after each step, which also takes care of daylight saving time.
+		time_t time = system_clock::to_time_t( after_ );
+		struct tm local;
+		localtime_r( &time, &local );
+		local.tm_sec = 0;
+		local.tm_min += 1;
+		local.tm_isdst = -1;
+		time = mktime( &local );
+
+		// NOTE the limit prevents an endless loop for expressions that will never match, such as the 31st of
+		// february. It allows for a search of roughly 250 years ahead.
+		for ( unsigned int iteration = 0; iteration < 100000; iteration++ ) {
+			if ( ! cron_.months[local.tm_mon + 1] ) {
+				local.tm_mon++;
+				local.tm_mday = 1;
+				local.tm_hour = 0;
+				local.tm_min = 0;
+			} else if (
+				! cron_.days[local.tm_mday]
+				|| ! cron_.weekdays[local.tm_wday == 0 ? 7 : local.tm_wday]
+			) {
+				local.tm_mday++;
+				local.tm_hour = 0;
+				local.tm_min = 0;
+			} else if ( ! cron_.hours[local.tm_hour] ) {
+				local.tm_hour++;
+				local.tm_min = 0;
+			} else if ( ! cron_.minutes[local.tm_min] ) {
+				local.tm_min++;
+			} else {
+				return system_clock::from_time_t( time );
 			}
+			local.tm_isdst = -1;
+			time = mktime( &local );
 		}
+		throw std::runtime_error( "no matching time" );
 	};
 
-	void Controller::_runLinks( std::shared_ptr<Device> device_ ) {
+	void Controller::_runLinks( std::shared_ptr<Device> device_, const std::string& value_ ) {
 
 		// Action links are only supported for switch-type devices. Other devices CAN be linked but cannot perform
 		// any target actions.
 		if ( device_->getType() == Device::Type::SWITCH ) {
-			auto device = std::static_pointer_cast<Switch>( device_ );
-			auto links = g_database->getQuery(
-				"SELECT `target_device_id`, `target_value`, `after`, `for`, `clear` "
-				"FROM `links` "
-				"WHERE `device_id`=%d "
-				"AND `target_device_id` IS NOT NULL "
-				"AND ( `value`=%Q OR `value` IS NULL ) "
-				"AND `enabled`=1 "
-				"ORDER BY `id`",
-				device->getId(),
-				device->getValue().c_str()
-			);
+			auto links = this->_getLinkRoutes( device_->getId() );
+			if ( links.size() == 0 ) {
+				return;
+			}
 
 			for ( auto linksIt = links.begin(); linksIt != links.end(); linksIt++ ) {
-				auto targetDevice = std::static_pointer_cast<Switch>( this->getDeviceById( std::stoi( (*linksIt)["target_device_id"] ) ) );
+				if (
+					! (*linksIt).anyValue
+					&& (*linksIt).value != value_
+				) {
+					continue;
+				}
+				auto targetDevice = std::static_pointer_cast<Switch>( this->getDeviceById( (*linksIt).targetDeviceId ) );
 				if ( targetDevice ) {
-					TaskOptions options = { 0, 0, 1, 0, false, false };
-					if ( (*linksIt)["after"].size() > 0 ) {
-						options.afterSec = std::stod( (*linksIt)["after"] );
-					}
-					if ( (*linksIt)["for"].size() > 0 ) {
-						options.forSec = std::stod( (*linksIt)["for"] );
-					}
-					if ( (*linksIt)["clear"].size() > 0 ) {
-						options.clear = std::stoi( (*linksIt)["clear"] ) > 0;
-					}
-					std::string targetValue = (*linksIt)["target_value"];
+					std::string targetValue = (*linksIt).targetValue;
 					if ( targetValue.size() == 0 ) {
-						targetValue = device->getValue();
+						targetValue = value_;
 					}
-					this->_processTask<Switch>( targetDevice, targetValue, Device::UpdateSource::LINK, options );
+					this->_processTask<Switch>( targetDevice, targetValue, Device::UpdateSource::LINK, (*linksIt).options );
 				}
 			}
 		}
 	};
 
+	std::vector<std::map<std::string, std::string>> Controller::_getScriptRoutes( const unsigned int& deviceId_ ) {
+		// NOTE a copy of the routes is returned because running the scripts can result in new events which need to
+		// access the routes again.
+		std::lock_guard<std::mutex> lock( this->m_routesMutex );
+		if ( ! this->m_scriptRoutesLoaded ) {
+			this->_loadScriptRoutes( -1 );
+		}
+		auto find = this->m_scriptRoutes.find( deviceId_ );
+		if ( find != this->m_scriptRoutes.end() ) {
+			return find->second;
+		}
+		return {};
+	};
+
+	std::vector<Controller::t_linkRoute> Controller::_getLinkRoutes( const unsigned int& deviceId_ ) {
+		std::lock_guard<std::mutex> lock( this->m_routesMutex );
+		if ( ! this->m_linkRoutesLoaded ) {
+			this->_loadLinkRoutes( -1 );
+		}
+		auto find = this->m_linkRoutes.find( deviceId_ );
+		if ( find != this->m_linkRoutes.end() ) {
+			return find->second;
+		}
+		return {};
+	};
+
+	void Controller::_loadScriptRoutes( const int& deviceId_ ) {
+		// NOTE Only call this method with held lock on routes mutex. A negative device id loads the routes for all
+		// devices at once.
+		std::vector<std::map<std::string, std::string>> scripts;
+		if ( deviceId_ < 0 ) {
+			this->m_scriptRoutes.clear();
+			scripts = g_database->getQuery(
+				"SELECT x.`device_id`, s.`id`, s.`name`, s.`code` "
+				"FROM `scripts` s, `x_device_scripts` x "
+				"WHERE x.`script_id`=s.`id` "
+				"AND s.`enabled`=1 "
+				"ORDER BY s.`id` ASC"
+			);
+			this->m_scriptRoutesLoaded = true;
+		} else {
+			this->m_scriptRoutes.erase( deviceId_ );
+			scripts = g_database->getQuery(
+				"SELECT x.`device_id`, s.`id`, s.`name`, s.`code` "
+				"FROM `scripts` s, `x_device_scripts` x "
+				"WHERE x.`script_id`=s.`id` "
+				"AND x.`device_id`=%d "
+				"AND s.`enabled`=1 "
+				"ORDER BY s.`id` ASC",
+				deviceId_
+			);
+		}
+		for ( auto& script : scripts ) {
+			unsigned int deviceId = std::stoi( script["device_id"] );
+			script.erase( "device_id" );
+			this->m_scriptRoutes[deviceId].push_back( script );
+		}
+	};
+
+	void Controller::_loadLinkRoutes( const int& deviceId_ ) {
+		// NOTE Only call this method with held lock on routes mutex. A negative device id loads the routes for all
+		// devices at once. The task options are parsed here so they don't need to be parsed for every event.
+		std::vector<std::map<std::string, std::string>> links;
+		if ( deviceId_ < 0 ) {
+			this->m_linkRoutes.clear();
+			links = g_database->getQuery(
+				"SELECT `device_id`, `target_device_id`, `value`, `target_value`, `after`, `for`, `clear` "
+				"FROM `links` "
+				"WHERE `target_device_id` IS NOT NULL "
+				"AND `enabled`=1 "
+				"ORDER BY `id`"
+			);
+			this->m_linkRoutesLoaded = true;
+		} else {
+			this->m_linkRoutes.erase( deviceId_ );
+			links = g_database->getQuery(
+				"SELECT `device_id`, `target_device_id`, `value`, `target_value`, `after`, `for`, `clear` "
+				"FROM `links` "
+				"WHERE `device_id`=%d "
+				"AND `target_device_id` IS NOT NULL "
+				"AND `enabled`=1 "
+				"ORDER BY `id`",
+				deviceId_
+			);
+		}
+		for ( auto& link : links ) {
+			t_linkRoute route;
+			route.targetDeviceId = std::stoi( link["target_device_id"] );
+			route.anyValue = ( link["value"].size() == 0 );
+			route.value = link["value"];
+			route.targetValue = link["target_value"];
+			route.options = { 0, 0, 1, 0, false, false };
+			if ( link["after"].size() > 0 ) {
+				route.options.afterSec = std::stod( link["after"] );
+			}
+			if ( link["for"].size() > 0 ) {
+				route.options.forSec = std::stod( link["for"] );
+			}
+			if ( link["clear"].size() > 0 ) {
+				route.options.clear = std::stoi( link["clear"] ) > 0;
+			}
+			this->m_linkRoutes[std::stoi( link["device_id"] )].push_back( route );
+		}
+	};
+
 	Controller::TaskOptions Controller::_parseTaskOptions( const std::string& options_ ) const {
 		int lastTokenType = 0;
 		TaskOptions result = { 0, 0, 1, 0, false, false };
@@ -1063,19 +2151,29 @@ namespace micasa {
 	template void Controller::_js_updateDevice( const std::shared_ptr<Switch> device_, const typename Switch::t_value& value_, const std::string& options_ );
 	template void Controller::_js_updateDevice( const std::shared_ptr<Text> device_, const typename Text::t_value& value_, const std::string& options_ );
 
-	bool Controller::_js_include( const std::string& name_, std::string& script_ ) {
-		// This is done without a lock because it is called from a script that is executed while holding the lock.
+	std::shared_ptr<const std::string> Controller::_js_include( const std::string& name_ ) {
+		std::lock_guard<std::mutex> lock( this->m_compiledScriptsMutex );
+		auto find = this->m_includes.find( name_ );
+		if ( find != this->m_includes.end() ) {
+			auto compiled = this->m_compiledScripts.find( find->second );
+			if ( compiled != this->m_compiledScripts.end() ) {
+				return compiled->second.code;
+			}
+		}
+
 		try {
-			script_ = g_database->getQueryValue<std::string>(
-				"SELECT `code` "
+			auto script = g_database->getQueryRow(
+				"SELECT `id`, `code` "
 				"FROM `scripts` "
 				"WHERE `name`=%Q "
 				"AND `enabled`=1",
 				name_.c_str()
 			);
-			return true;
+			unsigned int scriptId = std::stoi( script["id"] );
+			this->m_includes[name_] = scriptId;
+			return this->_compileScript( scriptId, script["code"] );
 		} catch( const Database::NoResultsException& ex_ ) {
-			return false;
+			return nullptr;
 		}
 	};
 
@@ -6,6 +6,12 @@
 #include <unordered_map>
 #include <iostream>
 #include <list>
+#include <functional>
+#include <bitset>
+#include <deque>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
 
 #include "Plugin.h"
 #include "Settings.h"
@@ -23,6 +29,21 @@
 #endif // _WITH_LIBUDEV
 
 #define CONTROLLER_SETTING_USERDATA "_userdata"
+#define CONTROLLER_SETTING_SCRIPT_TIME_LIMIT_MSEC "_script_time_limit_msec"
+#define CONTROLLER_SETTING_SCRIPT_HEAP_LIMIT_BYTES "_script_heap_limit_bytes"
+
+#define CONTROLLER_SCRIPT_DEFAULT_TIME_LIMIT_MSEC 5000
+#define CONTROLLER_SCRIPT_DEFAULT_HEAP_LIMIT_BYTES 16 * 1024 * 1024
+#define CONTROLLER_SCRIPT_RETIRED_MAX_BYTES 1024 * 1024
+
+#define CONTROLLER_SETTING_EVENT_QUEUE_SIZE "_event_queue_size"
+#define CONTROLLER_SETTING_EVENT_QUEUE_POLICY_PREFIX "_event_queue_policy_"
+#define CONTROLLER_SETTING_EVENT_QUEUE_OVERLOAD_PERCENTAGE "_event_queue_overload_percentage"
+
+#define CONTROLLER_EVENT_QUEUE_DEFAULT_SIZE 1024
+#define CONTROLLER_EVENT_QUEUE_DEFAULT_OVERLOAD_PERCENTAGE 50
+
+#define CONTROLLER_CHANGELOG_SIZE 1024
 
 extern "C" {
 	#include "v7.h"
@@ -55,7 +76,15 @@ namespace micasa {
 			bool recur;
 		}; // struct TaskOptions
 
-		Controller();
+		enum class EventQueuePolicy: unsigned short {
+			BLOCK       = 1,
+			DROP_OLDEST = 2,
+			DROP_NEWEST = 3
+		}; // enum EventQueuePolicy
+		static const std::map<EventQueuePolicy, std::string> EventQueuePolicyText;
+		ENUM_UTIL_W_TEXT( EventQueuePolicy, EventQueuePolicyText );
+
+		Controller( const unsigned int scriptContexts_ );
 		~Controller();
 
 		Controller( const Controller& ) = delete; // do not copy
@@ -69,6 +98,7 @@ namespace micasa {
 		std::shared_ptr<Plugin> getPlugin( const std::string& reference_ ) const;
 		std::shared_ptr<Plugin> getPluginById( const unsigned int& id_ ) const;
 		std::vector<std::shared_ptr<Plugin>> getAllPlugins() const;
+		std::vector<std::shared_ptr<Plugin>> getChildPlugins( std::shared_ptr<const Plugin> parent_ ) const;
 		std::shared_ptr<Plugin> declarePlugin( const Plugin::Type type_, const std::string reference_, const std::vector<Setting>& settings_, bool enabled_ );
 		std::shared_ptr<Plugin> declarePlugin( const Plugin::Type type_, const std::string reference_, const std::shared_ptr<Plugin> parent_, const std::vector<Setting>& settings_, bool enabled_ );
 		void removePlugin( const std::shared_ptr<Plugin> plugin_ );
@@ -78,10 +108,31 @@ namespace micasa {
 		std::shared_ptr<Device> getDeviceByName( const std::string& name_ ) const;
 		std::shared_ptr<Device> getDeviceByLabel( const std::string& label_ ) const;
 		std::vector<std::shared_ptr<Device>> getAllDevices() const;
+		void indexDevice( std::shared_ptr<Device> device_ );
+		void unindexDevice( std::shared_ptr<Device> device_ );
+		void subscribeDevice( std::shared_ptr<Plugin> plugin_, const unsigned int& deviceId_ );
+		void unsubscribeDevice( std::shared_ptr<Plugin> plugin_, const unsigned int& deviceId_ );
+		std::vector<std::shared_ptr<Plugin>> getDevicePlugins( std::shared_ptr<const Device> device_ ) const;
 		bool isScheduled( std::shared_ptr<const Device> device_ ) const;
 		std::chrono::seconds nextSchedule( std::shared_ptr<const Device> device_ ) const;
 
 		template<class D> void newEvent( std::shared_ptr<D> device_, const Device::UpdateSource& source_ );
+		void invalidateScriptRoutes( const int& deviceId_ = -1 );
+		void invalidateLinkRoutes( const int& deviceId_ = -1 );
+		void invalidateTimers( const int& scriptId_ = -1 );
+		void invalidateScript( const unsigned int& scriptId_ );
+		nlohmann::json getScriptStatistics( const unsigned int& scriptId_ ) const;
+		nlohmann::json getEventQueueJson() const;
+		void addStartupTiming( const std::string& phase_, const std::string& name_, const std::chrono::steady_clock::time_point& begin_, const unsigned int& pluginId_ = 0 );
+		nlohmann::json getStartupJson() const;
+		bool isOverloaded() const;
+		void invalidateDeviceJson() { this->m_deviceJsonVersion++; };
+		unsigned long getDeviceJsonVersion() const { return this->m_deviceJsonVersion; };
+		unsigned long getVersion() const;
+		unsigned long long recordDeviceChange( const unsigned int& deviceId_, bool removed_ = false );
+		unsigned long long getDeviceSequence( const unsigned int& deviceId_ ) const;
+		unsigned long long getSequence() const;
+		bool getDeviceChanges( const unsigned long long& since_, std::vector<unsigned int>& changed_, std::vector<unsigned int>& removed_ ) const;
 
 #ifdef _WITH_LIBUDEV
 		void addSerialPortCallback( const std::string& name_, const t_serialPortCallback& callback_ );
@@ -89,12 +140,153 @@ namespace micasa {
 #endif // _WITH_LIBUDEV
 
 	private:
+		struct t_linkRoute {
+			unsigned int targetDeviceId;
+			bool anyValue;
+			std::string value;
+			std::string targetValue;
+			TaskOptions options;
+		}; // struct t_linkRoute
+
+		struct t_index {
+			unsigned long version;
+			std::vector<std::shared_ptr<Plugin>> plugins;
+			std::unordered_map<std::string, std::shared_ptr<Plugin>> pluginsByReference;
+			std::unordered_map<unsigned int, std::shared_ptr<Plugin>> pluginsById;
+			std::unordered_map<unsigned int, std::vector<std::shared_ptr<Plugin>>> childrenByPluginId;
+			std::unordered_map<unsigned int, std::shared_ptr<Device>> devicesById;
+			std::unordered_multimap<std::string, std::shared_ptr<Device>> devicesByName;
+			std::unordered_multimap<std::string, std::shared_ptr<Device>> devicesByLabel;
+			std::unordered_map<unsigned int, std::pair<std::string, std::string>> deviceKeys;
+			std::unordered_map<unsigned int, std::vector<std::shared_ptr<Plugin>>> subscribersByDeviceId;
+		}; // struct t_index
+
+		struct t_cron {
+			std::bitset<60> minutes;
+			std::bitset<24> hours;
+			std::bitset<32> days;
+			std::bitset<13> months;
+			std::bitset<8> weekdays;
+		}; // struct t_cron
+
+		struct t_timer {
+			unsigned int id;
+			std::string name;
+			nlohmann::json data;
+			t_cron cron;
+			std::vector<std::map<std::string, std::string>> scripts;
+			std::vector<std::pair<unsigned int, std::string>> devices;
+			bool active;
+		}; // struct t_timer
+
+		struct t_scriptJob {
+			std::string key;
+			nlohmann::json data;
+			std::vector<std::map<std::string, std::string>> scripts;
+			unsigned int deviceId;
+		}; // struct t_scriptJob
+
+		struct t_compiledScript {
+			size_t hash;
+			std::shared_ptr<const std::string> code;
+		}; // struct t_compiledScript
+
+		struct t_retiredScript {
+			unsigned long generation; // the newest context generation that might reference the script
+			std::shared_ptr<const std::string> code;
+		}; // struct t_retiredScript
+
+		struct t_event {
+			std::shared_ptr<Device> device;
+			Device::UpdateSource source;
+			nlohmann::json value;
+			nlohmann::json formatted;
+			unsigned long long sequence;
+			std::chrono::steady_clock::time_point queued;
+		}; // struct t_event
+
+		struct t_eventStage {
+			std::string name;
+			EventQueuePolicy policy;
+			std::function<void( const t_event& event_ )> func;
+			std::deque<std::shared_ptr<const t_event>> events;
+			bool processing;
+			std::thread::id consumer;
+			unsigned long processed;
+			unsigned long dropped;
+			std::chrono::microseconds totalLag;
+			std::chrono::microseconds maxLag;
+		}; // struct t_eventStage
+
+		struct t_startupTiming {
+			std::string phase;
+			std::string name;
+			unsigned int pluginId;
+			std::chrono::steady_clock::time_point begin;
+			std::chrono::steady_clock::time_point end;
+		}; // struct t_startupTiming
+
+		struct t_scriptStatistics {
+			unsigned long invocations;
+			std::chrono::microseconds totalTime;
+			std::chrono::microseconds maxTime;
+			long maxHeapGrowth;
+		}; // struct t_scriptStatistics
+
+		struct t_change {
+			unsigned long long sequence;
+			unsigned int deviceId;
+			bool removed;
+		}; // struct t_change
+
 		volatile bool m_running;
-		std::unordered_map<std::string, std::shared_ptr<Plugin>> m_plugins;
-		mutable std::recursive_mutex m_pluginsMutex;
+		std::mutex m_pluginsMutex;
+		std::shared_ptr<const t_index> m_index;
+		mutable std::mutex m_indexMutex;
 		Scheduler m_scheduler;
-		v7* m_v7_js;
+		std::vector<v7*> m_jsContexts;
+		std::vector<v7*> m_jsIdleContexts;
 		mutable std::mutex m_jsMutex;
+		std::condition_variable m_jsCondition;
+		std::unordered_map<v7*, unsigned long> m_jsGenerations;
+		std::atomic<unsigned long> m_jsGeneration;
+		std::map<std::string, std::deque<t_scriptJob>> m_scriptQueues;
+		size_t m_scriptJobs;
+		mutable std::mutex m_scriptQueuesMutex;
+		std::condition_variable m_scriptQueuesCondition;
+		nlohmann::json m_userData;
+		mutable std::mutex m_userDataMutex;
+		std::unordered_map<unsigned int, t_compiledScript> m_compiledScripts;
+		std::unordered_map<std::string, unsigned int> m_includes;
+		std::vector<t_retiredScript> m_retiredScripts;
+		size_t m_retiredScriptsSize;
+		mutable std::mutex m_compiledScriptsMutex;
+		unsigned long m_scriptTimeLimit;
+		long m_scriptHeapLimit;
+		std::unordered_map<unsigned int, t_scriptStatistics> m_scriptStatistics;
+		mutable std::mutex m_scriptStatisticsMutex;
+		std::unordered_map<unsigned int, std::vector<std::map<std::string, std::string>>> m_scriptRoutes;
+		std::unordered_map<unsigned int, std::vector<t_linkRoute>> m_linkRoutes;
+		bool m_scriptRoutesLoaded;
+		bool m_linkRoutesLoaded;
+		std::atomic<unsigned long> m_deviceJsonVersion;
+		mutable std::mutex m_routesMutex;
+		std::vector<std::shared_ptr<t_timer>> m_timers;
+		mutable std::mutex m_timersMutex;
+		std::vector<t_eventStage> m_eventStages;
+		size_t m_eventQueueSize;
+		size_t m_eventQueueOverloadDepth;
+		mutable std::mutex m_eventsMutex;
+		std::condition_variable m_eventsCondition;
+		std::vector<t_startupTiming> m_startupTimings;
+		unsigned int m_startupPending;
+		mutable std::mutex m_startupMutex;
+		unsigned long long m_sequence;
+		const unsigned long long m_sequenceStart;
+		unsigned long long m_changelogFloor;
+		std::deque<t_change> m_changelog;
+		std::unordered_map<unsigned int, unsigned long long> m_deviceSequences;
+		mutable std::mutex m_changelogMutex;
 
 #ifdef _WITH_LIBUDEV
 		std::map<std::string, t_serialPortCallback> m_serialPortCallbacks;
@@ -104,14 +296,35 @@ namespace micasa {
 		std::thread m_udevWorker;
 #endif // _WITH_LIBUDEV
 
+		void _updateIndex( const std::function<void( t_index& index_ )>& func_ );
+		void _indexPlugin( t_index& index_, std::shared_ptr<Plugin> plugin_ ) const;
+		void _unindexPlugin( t_index& index_, std::shared_ptr<Plugin> plugin_ ) const;
+		void _indexDevice( t_index& index_, std::shared_ptr<Device> device_ ) const;
+		void _unindexDevice( t_index& index_, std::shared_ptr<Device> device_ ) const;
 		template<class D> void _processTask( std::shared_ptr<D> device_, const typename D::t_value value_, const Device::UpdateSource source_, const TaskOptions options_ );
-		void _runScripts( const std::string key_, const nlohmann::json data_, const std::vector<std::map<std::string, std::string>> scripts_ );
-		void _runTimers();
-		void _runLinks( std::shared_ptr<Device> device_ );
+		void _logStartup() const;
+		void _queueEvent( std::shared_ptr<const t_event> event_ );
+		void _addEventStage( const std::string& name_, const EventQueuePolicy& policy_, std::function<void( const t_event& event_ )>&& func_ );
+		void _runScripts( const std::string key_, const nlohmann::json data_, const std::vector<std::map<std::string, std::string>> scripts_, const std::string& queue_, const unsigned int& deviceId_ = 0 );
+		void _executeScripts( const t_scriptJob& job_ );
+		v7* _createScriptContext();
+		v7* _replaceScriptContext( v7* context_ );
+		void _retireScript( std::shared_ptr<const std::string> code_ );
+		std::shared_ptr<const std::string> _getCompiledScript( const unsigned int& scriptId_, const std::string& code_ );
+		std::shared_ptr<const std::string> _compileScript( const unsigned int& scriptId_, const std::string& code_ );
+		void _scheduleTimer( std::shared_ptr<t_timer> timer_ );
+		void _runTimer( std::shared_ptr<t_timer> timer_ );
+		t_cron _compileCron( const std::string& cron_ ) const;
+		std::chrono::system_clock::time_point _nextCronTime( const t_cron& cron_, const std::chrono::system_clock::time_point& after_ ) const;
+		void _runLinks( std::shared_ptr<Device> device_, const std::string& value_ );
+		std::vector<std::map<std::string, std::string>> _getScriptRoutes( const unsigned int& deviceId_ );
+		std::vector<t_linkRoute> _getLinkRoutes( const unsigned int& deviceId_ );
+		void _loadScriptRoutes( const int& deviceId_ );
+		void _loadLinkRoutes( const int& deviceId_ );
 		TaskOptions _parseTaskOptions( const std::string& options_ ) const;
 
 		template<class D> void _js_updateDevice( const std::shared_ptr<D> device_, const typename D::t_value& value_, const std::string& options_ = "" );
-		bool _js_include( const std::string& name_, std::string& script_ );
+		std::shared_ptr<const std::string> _js_include( const std::string& name_ );
 
 	}; // class Controller
 
@@ -69,35 +69,8 @@ namespace micasa {
 		va_list arguments;
 		va_start( arguments, query_ );
 		this->_wrapQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
-			int columns = sqlite3_column_count( statement_ );
-			while ( true ) {
-				if ( SQLITE_ROW == sqlite3_step( statement_ ) ) {
-					json row = json::object();
-					for ( int column = 0; column < columns; column++ ) {
-						std::string key = std::string( reinterpret_cast<const char*>( sqlite3_column_name( statement_, column ) ) );
-						switch( sqlite3_column_type( statement_, column ) ) {
-							case SQLITE_INTEGER:
-								row[key] = sqlite3_column_int( statement_, column );
-								break;
-							case SQLITE_FLOAT:
-								row[key] = sqlite3_column_double( statement_, column );
-								break;
-							case SQLITE_TEXT: {
-								const unsigned char* value = sqlite3_column_text( statement_, column );
-								row[key] = std::string( reinterpret_cast<const char*>( value ) );
-								break;
-							}
-							case SQLITE_BLOB:
-								// not supported (yet?)
-								break;
-							case SQLITE_NULL:
-								break;
-						}
-					}
-					result += row;
-				} else {
-					break;
-				}
+			while ( SQLITE_ROW == sqlite3_step( statement_ ) ) {
+				result += Database::_getJsonRow( statement_ );
 			}
 		} );
 		va_end( arguments );
@@ -105,6 +78,20 @@ namespace micasa {
 		return result;
 	};
 
+	void Database::getQueryPages( const std::function<nlohmann::json()>& page_, const std::function<void( const nlohmann::json& row_ )>& process_ ) const {
+		// NOTE large results are read in pages of at most DATABASE_ROWS_PAGE_SIZE rows. Each page is read by it's own
+		// statement which is finalized before the rows are handed to the supplied function, so a slow consumer doesn't
+		// keep a read transaction open on the connection. The page function should continue after the last row of the
+		// previous page by key rather than by offset.
+		json rows;
+		do {
+			rows = page_();
+			for ( auto const& row : rows ) {
+				process_( row );
+			}
+		} while ( rows.size() == DATABASE_ROWS_PAGE_SIZE );
+	};
+
 	std::map<std::string, std::string> Database::getQueryRow( const std::string query_, ... ) const {
 		std::map<std::string, std::string> result;
 
@@ -354,6 +341,33 @@ namespace micasa {
 		}
 	};
 
+	json Database::_getJsonRow( sqlite3_stmt* statement_ ) {
+		json row = json::object();
+		int columns = sqlite3_column_count( statement_ );
+		for ( int column = 0; column < columns; column++ ) {
+			std::string key = std::string( reinterpret_cast<const char*>( sqlite3_column_name( statement_, column ) ) );
+			switch( sqlite3_column_type( statement_, column ) ) {
+				case SQLITE_INTEGER:
+					row[key] = sqlite3_column_int( statement_, column );
+					break;
+				case SQLITE_FLOAT:
+					row[key] = sqlite3_column_double( statement_, column );
+					break;
+				case SQLITE_TEXT: {
+					const unsigned char* value = sqlite3_column_text( statement_, column );
+					row[key] = std::string( reinterpret_cast<const char*>( value ) );
+					break;
+				}
+				case SQLITE_BLOB:
+					// not supported (yet?)
+					break;
+				case SQLITE_NULL:
+					break;
+			}
+		}
+		return row;
+	};
+
 	void Database::_wrapQuery( const std::string& query_, va_list arguments_, const std::function<void(sqlite3_stmt*)>&& process_ ) const {
 		if ( ! this->m_connection ) {
 			Logger::log( Logger::LogLevel::ERROR, this, "Database not open." );
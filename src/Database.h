@@ -3,11 +3,14 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <functional>
 
 #include <sqlite3.h>
 
 #include "json.hpp"
 
+#define DATABASE_ROWS_PAGE_SIZE 1024
+
 namespace micasa {
 
 	class Database final {
@@ -42,6 +45,7 @@ namespace micasa {
 		template<typename T> std::vector<T> getQueryColumn( const std::string query_, ... ) const;
 		std::map<std::string, std::string> getQueryMap( const std::string query_, ... ) const ;
 		template<typename T> T getQueryValue( const std::string query_, ... ) const;
+		void getQueryPages( const std::function<nlohmann::json()>& page_, const std::function<void( const nlohmann::json& row_ )>& process_ ) const;
 		long putQuery( const std::string query_, ... ) const;
 		int getLastErrorCode() const;
 
@@ -50,6 +54,7 @@ namespace micasa {
 		mutable unsigned long long m_queries;
 
 		void _init() const;
+		static nlohmann::json _getJsonRow( sqlite3_stmt* statement_ );
 		void _wrapQuery( const std::string& query_, va_list arguments_, const std::function<void(sqlite3_stmt*)>&& process_ ) const;
 
 	}; // class Database
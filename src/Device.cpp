@@ -1,4 +1,5 @@
 #include <sstream>
+#include <algorithm>
 
 #include "Device.h"
 
@@ -33,7 +34,13 @@ namespace micasa {
 		m_id( id_ ),
 		m_reference( reference_ ),
 		m_enabled( enabled_ ),
-		m_label( label_ )
+		m_label( label_ ),
+		m_coalesced( 0 ),
+		m_updated( std::chrono::system_clock::now() ),
+		m_version( 0 ),
+		m_jsonVersion( 0 ),
+		m_rateWindow( std::chrono::steady_clock::now() ),
+		m_rateCount( 0 )
 	{
 #ifdef _DEBUG
 		assert( g_controller && "Global Controller instance should be created before Device instances." );
@@ -60,12 +67,14 @@ namespace micasa {
 	void Device::setLabel( const std::string& label_ ) {
 		if ( label_ != this->m_label ) {
 			this->m_label = label_;
+			this->_changed();
 			g_database->putQuery(
 				"UPDATE `devices` "
 				"SET `label`=%Q "
 				"WHERE `id`=%d"
 				, label_.c_str(), this->m_id
 			);
+			g_controller->indexDevice( this->shared_from_this() );
 		}
 	};
 
@@ -119,7 +128,101 @@ namespace micasa {
 		return nullptr;
 	};
 
-	json Device::getJson() const {
+	std::string Device::getSubType() const {
+		return this->m_settings->get( "subtype", this->m_settings->get( DEVICE_SETTING_DEFAULT_SUBTYPE, "generic" ) );
+	};
+
+	json Device::getJson( const std::vector<std::string>& fields_ ) const {
+		auto requested = [&]( const std::string& field_ ) -> bool {
+			return fields_.empty() || std::find( fields_.begin(), fields_.end(), field_ ) != fields_.end();
+		};
+
+		// Fields that can be read straight from the device are rendered directly if no other fields are requested,
+		// which avoids rendering the full json of devices that aren't cached yet.
+		static const std::vector<std::string> direct = { "id", "label", "name", "enabled", "plugin", "plugin_id", "type", "scheduled", "next_schedule", "age", "coalesced", "sequence" };
+		bool cached = fields_.empty();
+		for ( auto const& field : fields_ ) {
+			cached = cached || std::find( direct.begin(), direct.end(), field ) == direct.end();
+		}
+
+		json result = json::object();
+		if ( cached ) {
+			// The json of a device is cached until the device, it's settings, the settings of it's plugin or any of the
+			// other resources referenced in the json (timers, scripts and links) change. All these versions only ever
+			// increase so their sum is used as the version of the cached json. Fields that change over time are
+			// refreshed on every call.
+			unsigned long version = this->m_version + this->m_settings->getVersion() + this->getPlugin()->getSettings()->getVersion() + g_controller->getDeviceJsonVersion();
+			std::unique_lock<std::mutex> lock( this->m_jsonMutex );
+			if (
+				this->m_json.is_null()
+				|| this->m_jsonVersion != version
+			) {
+				lock.unlock();
+				json rendered = this->_getJson();
+				lock.lock();
+				this->m_json = rendered;
+				this->m_jsonVersion = version;
+			}
+			if ( fields_.empty() ) {
+				result = this->m_json;
+			} else {
+				// NOTE only the requested fields are copied out of the cached json.
+				for ( auto const& field : fields_ ) {
+					auto find = this->m_json.find( field );
+					if ( find != this->m_json.end() ) {
+						result[field] = *find;
+					}
+				}
+			}
+		} else {
+			if ( requested( "id" ) ) {
+				result["id"] = this->m_id;
+			}
+			if ( requested( "label" ) ) {
+				result["label"] = this->getLabel();
+			}
+			if ( requested( "name" ) ) {
+				result["name"] = this->getName();
+			}
+			if ( requested( "enabled" ) ) {
+				result["enabled"] = this->isEnabled();
+			}
+			if ( requested( "plugin" ) ) {
+				result["plugin"] = this->getPlugin()->getName();
+			}
+			if ( requested( "plugin_id" ) ) {
+				result["plugin_id"] = this->getPlugin()->getId();
+			}
+			if ( requested( "type" ) ) {
+				result["type"] = Device::resolveTextType( this->getType() );
+			}
+		}
+
+		if (
+			requested( "scheduled" )
+			|| requested( "next_schedule" )
+		) {
+			bool scheduled = g_controller->isScheduled( this->shared_from_this() );
+			if ( requested( "scheduled" ) ) {
+				result["scheduled"] = scheduled;
+			}
+			if ( requested( "next_schedule" ) ) {
+				result["next_schedule"] = scheduled ? g_controller->nextSchedule( this->shared_from_this() ).count() : 0;
+			}
+		}
+		if ( requested( "age" ) ) {
+			result["age"] = std::chrono::duration_cast<std::chrono::seconds>( std::chrono::system_clock::now() - this->m_updated ).count();
+		}
+		if ( requested( "coalesced" ) ) {
+			result["coalesced"] = this->getCoalesced();
+		}
+		if ( requested( "sequence" ) ) {
+			result["sequence"] = g_controller->getDeviceSequence( this->m_id );
+		}
+		return result;
+	};
+
+	json Device::_getJson() const {
 		json result = json::object();
 
 		result["id"] = this->m_id;
@@ -129,8 +232,6 @@ namespace micasa {
 		result["enabled"] = this->isEnabled();
 		result["plugin"] = this->getPlugin()->getName();
 		result["plugin_id"] = this->getPlugin()->getId();
-		result["scheduled"] = g_controller->isScheduled( this->shared_from_this() );
-		result["next_schedule"] = g_controller->nextSchedule( this->shared_from_this() ).count();
 		result["ignore_duplicates"] = this->getSettings()->get<bool>( "ignore_duplicates", false );
 		if ( this->getSettings()->contains( DEVICE_SETTING_BATTERY_LEVEL ) ) {
 			result["battery_level"] = this->getSettings()->get<unsigned int>( DEVICE_SETTING_BATTERY_LEVEL );
@@ -236,6 +337,30 @@ namespace micasa {
 
 	void Device::setEnabled( bool enabled_ ) {
 		this->m_enabled = enabled_;
+		this->_changed();
+	};
+
+	void Device::_changed() {
+		// Every change bumps the version of the cached json and is added to the changelog of the controller, which
+		// allows clients to fetch only the devices that have changed since their last sync.
+		this->m_version++;
+		g_controller->recordDeviceChange( this->m_id );
+	};
+
+	bool Device::_isOverloaded() {
+		// A device is considered overloaded if it reports more updates per second than it's configured rate, or when
+		// the controller isn't able to keep up with processing events from all devices. Overloaded devices coalesce
+		// their pending updates into a single one.
+		std::unique_lock<std::mutex> lock( this->m_rateMutex );
+		auto now = std::chrono::steady_clock::now();
+		if ( now - this->m_rateWindow >= std::chrono::seconds( 1 ) ) {
+			this->m_rateWindow = now;
+			this->m_rateCount = 0;
+		}
+		this->m_rateCount++;
+		bool overloaded = this->m_rateCount > this->m_settings->get<unsigned int>( DEVICE_SETTING_OVERLOAD_RATE, DEVICE_OVERLOAD_DEFAULT_RATE );
+		lock.unlock();
+		return overloaded || g_controller->isOverloaded();
 	};
 
 	void Device::setScripts( std::vector<unsigned int>& scriptIds_ ) {
@@ -259,6 +384,7 @@ namespace micasa {
 			this->getId(),
 			list.str().c_str()
 		);
+		this->_changed();
 	};
 
 }; // namespace micasa
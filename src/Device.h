@@ -6,6 +6,8 @@
 #include <memory>
 #include <map>
 #include <chrono>
+#include <atomic>
+#include <vector>
 
 #include "Settings.h"
 #include "Utils.h"
@@ -20,6 +22,10 @@
 #define DEVICE_SETTING_MINIMUM_USER_RIGHTS    "_minimum_user_rights"
 #define DEVICE_SETTING_BATTERY_LEVEL          "_battery_level"
 #define DEVICE_SETTING_SIGNAL_STRENGTH        "_signal_strength"
+#define DEVICE_SETTING_OVERLOAD_RATE          "_overload_rate"
+
+#define DEVICE_OVERLOAD_DEFAULT_RATE          10 // updates per second
+#define DEVICE_OVERLOAD_INTERVAL_MSEC         1000
 
 namespace micasa {
 
@@ -78,10 +84,13 @@ namespace micasa {
 		void setScripts( std::vector<unsigned int>& scriptIds_ );
 		bool isEnabled() const { return this->m_enabled; };
 		void setEnabled( bool enabled_ = true );
+		unsigned long getCoalesced() const { return this->m_coalesced; };
+		std::string getSubType() const;
+		std::chrono::system_clock::time_point getUpdated() const { return this->m_updated; };
 
 		virtual void start() = 0;
 		virtual void stop() = 0;
-		virtual nlohmann::json getJson() const;
+		nlohmann::json getJson( const std::vector<std::string>& fields_ = {} ) const;
 		virtual nlohmann::json getSettingsJson() const;
 		virtual void putSettingsJson( const nlohmann::json& settings_ );
 		virtual Type getType() const =0;
@@ -94,8 +103,22 @@ namespace micasa {
 		std::string m_label;
 		Scheduler m_scheduler;
 		std::shared_ptr<Settings<Device>> m_settings;
+		std::atomic<unsigned long> m_coalesced;
+		std::chrono::system_clock::time_point m_updated;
+		std::atomic<unsigned long> m_version;
 
 		Device( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ );
+		bool _isOverloaded();
+		void _changed();
+		virtual nlohmann::json _getJson() const;
+
+	private:
+		mutable nlohmann::json m_json;
+		mutable unsigned long m_jsonVersion;
+		mutable std::mutex m_jsonMutex;
+		std::chrono::steady_clock::time_point m_rateWindow;
+		unsigned int m_rateCount;
+		std::mutex m_rateMutex;
 
 	}; // class Device
 
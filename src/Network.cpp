@@ -1,4 +1,3 @@
-#include <regex>
 #include <sstream>
 #include <iostream>
 
@@ -20,14 +19,18 @@ namespace micasa {
 	Network::Connection::Connection( mg_connection* mg_conn_, unsigned int flags_, t_eventFunc&& func_ ) :
 		m_mg_conn( mg_conn_ ),
 		m_flags( flags_ ),
-		m_func( std::move( func_ ) )
+		m_func( std::move( func_ ) ),
+		m_queued( 0 ),
+		m_buffered( 0 )
 	{
 	};
 
 	Network::Connection::Connection( mg_connection* mg_conn_, unsigned int flags_, const t_eventFunc& func_ ) :
 		m_mg_conn( mg_conn_ ),
 		m_flags( flags_ ),
-		m_func( func_ )
+		m_func( func_ ),
+		m_queued( 0 ),
+		m_buffered( 0 )
 	{
 	};
 
@@ -53,22 +56,68 @@ namespace micasa {
 
 	void Network::Connection::serve( const std::string& root_, const std::string& index_ ) {
 		std::unique_lock<std::mutex> lock( this->m_mutex );
-		this->m_tasks.push( [this,root_,index_]() {
-			mg_serve_http_opts options;
-			memset( &options, 0, sizeof( options ) );
-			options.document_root = root_.c_str();
-			options.index_files = index_.c_str();
-			options.enable_directory_listing = "no";
-			mg_serve_http( this->m_mg_conn, &this->m_http, options );
+
+		// NOTE the message points into the request, which is held on to in case another message arrives on the same
+		// connection before the task is executed.
+		std::shared_ptr<const t_request> request = this->m_request;
+		http_message http = this->m_http;
+		this->m_tasks.push( [this,root_,index_,request,http]() mutable {
+			if ( request != nullptr ) {
+				mg_serve_http_opts options;
+				memset( &options, 0, sizeof( options ) );
+				options.document_root = root_.c_str();
+				options.index_files = index_.c_str();
+				options.enable_directory_listing = "no";
+				mg_serve_http( this->m_mg_conn, &http, options );
+			}
 		} );
 		lock.unlock();
-		std::lock_guard<std::mutex> broadcastLock( Network::Connection::s_broadcastMutex );
-		mg_broadcast( &Network::get().m_manager, micasa_mg_handler, (void*)"", 0 );
+		Network::wakeup();
 	};
 
 	void Network::Connection::reply( const std::string& data_, int code_, const std::map<std::string, std::string>& headers_, bool close_ ) {
 		std::unique_lock<std::mutex> lock( this->m_mutex );
+
+		// When called from the poll thread, for instance from an intercept function, the reply is written directly.
+		// Waking up the poll thread from the poll thread itself would deadlock.
+		if ( std::this_thread::get_id() == Network::get().m_worker.get_id() ) {
+			if ( this->m_tasks.empty() ) {
+				this->_reply( data_, code_, headers_, close_ );
+			} else {
+				this->m_tasks.push( [this,data_,code_,headers_,close_]() {
+					this->_reply( data_, code_, headers_, close_ );
+				} );
+			}
+			return;
+		}
+
 		this->m_tasks.push( [this,data_,code_,headers_,close_]() {
+			this->_reply( data_, code_, headers_, close_ );
+		} );
+		lock.unlock();
+		Network::wakeup();
+	};
+
+	void Network::Connection::send( const std::string& data_, bool wakeup_, bool binary_ ) {
+		std::unique_lock<std::mutex> lock( this->m_mutex );
+		this->m_tasks.push( [this,data_,binary_]() {
+			if ( this->m_mg_conn != nullptr ) {
+				if ( ( this->m_flags & NETWORK_CONNECTION_FLAG_SOCKET ) == NETWORK_CONNECTION_FLAG_SOCKET ) {
+					mg_send_websocket_frame( this->m_mg_conn, binary_ ? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_TEXT, data_.c_str(), data_.length() );
+				} else {
+					mg_send( this->m_mg_conn, data_.c_str(), data_.length() );
+				}
+			}
+		} );
+		lock.unlock();
+		if ( wakeup_ ) {
+			Network::wakeup();
+		}
+	};
+
+	void Network::Connection::replyChunked( int code_, const std::map<std::string, std::string>& headers_ ) {
+		std::unique_lock<std::mutex> lock( this->m_mutex );
+		this->m_tasks.push( [this,code_,headers_]() {
 			std::stringstream headers;
 			for ( auto headersIt = headers_.begin(); headersIt != headers_.end(); ) {
 				headers << headersIt->first << ": " << headersIt->second;
@@ -77,35 +126,35 @@ namespace micasa {
 				}
 			}
 			if ( this->m_mg_conn != nullptr ) {
-				mg_send_head( this->m_mg_conn, code_, data_.length(), headers.str().c_str() );
-				if ( code_ != 304 ) { // not modified
-					mg_send( this->m_mg_conn, data_.c_str(), data_.length() );
-				}
-				if ( close_ ) {
-					this->m_mg_conn->flags |= MG_F_SEND_AND_CLOSE;
-					this->m_flags |= NETWORK_CONNECTION_FLAG_CLOSE;
-				}
+				mg_send_head( this->m_mg_conn, code_, -1, headers.str().c_str() ); // -1 = chunked
 			}
 		} );
 		lock.unlock();
-		std::lock_guard<std::mutex> broadcastLock( Network::Connection::s_broadcastMutex );
-		mg_broadcast( &Network::get().m_manager, micasa_mg_handler, (void*)"", 0 );
+		Network::wakeup();
 	};
 
-	void Network::Connection::send( const std::string& data_ ) {
+	bool Network::Connection::sendChunk( const std::string& data_ ) {
+		// The caller is blocked while too much data is waiting to be send to the client, which keeps the memory used
+		// by large responses bounded. An empty chunk marks the end of the response.
 		std::unique_lock<std::mutex> lock( this->m_mutex );
+		bool ready = this->m_bufferedCondition.wait_for( lock, std::chrono::seconds( NETWORK_CONNECTION_DEFAULT_TIMEOUT_SEC ), [this]() -> bool {
+			return this->m_mg_conn == nullptr || this->m_queued + this->m_buffered < NETWORK_CONNECTION_MAX_BUFFERED_BYTES;
+		} );
+		if (
+			! ready
+			|| this->m_mg_conn == nullptr
+		) {
+			return false;
+		}
+		this->m_queued += data_.length();
 		this->m_tasks.push( [this,data_]() {
 			if ( this->m_mg_conn != nullptr ) {
-				if ( ( this->m_flags & NETWORK_CONNECTION_FLAG_SOCKET ) == NETWORK_CONNECTION_FLAG_SOCKET ) {
-					mg_send_websocket_frame( this->m_mg_conn, WEBSOCKET_OP_TEXT, data_.c_str(), data_.length() );
-				} else {
-					mg_send( this->m_mg_conn, data_.c_str(), data_.length() );
-				}
+				mg_send_http_chunk( this->m_mg_conn, data_.c_str(), data_.length() );
 			}
 		} );
 		lock.unlock();
-		std::lock_guard<std::mutex> broadcastLock( Network::Connection::s_broadcastMutex );
-		mg_broadcast( &Network::get().m_manager, micasa_mg_handler, (void*)"", 0 );
+		Network::wakeup();
+		return true;
 	};
 
 	std::string Network::Connection::getData() const {
@@ -120,82 +169,227 @@ namespace micasa {
 		return result;
 	};
 
+	bool Network::Connection::popFrame( std::string& frame_ ) {
+		std::lock_guard<std::mutex> lock( this->m_mutex );
+		if ( this->m_frames.empty() ) {
+			return false;
+		}
+		frame_ = std::move( this->m_frames.front() );
+		this->m_frames.pop();
+		return true;
+	};
+
 	std::string Network::Connection::getBody() const {
 		std::lock_guard<std::mutex> lock( this->m_mutex );
-		return std::string( this->m_http.body.p, this->m_http.body.len );
+		return this->m_request != nullptr ? this->m_request->body.str() : "";
 	};
 
 	std::string Network::Connection::getUri() const {
 		std::lock_guard<std::mutex> lock( this->m_mutex );
-		return std::string( this->m_http.uri.p, this->m_http.uri.len );
+		return this->m_request != nullptr ? this->m_request->uri.str() : "";
 	};
 
 	unsigned int Network::Connection::getPort() const {
 		std::lock_guard<std::mutex> lock( this->m_mutex );
-		char* buffer = new char[6]; // max 65535 length  5 + \0
-		mg_conn_addr_to_str( this->m_mg_conn, buffer, 6, MG_SOCK_STRINGIFY_PORT );
+		char buffer[6]; // max 65535 length  5 + \0
+		mg_conn_addr_to_str( this->m_mg_conn, buffer, sizeof( buffer ), MG_SOCK_STRINGIFY_PORT );
 		return std::stoi( buffer );
 	};
 
 	std::string Network::Connection::getIp() const {
 		std::lock_guard<std::mutex> lock( this->m_mutex );
-		char* buffer = new char[46]; // max ipv6 length = 45 + \0
-		mg_conn_addr_to_str( this->m_mg_conn, buffer, 46, MG_SOCK_STRINGIFY_IP );
+		char buffer[46]; // max ipv6 length = 45 + \0
+		mg_conn_addr_to_str( this->m_mg_conn, buffer, sizeof( buffer ), MG_SOCK_STRINGIFY_IP );
 		return std::string( buffer );
 	};
 
 	std::string Network::Connection::getQuery() const {
 		std::lock_guard<std::mutex> lock( this->m_mutex );
-		return std::string( this->m_http.query_string.p, this->m_http.query_string.len );
+		return this->m_request != nullptr ? this->m_request->query.str() : "";
 	};
 
 	std::string Network::Connection::getMethod() const {
 		std::lock_guard<std::mutex> lock( this->m_mutex );
-		return std::string( this->m_http.method.p, this->m_http.method.len );
+		return this->m_request != nullptr ? this->m_request->method.str() : "";
 	};
 
 	std::map<std::string, std::string> Network::Connection::getHeaders() const {
 		std::lock_guard<std::mutex> lock( this->m_mutex );
 		std::map<std::string, std::string> headers;
-		int i = 0;
-		for ( const mg_str& name : this->m_http.header_names ) {
-			std::string header, value;
-			header.assign( name.p, name.len );
-			if ( ! header.empty() ) {
-				value.assign( this->m_http.header_values[i].p, this->m_http.header_values[i].len );
-				headers[header] = value;
+		if ( this->m_request != nullptr ) {
+			for ( auto const &header : this->m_request->headers ) {
+				headers[header.first.str()] = header.second.str();
 			}
-			i++;
 		}
 		return headers;
 	};
 
 	std::map<std::string, std::string> Network::Connection::getParams() const {
-		std::string query = this->getQuery();
+		std::lock_guard<std::mutex> lock( this->m_mutex );
 		std::map<std::string, std::string> params;
-		std::regex pattern( "([\\w+%]+)=([^&]*)" );
-		for ( auto paramsIt = std::sregex_iterator( query.begin(), query.end(), pattern ); paramsIt != std::sregex_iterator(); paramsIt++ ) {
-			std::string key = (*paramsIt)[1].str();
+		if ( this->m_request != nullptr ) {
+			for ( auto const &param : this->m_request->params ) {
+				params[param.first.str()] = param.second.str();
+			}
+		}
+		return params;
+	};
 
-			unsigned int size = 1024;
-			int length;
-			std::string value;
-			do {
-				char* buffer = new char[size];
-				length = mg_url_decode( (*paramsIt)[2].str().c_str(), (*paramsIt)[2].str().size(), buffer, size, 1 );
-				if ( length > -1 ) {
-					value.assign( buffer, length );
-				}
-				delete[] buffer;
-				size *= 2;
-				if ( size > 65536 ) {
-					break;
-				}
-			} while( length == -1 );
+	std::shared_ptr<const Network::Connection::t_request> Network::Connection::getRequest() const {
+		std::lock_guard<std::mutex> lock( this->m_mutex );
+		return this->m_request;
+	};
 
-			params[key] = value;
+	void Network::Connection::_reply( const std::string& data_, int code_, const std::map<std::string, std::string>& headers_, bool close_ ) {
+		// NOTE Only call this method from the poll thread with held lock on the connection mutex.
+		std::stringstream headers;
+		for ( auto headersIt = headers_.begin(); headersIt != headers_.end(); ) {
+			headers << headersIt->first << ": " << headersIt->second;
+			if ( ++headersIt != headers_.end() ) {
+				headers << "\r\n";
+			}
 		}
-		return params;
+		if ( this->m_mg_conn != nullptr ) {
+			mg_send_head( this->m_mg_conn, code_, data_.length(), headers.str().c_str() );
+			if ( code_ != 304 ) { // not modified
+				mg_send( this->m_mg_conn, data_.c_str(), data_.length() );
+			}
+			if ( close_ ) {
+				this->m_mg_conn->flags |= MG_F_SEND_AND_CLOSE;
+				this->m_flags |= NETWORK_CONNECTION_FLAG_CLOSE;
+			}
+		}
+	};
+
+	void Network::Connection::_parse( const http_message& http_ ) {
+		std::lock_guard<std::mutex> lock( this->m_mutex );
+		if (
+			this->m_request == nullptr
+			|| this->m_request.use_count() > 1
+		) {
+			this->m_request = std::make_shared<t_request>();
+		}
+		t_request& request = *this->m_request;
+
+		// The message is copied because mongoose removes it from the receive buffer as soon as the event has been
+		// handled, while the request is usually processed later on by another thread. All the views of the request
+		// point into this copy.
+		const char* begin = http_.message.p;
+		const char* end = http_.body.p + ( http_.body.len == (size_t)~0 ? 0 : http_.body.len );
+		request.raw.assign( begin, end - begin );
+		auto rebase = [&]( const mg_str& str_ ) -> mg_str {
+			mg_str result = { nullptr, 0 };
+			if (
+				str_.p >= begin
+				&& str_.p <= end
+				&& str_.len <= (size_t)( end - str_.p )
+			) {
+				result.p = request.raw.data() + ( str_.p - begin );
+				result.len = str_.len;
+			}
+			return result;
+		};
+		auto view = [&]( const mg_str& str_ ) -> StringView {
+			mg_str result = rebase( str_ );
+			return StringView( result.p, result.len );
+		};
+
+		request.method = view( http_.method );
+		request.uri = view( http_.uri );
+		request.query = view( http_.query_string );
+		request.body = view( http_.body );
+		request.headers.clear();
+		for ( unsigned int i = 0; i < MG_MAX_HTTP_HEADERS && http_.header_names[i].len > 0; i++ ) {
+			request.headers.push_back( { view( http_.header_names[i] ), view( http_.header_values[i] ) } );
+		}
+
+		// The parameters are url decoded into a separate buffer. The decoded size never exceeds the encoded size, so
+		// the buffer is sized once up front and the views remain valid.
+		request.params.clear();
+		request.decoded.resize( request.query.size() * 2 + 2 );
+		char* decoded = &request.decoded[0];
+		size_t available = request.decoded.size();
+		for ( size_t pos = 0; pos < request.query.size(); ) {
+			size_t next = request.query.find( '&', pos );
+			if ( next == std::string::npos ) {
+				next = request.query.size();
+			}
+			StringView param = request.query.substr( pos, next - pos );
+			pos = next + 1;
+
+			size_t separator = param.find( '=' );
+			if (
+				separator == std::string::npos
+				|| separator == 0
+			) {
+				continue;
+			}
+			int keyLength = mg_url_decode( param.data(), separator, decoded, available, 1 );
+			if ( keyLength < 0 ) {
+				continue;
+			}
+			StringView key( decoded, keyLength );
+			decoded += keyLength + 1;
+			available -= keyLength + 1;
+			int valueLength = mg_url_decode( param.data() + separator + 1, param.size() - separator - 1, decoded, available, 1 );
+			if ( valueLength < 0 ) {
+				continue;
+			}
+			request.params.push_back( { key, StringView( decoded, valueLength ) } );
+			decoded += valueLength + 1;
+			available -= valueLength + 1;
+		}
+
+		// The mongoose representation of the message is kept for mg_serve_http.
+		this->m_http = http_;
+		this->m_http.message = rebase( http_.message );
+		this->m_http.body = rebase( http_.body );
+		this->m_http.method = rebase( http_.method );
+		this->m_http.uri = rebase( http_.uri );
+		this->m_http.proto = rebase( http_.proto );
+		this->m_http.resp_status_msg = rebase( http_.resp_status_msg );
+		this->m_http.query_string = rebase( http_.query_string );
+		for ( unsigned int i = 0; i < MG_MAX_HTTP_HEADERS; i++ ) {
+			this->m_http.header_names[i] = rebase( http_.header_names[i] );
+			this->m_http.header_values[i] = rebase( http_.header_values[i] );
+		}
+	};
+
+	StringView Network::Connection::t_request::getHeader( const char* name_ ) const {
+		for ( auto const &header : this->headers ) {
+			if ( header.first.equals( name_, true ) ) {
+				return header.second;
+			}
+		}
+		return StringView();
+	};
+
+	bool Network::Connection::t_request::hasHeader( const char* name_ ) const {
+		for ( auto const &header : this->headers ) {
+			if ( header.first.equals( name_, true ) ) {
+				return true;
+			}
+		}
+		return false;
+	};
+
+	StringView Network::Connection::t_request::getParam( const char* name_ ) const {
+		// NOTE the last occurence of a parameter wins.
+		for ( auto paramIt = this->params.rbegin(); paramIt != this->params.rend(); paramIt++ ) {
+			if ( paramIt->first == name_ ) {
+				return paramIt->second;
+			}
+		}
+		return StringView();
+	};
+
+	bool Network::Connection::t_request::hasParam( const char* name_ ) const {
+		for ( auto const &param : this->params ) {
+			if ( param.first == name_ ) {
+				return true;
+			}
+		}
+		return false;
 	};
 
 	// =======
@@ -225,14 +419,14 @@ namespace micasa {
 		mg_mgr_free( &this->m_manager );
 	};
 
-	std::shared_ptr<Network::Connection> Network::bind( const std::string& port_, Connection::t_eventFunc&& func_ ) {
+	std::shared_ptr<Network::Connection> Network::bind( const std::string& port_, Connection::t_eventFunc&& func_, Connection::t_interceptFunc&& intercept_ ) {
 		mg_bind_opts options;
 		memset( &options, 0, sizeof( options ) );
-		return Network::_bind( port_, options, std::move( func_ ) );
+		return Network::_bind( port_, options, std::move( func_ ), std::move( intercept_ ) );
 	};
 
 #ifdef _WITH_OPENSSL
-	std::shared_ptr<Network::Connection> Network::bind( const std::string& port_, const std::string& cert_, const std::string& key_, Connection::t_eventFunc&& func_ ) {
+	std::shared_ptr<Network::Connection> Network::bind( const std::string& port_, const std::string& cert_, const std::string& key_, Connection::t_eventFunc&& func_, Connection::t_interceptFunc&& intercept_ ) {
 		mg_bind_opts options;
 		memset( &options, 0, sizeof( options ) );
 		if (
@@ -242,7 +436,7 @@ namespace micasa {
 			options.ssl_cert = cert_.c_str();
 			options.ssl_key = key_.c_str();
 		}
-		return Network::_bind( port_, options, std::move( func_ ) );
+		return Network::_bind( port_, options, std::move( func_ ), std::move( intercept_ ) );
 	};
 #endif
 
@@ -254,7 +448,14 @@ namespace micasa {
 		return Network::_connect( uri_, headers_, data_, std::move( func_ ) );
 	};
 
-	std::shared_ptr<Network::Connection> Network::_bind( const std::string& port_, const mg_bind_opts& options_, Network::Connection::t_eventFunc&& func_ ) {
+	void Network::wakeup() {
+		// Tasks that were queued on connections are executed by the poll thread. Callers that queue tasks on many
+		// connections at once can postpone the wakeup and wake the poll thread only once.
+		std::lock_guard<std::mutex> broadcastLock( Network::Connection::s_broadcastMutex );
+		mg_broadcast( &Network::get().m_manager, micasa_mg_handler, (void*)"", 0 );
+	};
+
+	std::shared_ptr<Network::Connection> Network::_bind( const std::string& port_, const mg_bind_opts& options_, Network::Connection::t_eventFunc&& func_, Network::Connection::t_interceptFunc&& intercept_ ) {
 		Network& network = Network::get();
 		mg_connection* mg_conn = mg_bind_opt( &network.m_manager, port_.c_str(), micasa_mg_handler, options_ );
 		Logger::logr( Logger::LogLevel::VERBOSE, &network, "Binding to %s.", port_.c_str() );
@@ -262,6 +463,7 @@ namespace micasa {
 		if ( mg_conn ) {
 			mg_set_protocol_http_websocket( mg_conn );
 			connection = std::make_shared<Connection>( mg_conn, NETWORK_CONNECTION_FLAG_HTTP | NETWORK_CONNECTION_FLAG_BIND, std::move( func_ ) );
+			connection->m_intercept = std::move( intercept_ );
 			mg_conn->user_data = mg_conn;
 			network.m_connections.insert( { mg_conn, connection } );
 			return connection;
@@ -306,6 +508,7 @@ namespace micasa {
 			auto find = network.m_connections.find( (mg_connection*)mg_conn_->user_data );
 			if ( find != network.m_connections.end() ) {
 				connection = std::make_shared<Connection>( mg_conn_, find->second->m_flags & ~NETWORK_CONNECTION_FLAG_BIND, find->second->m_func );
+				connection->m_intercept = find->second->m_intercept;
 				network.m_connections.insert( { mg_conn_, connection } );
 				Logger::logr( Logger::LogLevel::VERBOSE, &network, "Accepted connection from %s on port %d.", connection->getIp().c_str(), find->second->getPort() );
 			}
@@ -326,7 +529,20 @@ namespace micasa {
 						}
 						connection->m_tasks.pop();
 					}
+					connection->m_queued = 0;
+					if ( connection->m_buffered != connection->m_mg_conn->send_mbuf.len ) {
+						connection->m_buffered = connection->m_mg_conn->send_mbuf.len;
+						connection->m_bufferedCondition.notify_all();
+					}
+					lock.unlock();
+					break;
+				}
+
+				case MG_EV_SEND: {
+					std::unique_lock<std::mutex> lock( connection->m_mutex );
+					connection->m_buffered = connection->m_mg_conn->send_mbuf.len;
 					lock.unlock();
+					connection->m_bufferedCondition.notify_all();
 					break;
 				}
 
@@ -384,13 +600,20 @@ namespace micasa {
 				case MG_EV_HTTP_REQUEST:
 				case MG_EV_HTTP_REPLY:
 				case MG_EV_WEBSOCKET_HANDSHAKE_REQUEST: {
-					std::unique_lock<std::mutex> lock( connection->m_mutex );
-					connection->m_http = *(http_message*)data_;
-					lock.unlock();
+					connection->_parse( *(http_message*)data_ );
 					if ( event_ == MG_EV_HTTP_REPLY ) {
 						connection->m_mg_conn->flags |= MG_F_CLOSE_IMMEDIATELY;
 						connection->m_flags |= NETWORK_CONNECTION_FLAG_CLOSE;
 					}
+					// Requests that can be answered right away, such as static assets that are kept in memory, are
+					// handled by the intercept function without the overhead of a context switch.
+					if (
+						event_ == MG_EV_HTTP_REQUEST
+						&& connection->m_intercept != nullptr
+						&& connection->m_intercept( connection )
+					) {
+						break;
+					}
 					if ( connection->m_func != nullptr ) {
 						network.m_scheduler.schedule( 0, 1, &network, [connection]( std::shared_ptr<Scheduler::Task<>> ) {
 							connection->m_func( connection, Connection::Event::HTTP );
@@ -404,6 +627,21 @@ namespace micasa {
 					break;
 				}
 
+				case MG_EV_WEBSOCKET_FRAME: {
+					// NOTE websocket frames are queued as a whole so that the receiver can process them one at a time
+					// instead of having to split the concatenated data.
+					websocket_message* message = (websocket_message*)data_;
+					std::unique_lock<std::mutex> lock( connection->m_mutex );
+					connection->m_frames.push( std::string( (char*)message->data, message->size ) );
+					lock.unlock();
+					if ( connection->m_func != nullptr ) {
+						network.m_scheduler.schedule( 0, 1, &network, [connection]( std::shared_ptr<Scheduler::Task<>> ) {
+							connection->m_func( connection, Connection::Event::DATA );
+						} );
+					}
+					break;
+				}
+
 				case MG_EV_CLOSE: {
 					if ( ( connection->m_flags & NETWORK_CONNECTION_FLAG_FAILURE ) == 0 ) {
 						Connection::Event event = Connection::Event::DROPPED;
@@ -417,7 +655,10 @@ namespace micasa {
 						}
 					}
 					network.m_connections.erase( connection->m_mg_conn );
+					std::unique_lock<std::mutex> lock( connection->m_mutex );
 					connection->m_mg_conn = nullptr;
+					lock.unlock();
+					connection->m_bufferedCondition.notify_all();
 				}
 			}
 		}
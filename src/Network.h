@@ -2,10 +2,13 @@
 
 #include <thread>
 #include <map>
+#include <vector>
+#include <memory>
 #include <unordered_map>
 #include <atomic>
 #include <queue>
 #include <mutex>
+#include <condition_variable>
 #include <climits>
 
 #include "Utils.h"
@@ -24,6 +27,7 @@ extern "C" {
 #define NETWORK_CONNECTION_FLAG_SOCKET     (1 << 4)
 
 #define NETWORK_CONNECTION_DEFAULT_TIMEOUT_SEC 10
+#define NETWORK_CONNECTION_MAX_BUFFERED_BYTES 64 * 1024
 
 namespace micasa {
 
@@ -63,6 +67,28 @@ namespace micasa {
 			ENUM_UTIL( Event );
 
 			typedef std::function<void( std::shared_ptr<Connection> connection_, Event event_ )> t_eventFunc;
+			// NOTE intercept functions are called on the poll thread and should therefore never block.
+			typedef std::function<bool( std::shared_ptr<Connection> connection_ )> t_interceptFunc;
+
+			// The request holds a copy of the http message and views into that copy. The header and parameter tables
+			// are flat and are searched linearly, which is faster than a map for the handful of entries in a request.
+			// The request object is reused for subsequent messages on the same connection if it's no longer
+			// referenced, so that the common path doesn't allocate.
+			struct t_request {
+				std::string raw;
+				std::string decoded; // url decoded parameters
+				StringView method;
+				StringView uri;
+				StringView query;
+				StringView body;
+				std::vector<std::pair<StringView, StringView>> headers;
+				std::vector<std::pair<StringView, StringView>> params;
+
+				StringView getHeader( const char* name_ ) const;
+				StringView getParam( const char* name_ ) const;
+				bool hasHeader( const char* name_ ) const;
+				bool hasParam( const char* name_ ) const;
+			}; // struct t_request
 
 			Connection( mg_connection* connection_, unsigned int flags_, t_eventFunc&& func_ );
 			Connection( mg_connection* connection_, unsigned int flags_, const t_eventFunc& func_ );
@@ -77,10 +103,13 @@ namespace micasa {
 			void terminate();
 			void serve( const std::string& root_, const std::string& index_ = "index.html" );
 			void reply( const std::string& data_, int code_, const std::map<std::string, std::string>& headers_, bool close_ = false );
-			void send( const std::string& data_ );
+			void send( const std::string& data_, bool wakeup_ = true, bool binary_ = false );
+			void replyChunked( int code_, const std::map<std::string, std::string>& headers_ );
+			bool sendChunk( const std::string& data_ );
 
 			std::string getData() const;
 			std::string popData( unsigned int length_ = UINT_MAX );
+			bool popFrame( std::string& frame_ );
 			std::string getBody() const;
 			std::string getUri() const;
 			unsigned int getPort() const;
@@ -89,14 +118,21 @@ namespace micasa {
 			std::string getMethod() const;
 			std::map<std::string, std::string> getHeaders() const;
 			std::map<std::string, std::string> getParams() const;
+			std::shared_ptr<const t_request> getRequest() const;
 
 		private:
 			mg_connection* m_mg_conn;
 			std::atomic<unsigned int> m_flags;
 			struct http_message m_http;
+			std::shared_ptr<t_request> m_request;
 			std::string m_data;
 			t_eventFunc m_func;
+			t_interceptFunc m_intercept;
 			std::queue<std::function<void(void)>> m_tasks;
+			std::queue<std::string> m_frames;
+			size_t m_queued;
+			size_t m_buffered;
+			std::condition_variable m_bufferedCondition;
 			mutable std::mutex m_mutex;
 
 			// The calls to mg_broadcast should by synchronized; if not, one call might absorb the results from the
@@ -104,6 +140,9 @@ namespace micasa {
 			// pair where mg_poll acknowledges a call to mg_broadcast).
 			static std::mutex s_broadcastMutex;
 
+			void _reply( const std::string& data_, int code_, const std::map<std::string, std::string>& headers_, bool close_ );
+			void _parse( const http_message& http_ );
+
 		}; // class Connection
 
 		~Network(); // public destructor
@@ -115,12 +154,13 @@ namespace micasa {
 
 		friend std::ostream& operator<<( std::ostream& out_, const Network* network_ ) { out_ << "Network"; return out_; }
 
-		static std::shared_ptr<Connection> bind( const std::string& port_, Connection::t_eventFunc&& func_ );
+		static std::shared_ptr<Connection> bind( const std::string& port_, Connection::t_eventFunc&& func_, Connection::t_interceptFunc&& intercept_ = nullptr );
 #ifdef _WITH_OPENSSL
-		static std::shared_ptr<Connection> bind( const std::string& port_, const std::string& cert_, const std::string& key_, Connection::t_eventFunc&& func_ );
+		static std::shared_ptr<Connection> bind( const std::string& port_, const std::string& cert_, const std::string& key_, Connection::t_eventFunc&& func_, Connection::t_interceptFunc&& intercept_ = nullptr );
 #endif
 		static std::shared_ptr<Connection> connect( const std::string& uri_, const std::map<std::string, std::string>& headers_, const std::string& data_, Connection::t_eventFunc&& func_ );
 		static std::shared_ptr<Connection> connect( const std::string& uri_, const std::map<std::string, std::string>& headers_, Connection::t_eventFunc&& func_ );
+		static void wakeup();
 
 	private:
 		Scheduler m_scheduler;
@@ -137,7 +177,7 @@ namespace micasa {
 			return instance;
 		}
 
-		static std::shared_ptr<Connection> _bind( const std::string& port_, const mg_bind_opts& options_, Connection::t_eventFunc&& func_ );
+		static std::shared_ptr<Connection> _bind( const std::string& port_, const mg_bind_opts& options_, Connection::t_eventFunc&& func_, Connection::t_interceptFunc&& intercept_ );
 		static std::shared_ptr<Connection> _connect( const std::string& uri_, const std::map<std::string, std::string>& headers_, const std::string& data_, Connection::t_eventFunc&& func_ );
 		static void _handler( mg_connection* mg_conn_, int event_, void* data_ );
 
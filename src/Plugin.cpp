@@ -208,16 +208,14 @@ namespace micasa {
 
 	void Plugin::setState( const State& state_, bool children_ ) {
 		this->m_state = state_;
+		g_controller->invalidateDeviceJson();
 		if ( children_ ) {
 			for ( auto& child : this->getChildren() ) {
 				child->setState( state_ );
 			}
 		}
 
-		json data = json::object();
-		data["event"] = "plugin_update";
-		data["data"] = this->getJson();
-		g_webServer->broadcast( data.dump() );
+		g_webServer->broadcast( "plugin_update", this->getJson(), this->getId() );
 	};
 
 	json Plugin::getJson() const {
@@ -262,14 +260,7 @@ namespace micasa {
 	};
 
 	std::vector<std::shared_ptr<Plugin>> Plugin::getChildren() const {
-		auto me = this->shared_from_this();
-		std::vector<std::shared_ptr<Plugin>> children;
-		for ( auto& plugin : g_controller->getAllPlugins() ) {
-			if ( plugin->getParent() == me ) {
-				children.push_back( plugin );
-			}
-		}
-		return children;
+		return g_controller->getChildPlugins( this->shared_from_this() );
 	};
 
 	std::shared_ptr<Device> Plugin::getDevice( const std::string& reference_ ) const {
@@ -282,11 +273,14 @@ namespace micasa {
 	};
 
 	std::shared_ptr<Device> Plugin::getDeviceById( const unsigned int& id_ ) const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_devicesMutex );
-		for ( auto const &devicesIt : this->m_devices ) {
-			if ( devicesIt.second->getId() == id_ ) {
-				return devicesIt.second;
-			}
+		// The global device index of the controller is used to find the device, after which it only needs to be
+		// checked if the device belongs to this plugin.
+		auto device = g_controller->getDeviceById( id_ );
+		if (
+			device != nullptr
+			&& device->getPlugin().get() == this
+		) {
+			return device;
 		}
 		return nullptr;
 	};
@@ -347,13 +341,10 @@ namespace micasa {
 					device_->getId()
 				);
 
-				json data = json::object();
-				data["event"] = "device_remove";
-				data["data"] = {
-					{ "id", device_->getId() }
-				};
-				g_webServer->broadcast( data.dump() );
+				unsigned long long sequence = g_controller->recordDeviceChange( device_->getId(), true );
+				g_webServer->broadcast( "device_remove", { { "id", device_->getId() }, { "sequence", sequence } }, this->getId(), device_->getId() );
 
+				g_controller->unindexDevice( device_ );
 				this->m_devices.erase( devicesIt );
 				break;
 			}
@@ -402,11 +393,10 @@ namespace micasa {
 		}
 
 		this->m_devices[reference_] = device;
+		g_controller->indexDevice( device );
+		g_controller->recordDeviceChange( device->getId() );
 
-		json data = json::object();
-		data["event"] = "device_add";
-		data["data"] = device->getJson();
-		g_webServer->broadcast( data.dump() );
+		g_webServer->broadcast( "device_add", device->getJson(), this->getId(), device->getId() );
 
 		return device;
 	};
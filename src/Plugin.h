@@ -89,11 +89,15 @@ namespace micasa {
 		virtual nlohmann::json getSettingsJson() const;
 		virtual void putSettingsJson( const nlohmann::json& settings_ ) { };
 
-		// The device update/remove methods are called on *all* plugins to allow interaction between plugins.
+		// The device settings, json and remove methods are called on *all* plugins to allow interaction between
+		// plugins. The device update methods are only called on the plugin that owns the device and on plugins that
+		// subscribed to the device at the controller. The afterUpdateDevice method is called asynchroniously from the
+		// event queue after an update was applied.
 		virtual void updateDeviceJson( std::shared_ptr<const Device> device_, nlohmann::json& json_, bool owned_ ) const { };
 		virtual void updateDeviceSettingsJson( std::shared_ptr<const Device> device_, nlohmann::json& json_, bool owned_ ) const { };
 		virtual void putDeviceSettingsJson( std::shared_ptr<Device> device_, const nlohmann::json& json_, bool owned_ ) { };
 		virtual bool updateDevice( const Device::UpdateSource& source_, std::shared_ptr<Device> device_, bool owned_, bool& apply_ ) { return true; };
+		virtual void afterUpdateDevice( std::shared_ptr<Device> device_, const Device::UpdateSource& source_, bool owned_ ) { };
 		virtual void beforeRemoveDevice( const std::shared_ptr<Device> device_ ) { };
 
 	protected:
@@ -10,12 +10,14 @@
 #include "Plugin.h"
 #include "Device.h"
 #include "User.h"
+#include "Controller.h"
 
 namespace micasa {
 
 	using namespace nlohmann;
 
 	extern std::unique_ptr<Database> g_database;
+	extern std::unique_ptr<Controller> g_controller;
 
 	SettingValue::SettingValue( const unsigned long& value_ ) {
 		this->assign( std::to_string( value_ ) );
@@ -55,15 +57,28 @@ namespace micasa {
 
 	template<class T> SettingsHelper<T>::SettingsHelper( const T& target_ ) :
 		m_target( target_ ),
-		m_populated( false )
+		m_populated( false ),
+		m_version( 0 )
 	{
 #ifdef _DEBUG
 		assert( g_database && "Global Database instance should be created before settings instances." );
 #endif // _DEBUG
 	};
 
+	template<class T> void SettingsHelper<T>::_committed() const {
+	};
+
+	// Changed device settings are a change of the device itself and are therefore recorded in the changelog of the
+	// controller, just like changes to it's value.
+	template<> void SettingsHelper<Device>::_committed() const {
+		g_controller->recordDeviceChange( this->m_target.getId() );
+	};
+
 	template<class T> void SettingsHelper<T>::commit() {
-		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
+		std::unique_lock<std::mutex> lock( this->m_settingsMutex );
+		if ( this->m_dirty.size() == 0 ) {
+			return;
+		}
 		for ( auto dirtyIt = this->m_dirty.begin(); dirtyIt != this->m_dirty.end(); dirtyIt++ ) {
 			auto setting = this->m_settings.find( *dirtyIt );
 			if ( setting != this->m_settings.end() ) {
@@ -89,6 +104,8 @@ namespace micasa {
 			}
 		}
 		this->m_dirty.clear();
+		lock.unlock();
+		this->_committed();
 	};
 
 	template<class T> void SettingsHelper<T>::_populateOnce() const {
@@ -111,7 +128,8 @@ namespace micasa {
 	// The void-variant of the class is fully specialized, resulting in a fully instantiated type
 	// called SettingsHelper<void>.
 	SettingsHelper<void>::SettingsHelper() :
-		m_populated( false )
+		m_populated( false ),
+		m_version( 0 )
 	{
 #ifdef _DEBUG
 		assert( g_database && "Global Database instance should be created before settings instances." );
@@ -172,6 +190,7 @@ namespace micasa {
 		for ( auto settingsIt = settings_.begin(); settingsIt != settings_.end(); settingsIt++ ) {
 			this->m_dirty.push_back( settingsIt->first );
 		}
+		this->m_version++;
 	};
 
 	template<class T> bool Settings<T>::contains( const std::initializer_list<std::string>& settings_ ) const {
@@ -194,7 +213,9 @@ namespace micasa {
 	template<class T> void Settings<T>::remove( const std::string& key_ ) {
 		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
 		this->_populateOnce();
-		this->m_settings.erase( key_ );
+		if ( this->m_settings.erase( key_ ) > 0 ) {
+			this->m_version++;
+		}
 		this->m_dirty.push_back( key_ );
 	};
 
@@ -209,6 +230,11 @@ namespace micasa {
 		return this->m_dirty.size() > 0;
 	};
 
+	template<class T> unsigned long Settings<T>::getVersion() const {
+		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
+		return this->m_version;
+	};
+
 	template<class T> std::string Settings<T>::get( const std::string& key_ ) const {
 		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
 		this->_populateOnce();
@@ -234,6 +260,7 @@ namespace micasa {
 		) {
 			this->m_settings[key_] = value_;
 			this->m_dirty.push_back( key_ );
+			this->m_version++;
 		}
 	};
 
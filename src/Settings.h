@@ -39,9 +39,11 @@ namespace micasa {
 		mutable std::map<std::string, std::string> m_settings;
 		mutable bool m_populated;
 		std::vector<std::string> m_dirty;
+		unsigned long m_version;
 		mutable std::mutex m_settingsMutex;
 
 		void _populateOnce() const;
+		void _committed() const;
 
 	}; // class SettingsHelper
 
@@ -58,6 +60,7 @@ namespace micasa {
 		mutable std::map<std::string, std::string> m_settings;
 		mutable bool m_populated;
 		std::vector<std::string> m_dirty;
+		unsigned long m_version;
 		mutable std::mutex m_settingsMutex;
 
 		void _populateOnce() const;
@@ -79,6 +82,7 @@ namespace micasa {
 		void remove( const std::string& key_ );
 		unsigned int count() const;
 		bool isDirty() const;
+		unsigned long getVersion() const;
 
 		std::string get( const std::string& key_ ) const;
 		template<typename V> V get( const std::string& key_ ) const {
@@ -78,6 +78,7 @@ namespace micasa {
 				n > -1
 				&& n < size
 			) {
+				str.resize( n );
 				return str;
 			}
 			if ( n > -1 ) {
@@ -5,6 +5,8 @@
 #include <map>
 #include <type_traits>
 #include <iomanip>
+#include <cstring>
+#include <strings.h>
 
 #include "json.hpp"
 
@@ -21,6 +23,57 @@ namespace micasa {
 
 	const std::map<std::string, std::string> getSerialPorts();
 
+	// A non-owning reference to a range of characters. The owner of the characters should outlive the view.
+	class StringView final {
+
+	public:
+		StringView() : m_data( nullptr ), m_size( 0 ) { };
+		StringView( const char* data_, size_t size_ ) : m_data( data_ ), m_size( size_ ) { };
+
+		const char* data() const { return this->m_data; };
+		size_t size() const { return this->m_size; };
+		bool empty() const { return this->m_size == 0; };
+		char operator[]( size_t pos_ ) const { return this->m_data[pos_]; };
+		char back() const { return this->m_data[this->m_size - 1]; };
+		std::string str() const { return std::string( this->m_data, this->m_size ); };
+
+		StringView substr( size_t pos_, size_t length_ = std::string::npos ) const {
+			pos_ = std::min( pos_, this->m_size );
+			return StringView( this->m_data + pos_, std::min( length_, this->m_size - pos_ ) );
+		};
+		size_t find( char search_, size_t pos_ = 0 ) const {
+			for ( size_t i = pos_; i < this->m_size; i++ ) {
+				if ( this->m_data[i] == search_ ) {
+					return i;
+				}
+			}
+			return std::string::npos;
+		};
+		bool startsWith( const char* search_ ) const {
+			size_t length = strlen( search_ );
+			return this->m_size >= length && ( length == 0 || memcmp( this->m_data, search_, length ) == 0 );
+		};
+		bool equals( const char* other_, bool caseInsensitive_ = false ) const {
+			size_t length = strlen( other_ );
+			if ( this->m_size != length ) {
+				return false;
+			} else if ( length == 0 ) {
+				return true;
+			}
+			return caseInsensitive_ ? strncasecmp( this->m_data, other_, length ) == 0 : memcmp( this->m_data, other_, length ) == 0;
+		};
+
+		bool operator==( const char* other_ ) const { return this->equals( other_ ); };
+		bool operator!=( const char* other_ ) const { return ! this->equals( other_ ); };
+		bool operator==( const std::string& other_ ) const { return this->m_size == other_.size() && ( this->m_size == 0 || memcmp( this->m_data, other_.data(), this->m_size ) == 0 ); };
+		bool operator!=( const std::string& other_ ) const { return ! ( *this == other_ ); };
+
+	private:
+		const char* m_data;
+		size_t m_size;
+
+	}; // class StringView
+
 	template<typename T> inline T jsonGetImpl( const nlohmann::basic_json<>::value_type& input_, T* ) {
 		T value;
 		if ( input_.is_string() ) {
@@ -28,7 +81,7 @@ namespace micasa {
 		} else if ( input_.is_number_float() ) {
 			std::istringstream( std::to_string( input_.get<double>() ) ) >> std::fixed >> std::setprecision( 3 ) >> value;
 		} else if ( input_.is_number() ) {
-			std::istringstream( std::to_string( input_.get<long>() ) ) >> value;
+			std::istringstream( std::to_string( input_.get<long long>() ) ) >> value;
 		} else if ( input_.is_boolean() ) {
 			std::istringstream( input_.get<bool>() ? "1" : "0" ) >> value;
 		} else {
@@ -12,8 +12,12 @@
 // https://github.com/nlohmann/json
 
 #include <cstdlib>
-#include <regex>
+#include <algorithm>
 #include <sstream>
+#include <fstream>
+#include <unordered_set>
+
+#include <dirent.h>
 
 #ifdef _WITH_OPENSSL
 	#include <openssl/x509.h>
@@ -72,10 +76,36 @@ namespace micasa {
 		{ WebServer::Method::OPTIONS, "OPTIONS" }
 	};
 
+	const std::map<WebServer::SocketEncoding, std::string> WebServer::SocketEncodingText = {
+		{ WebServer::SocketEncoding::JSON, "json" },
+		{ WebServer::SocketEncoding::MSGPACK, "msgpack" },
+		{ WebServer::SocketEncoding::CBOR, "cbor" }
+	};
+
+	const std::map<WebServer::ContentEncoding, std::string> WebServer::ContentEncodingText = {
+		{ WebServer::ContentEncoding::IDENTITY, "identity" },
+		{ WebServer::ContentEncoding::GZIP, "gzip" },
+		{ WebServer::ContentEncoding::DEFLATE, "deflate" }
+	};
+
+	// The keys in this dictionary are replaced by their index in messages that are send to sockets using one of the
+	// binary encodings. The dictionary itself is send as the first message on these sockets.
+	const std::vector<std::string> WebServer::SocketDictionary = {
+		"event", "data", "id", "plugin_id", "value", "source", "label", "name", "type", "subtype", "unit", "enabled",
+		"state", "age", "plugin", "comments", "scheduled", "next_schedule", "ignore_duplicates", "coalesced",
+		"battery_level", "signal_strength", "total_timers", "total_scripts", "total_links", "readonly", "parent_id",
+		"sequence"
+	};
+
 	WebServer::WebServer( unsigned int port_, unsigned int sslport_ ) :
 		m_port( port_ ),
 		m_sslport( sslport_ ),
-		m_resources( std::vector<t_resource>( 9 ) )
+		m_broadcastSequence( 0 ),
+		m_routeNodes( std::vector<t_routeNode>( 1 ) ),
+		m_routeMisses( 0 ),
+		m_version( 0 ),
+		m_epoch( std::to_string( duration_cast<seconds>( system_clock::now().time_since_epoch() ).count() ) ),
+		m_compressionLevel( 0 )
 	{
 #ifdef _DEBUG
 		assert( g_database && "Global Database instance should be created before global WebServer instance." );
@@ -169,18 +199,43 @@ namespace micasa {
 		this->_installScriptResourceHandler();
 		this->_installTimerResourceHandler();
 		this->_installUserResourceHandler();
+		this->_installSystemResourceHandler();
+		this->_installBatchResourceHandler();
+
+		// The level is configurable because compressing dynamic content costs cpu cycles on each request; a level of
+		// 0 disables compression altogether.
+		this->m_compressionLevel = std::max( 0, std::min( 9, g_settings->get<int>( WEBSERVER_SETTING_COMPRESSION_LEVEL, WEBSERVER_COMPRESSION_DEFAULT_LEVEL ) ) );
+
+		// The static assets are loaded into memory once, together with their compressed variant and etag. They are
+		// considered immutable for the lifetime of the process, so there's no need for locking.
+		auto begin = steady_clock::now();
+		size_t size = this->_loadAssets( "www" );
+		Logger::logr( Logger::LogLevel::VERBOSE, this, "Loaded %zu static assets (%zu bytes).", this->m_assets.size(), size );
+		g_controller->addStartupTiming( "load", "assets", begin );
 
 		auto handler = [this]( std::shared_ptr<Network::Connection> connection_, Network::Connection::Event event_ ) -> void {
 			if ( event_ == Network::Connection::Event::HTTP ) {
 				this->_processRequest( connection_ );
+			} else if ( event_ == Network::Connection::Event::DATA ) {
+				this->_processSocket( connection_ );
+			} else if (
+				event_ == Network::Connection::Event::CLOSE
+				|| event_ == Network::Connection::Event::DROPPED
+			) {
+				std::lock_guard<std::mutex> lock( this->m_loginsMutex );
+				this->_removeSocket( connection_.get() );
 			}
 		};
+		auto intercept = [this]( std::shared_ptr<Network::Connection> connection_ ) -> bool {
+			return this->_serveAsset( connection_ );
+		};
+		begin = steady_clock::now();
 		if ( this->m_port > 0 ) {
 		std::string address;
 #ifdef _IPV6_ENABLED
-			this->m_bind = Network::bind( "[::]:" + std::to_string( this->m_port ), handler );
+			this->m_bind = Network::bind( "[::]:" + std::to_string( this->m_port ), handler, intercept );
 #else
-			this->m_bind = Network::bind( "0.0.0.0:" + std::to_string( this->m_port ), handler );
+			this->m_bind = Network::bind( "0.0.0.0:" + std::to_string( this->m_port ), handler, intercept );
 #endif
 			if ( ! this->m_bind ) {
 				Logger::logr( Logger::LogLevel::ERROR, this, "Unable to bind to port %d.", this->m_port );
@@ -189,15 +244,16 @@ namespace micasa {
 #ifdef _WITH_OPENSSL
 		if ( this->m_sslport > 0 ) {
 #ifdef _IPV6_ENABLED
-			this->m_sslbind = Network::bind( "[::]:" + std::to_string( this->m_sslport ), std::string( _DATADIR ) + "/cert.pem", std::string( _DATADIR ) + "/key.pem", handler );
+			this->m_sslbind = Network::bind( "[::]:" + std::to_string( this->m_sslport ), std::string( _DATADIR ) + "/cert.pem", std::string( _DATADIR ) + "/key.pem", handler, intercept );
 #else
-			this->m_sslbind = Network::bind( "0.0.0.0:" + std::to_string( this->m_sslport ), std::string( _DATADIR ) + "/cert.pem", std::string( _DATADIR ) + "/key.pem", handler );
+			this->m_sslbind = Network::bind( "0.0.0.0:" + std::to_string( this->m_sslport ), std::string( _DATADIR ) + "/cert.pem", std::string( _DATADIR ) + "/key.pem", handler, intercept );
 #endif
 			if ( ! this->m_sslbind ) {
 				Logger::logr( Logger::LogLevel::ERROR, this, "Unable to bind to port %d.", this->m_sslport );
 			}
 		}
 #endif // _WITH_OPENSSL
+		g_controller->addStartupTiming( "bind", "webserver", begin );
 
 		// If there are no users defined in the database, a default administrator is created.
 		if ( g_database->getQueryValue<unsigned int>( "SELECT COUNT(*) FROM `users`" ) == 0 ) {
@@ -250,21 +306,267 @@ namespace micasa {
 		Logger::log( Logger::LogLevel::NORMAL, this, "Stopped." );
 	};
 
-	void WebServer::broadcast( const std::string& message_ ) {
-		this->m_scheduler.schedule( 0, 1, this, [=]( std::shared_ptr<Scheduler::Task<>> ) {
-			std::lock_guard<std::mutex> lock( this->m_loginsMutex );
-			for ( auto loginIt = this->m_logins.begin(); loginIt != this->m_logins.end(); loginIt++ ) {
-				for ( auto connectionIt = loginIt->second.sockets.begin(); connectionIt != loginIt->second.sockets.end(); ) {
-					auto connection = (*connectionIt).lock();
-					if ( connection ) {
-						connection->send( message_ );
-						connectionIt++;
-					} else {
-						connectionIt = loginIt->second.sockets.erase( connectionIt );
+	void WebServer::broadcast( const std::string& event_, const json& data_, const unsigned int& pluginId_, const unsigned int& deviceId_ ) {
+		json data = json::object();
+		data["event"] = event_;
+		data["data"] = data_;
+		data["sequence"] = g_controller->getSequence();
+
+		// The message is encoded only once for each of the encodings in use by the receiving sockets.
+		std::map<SocketEncoding, std::string> encoded;
+		json compact;
+		auto encode = [&]( const SocketEncoding& encoding_ ) -> const std::string& {
+			auto find = encoded.find( encoding_ );
+			if ( find != encoded.end() ) {
+				return find->second;
+			}
+			std::string& message = encoded[encoding_];
+			if ( encoding_ == SocketEncoding::JSON ) {
+				message = data.dump();
+			} else {
+				if ( compact.is_null() ) {
+					compact = WebServer::_compactJson( data );
+				}
+				std::vector<uint8_t> bytes = ( encoding_ == SocketEncoding::MSGPACK ) ? json::to_msgpack( compact ) : json::to_cbor( compact );
+				message.assign( bytes.begin(), bytes.end() );
+			}
+			return message;
+		};
+
+		// Messages are not send right away but added to the outbound batch of each socket. The batches are flushed
+		// as a single frame holding an array of messages, either after a short interval or as soon as one of the
+		// batches grows too large. This way the network thread is woken up only once for a series of messages.
+		std::unique_lock<std::mutex> lock( this->m_loginsMutex );
+		unsigned long sequence = ++this->m_broadcastSequence;
+		bool flush = false;
+		auto deliver = [&]( t_socket* socket_ ) {
+			if ( socket_->sequence == sequence ) {
+				return; // already delivered through one of the other indices
+			}
+			socket_->sequence = sequence;
+			if (
+				! socket_->events.empty()
+				&& socket_->events.find( event_ ) == socket_->events.end()
+			) {
+				return;
+			}
+			if ( socket_->encoding == SocketEncoding::JSON ) {
+				socket_->batch.append( socket_->batch.empty() ? "[" : "," );
+			} else if ( socket_->batch.empty() ) {
+				socket_->batch.append( 5, '\0' ); // placeholder for the array header
+			}
+			socket_->batch.append( encode( socket_->encoding ) );
+			socket_->count++;
+			flush = flush || socket_->batch.size() >= WEBSERVER_BROADCAST_BATCH_SIZE;
+		};
+		for ( auto const &socket : this->m_socketsUnfiltered ) {
+			deliver( socket );
+		}
+		if ( deviceId_ > 0 ) {
+			auto find = this->m_socketsByDevice.find( deviceId_ );
+			if ( find != this->m_socketsByDevice.end() ) {
+				for ( auto const &socket : find->second ) {
+					deliver( socket );
+				}
+			}
+		}
+		if ( pluginId_ > 0 ) {
+			auto find = this->m_socketsByPlugin.find( pluginId_ );
+			if ( find != this->m_socketsByPlugin.end() ) {
+				for ( auto const &socket : find->second ) {
+					deliver( socket );
+				}
+			}
+		}
+
+		if ( ! flush ) {
+			this->_scheduleBroadcasts();
+			return;
+		}
+		lock.unlock();
+		this->_flushBroadcasts();
+	};
+
+	void WebServer::_scheduleBroadcasts() {
+		// NOTE Only call this method with held lock on logins mutex.
+		if ( ! this->m_broadcastTask.lock() ) {
+			this->m_broadcastTask = this->m_scheduler.schedule( WEBSERVER_BROADCAST_INTERVAL_MSEC, 1, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
+				this->_flushBroadcasts();
+			} );
+		}
+	};
+
+	void WebServer::_flushBroadcasts() {
+		std::unique_lock<std::mutex> lock( this->m_loginsMutex );
+		bool wakeup = false;
+		std::vector<const Network::Connection*> expired;
+		for ( auto &socketIt : this->m_sockets ) {
+			t_socket& socket = socketIt.second;
+			auto connection = socket.connection.lock();
+			if ( ! connection ) {
+				expired.push_back( socketIt.first );
+			} else if ( socket.count > 0 ) {
+				if ( socket.encoding == SocketEncoding::JSON ) {
+					socket.batch.append( "]" );
+				} else {
+					// Both msgpack and cbor have an array header with a 32 bit big-endian element count.
+					socket.batch[0] = (char)( socket.encoding == SocketEncoding::MSGPACK ? 0xdd : 0x9a );
+					for ( unsigned int i = 0; i < 4; i++ ) {
+						socket.batch[1 + i] = (char)( ( socket.count >> ( 8 * ( 3 - i ) ) ) & 0xff );
 					}
 				}
+				connection->send( socket.batch, false, socket.encoding != SocketEncoding::JSON );
+				wakeup = true;
 			}
-		} );
+			socket.batch.clear();
+			socket.count = 0;
+		}
+		for ( auto const &connection : expired ) {
+			this->_removeSocket( connection );
+		}
+		lock.unlock();
+		if ( wakeup ) {
+			Network::wakeup();
+		}
+	};
+
+	json WebServer::_compactJson( const json& input_ ) {
+		static const std::unordered_map<std::string, std::string> keys = []() {
+			std::unordered_map<std::string, std::string> keys;
+			for ( unsigned int index = 0; index < WebServer::SocketDictionary.size(); index++ ) {
+				keys[WebServer::SocketDictionary[index]] = std::to_string( index );
+			}
+			return keys;
+		}();
+		if ( input_.is_object() ) {
+			json result = json::object();
+			for ( auto inputIt = input_.begin(); inputIt != input_.end(); inputIt++ ) {
+				auto find = keys.find( inputIt.key() );
+				result[find != keys.end() ? find->second : inputIt.key()] = WebServer::_compactJson( inputIt.value() );
+			}
+			return result;
+		} else if ( input_.is_array() ) {
+			json result = json::array();
+			for ( auto const &element : input_ ) {
+				result.push_back( WebServer::_compactJson( element ) );
+			}
+			return result;
+		} else {
+			return input_;
+		}
+	};
+
+	void WebServer::_processSocket( std::shared_ptr<Network::Connection> connection_ ) {
+		// Frames are processed while holding the logins lock to make sure subscriptions are applied in the order
+		// they were received.
+		std::lock_guard<std::mutex> lock( this->m_loginsMutex );
+		std::string frame;
+		while( connection_->popFrame( frame ) ) {
+			auto find = this->m_sockets.find( connection_.get() );
+			if ( find == this->m_sockets.end() ) {
+				return;
+			}
+			try {
+				json message = json::parse( frame );
+				std::string action = jsonGet<std::string>( message, "action" );
+				if ( action == "subscribe" ) {
+					this->_subscribeSocket( find->second, message, true );
+				} else if ( action == "unsubscribe" ) {
+					this->_subscribeSocket( find->second, message, false );
+				} else {
+					Logger::logr( Logger::LogLevel::WARNING, this, "Invalid socket action %s.", action.c_str() );
+				}
+			} catch( json::exception ex_ ) {
+				Logger::log( Logger::LogLevel::ERROR, this, ex_.what() );
+			} catch( std::runtime_error ex_ ) {
+				Logger::log( Logger::LogLevel::ERROR, this, ex_.what() );
+			}
+		}
+	};
+
+	void WebServer::_subscribeSocket( t_socket& socket_, const json& subscription_, bool subscribe_ ) {
+		// NOTE Only call this method with held lock on logins mutex.
+		// Sockets without device- or plugin subscriptions receive the events of all devices and plugins, sockets
+		// without event subscriptions receive all types of events. Unsubscribing without any events, devices or
+		// plugins removes all subscriptions.
+		auto events = jsonGet<std::vector<std::string>>( subscription_, "events", std::vector<std::string>() );
+		auto devices = jsonGet<std::vector<unsigned int>>( subscription_, "devices", std::vector<unsigned int>() );
+		auto plugins = jsonGet<std::vector<unsigned int>>( subscription_, "plugins", std::vector<unsigned int>() );
+
+		this->_indexSocket( socket_, false );
+		if ( subscribe_ ) {
+			socket_.events.insert( events.begin(), events.end() );
+			socket_.devices.insert( devices.begin(), devices.end() );
+			socket_.plugins.insert( plugins.begin(), plugins.end() );
+		} else if (
+			events.empty()
+			&& devices.empty()
+			&& plugins.empty()
+		) {
+			socket_.events.clear();
+			socket_.devices.clear();
+			socket_.plugins.clear();
+		} else {
+			for ( auto const &event : events ) {
+				socket_.events.erase( event );
+			}
+			for ( auto const &deviceId : devices ) {
+				socket_.devices.erase( deviceId );
+			}
+			for ( auto const &pluginId : plugins ) {
+				socket_.plugins.erase( pluginId );
+			}
+		}
+		this->_indexSocket( socket_, true );
+	};
+
+	void WebServer::_indexSocket( t_socket& socket_, bool index_ ) {
+		// NOTE Only call this method with held lock on logins mutex.
+		if (
+			socket_.devices.empty()
+			&& socket_.plugins.empty()
+		) {
+			if ( index_ ) {
+				this->m_socketsUnfiltered.insert( &socket_ );
+			} else {
+				this->m_socketsUnfiltered.erase( &socket_ );
+			}
+		}
+		auto update = [&]( std::unordered_map<unsigned int, std::set<t_socket*>>& index_, const std::set<unsigned int>& ids_, bool insert_ ) {
+			for ( auto const &id : ids_ ) {
+				if ( insert_ ) {
+					index_[id].insert( &socket_ );
+				} else {
+					auto find = index_.find( id );
+					if ( find != index_.end() ) {
+						find->second.erase( &socket_ );
+						if ( find->second.empty() ) {
+							index_.erase( find );
+						}
+					}
+				}
+			}
+		};
+		update( this->m_socketsByDevice, socket_.devices, index_ );
+		update( this->m_socketsByPlugin, socket_.plugins, index_ );
+	};
+
+	void WebServer::_removeSocket( const Network::Connection* connection_ ) {
+		// NOTE Only call this method with held lock on logins mutex.
+		auto find = this->m_sockets.find( connection_ );
+		if ( find == this->m_sockets.end() ) {
+			return;
+		}
+		this->_indexSocket( find->second, false );
+		auto login = this->m_logins.find( find->second.token );
+		if ( login != this->m_logins.end() ) {
+			auto& sockets = login->second.sockets;
+			sockets.erase( std::remove_if( sockets.begin(), sockets.end(), [connection_]( const std::weak_ptr<Network::Connection>& socket_ ) {
+				auto connection = socket_.lock();
+				return ! connection || connection.get() == connection_;
+			} ), sockets.end() );
+		}
+		this->m_sockets.erase( find );
 	};
 
 	std::string WebServer::_hash( const std::string& data_ ) const {
@@ -292,61 +594,100 @@ namespace micasa {
 	};
 
 	inline void WebServer::_processRequest( std::shared_ptr<Network::Connection> connection_ ) {
-		auto uri = connection_->getUri();
-		auto headers = connection_->getHeaders();
+		auto request = connection_->getRequest();
+		if ( __unlikely( request == nullptr ) ) {
+			return;
+		}
+		const StringView& uri = request->uri;
 
 		// A websocket connection starts of as a regular http request with an additional header requesting to upgrade
 		// the connection once the http handshake is done.
-		auto find = headers.find( "Upgrade" );
 		if ( __unlikely(
-			find != headers.end()
-			&& uri.substr( 0, 5 ) == "/live"
+			request->hasHeader( "Upgrade" )
+			&& uri.startsWith( "/live" )
 		) ) {
-			std::string token = uri.substr( 6 );
+			std::string token = uri.substr( 6 ).str();
 			std::lock_guard<std::mutex> lock( this->m_loginsMutex );
 			auto find = this->m_logins.find( token );
 			if (
 				find != this->m_logins.end()
 				&& find->second.valid > system_clock::now()
 			) {
+				this->_removeSocket( connection_.get() );
 				find->second.sockets.push_back( connection_ );
+				t_socket& socket = this->m_sockets[connection_.get()];
+				socket.connection = connection_;
+				socket.token = token;
+				socket.count = 0;
+				socket.sequence = 0;
+				this->_indexSocket( socket, true );
+
+				// Clients can request one of the compact binary encodings, in which case the dictionary of keys is
+				// queued as the first message.
+				socket.encoding = SocketEncoding::JSON;
+				if ( request->hasParam( "encoding" ) ) {
+					std::string encoding = request->getParam( "encoding" ).str();
+					try {
+						socket.encoding = WebServer::resolveTextSocketEncoding( encoding );
+					} catch( std::invalid_argument ex_ ) {
+						Logger::logr( Logger::LogLevel::WARNING, this, "Invalid socket encoding %s.", encoding.c_str() );
+					}
+				}
+				if ( socket.encoding != SocketEncoding::JSON ) {
+					json dictionary = {
+						{ "event", "dictionary" },
+						{ "data", WebServer::SocketDictionary }
+					};
+					std::vector<uint8_t> bytes = ( socket.encoding == SocketEncoding::MSGPACK ) ? json::to_msgpack( dictionary ) : json::to_cbor( dictionary );
+					socket.batch.append( 5, '\0' );
+					socket.batch.append( bytes.begin(), bytes.end() );
+					socket.count = 1;
+					this->_scheduleBroadcasts();
+				}
 			}
 
 		// Serve static files for requests NOT targetting the api.
-		} else if ( __unlikely( uri.substr( 0, 4 ) != "/api" ) ) {
+		} else if ( __unlikely( ! uri.startsWith( "/api" ) ) ) {
 
+			// NOTE assets that are kept in memory are already served by the intercept function on the poll thread.
 			connection_->serve( "www" );
 
 		// Serve dynamic data for requests targettig the api.
 		} else {
 
-			auto method = WebServer::resolveTextMethod( connection_->getMethod() );
-			auto data = connection_->getBody();
-			auto params = connection_->getParams();
+			auto method = WebServer::resolveTextMethod( request->method.str() );
 
 			// Some query paramters might override other request characteristics.
-			try {
-				method = WebServer::resolveTextMethod( params.at( "_method" ) );
-			} catch( ... ) { };
-			try {
-				headers["Authorization"] = params.at( "_token" );
-			} catch( ... ) { };
+			if ( request->hasParam( "_method" ) ) {
+				try {
+					method = WebServer::resolveTextMethod( request->getParam( "_method" ).str() );
+				} catch( ... ) { };
+			}
+			bool authorization = request->hasHeader( "Authorization" );
+			StringView token = request->getHeader( "Authorization" );
+			if ( request->hasParam( "_token" ) ) {
+				authorization = true;
+				token = request->getParam( "_token" );
+			}
 
 			// Prepare the input json object that holds all the supplied parameters (both in the body as in the query
 			// string).
 			json input = json::object();
 			if (
 				WebServer::resolveMethod( method & ( Method::POST | Method::PUT | Method::PATCH ) ) > 0
-				&& data.length() > 2
+				&& request->body.size() > 2
 			) {
 				try {
-					input = json::parse( data );
+					input = json::parse( request->body.data(), request->body.data() + request->body.size() );
 				} catch( json::exception ex_ ) {
 					Logger::log( Logger::LogLevel::ERROR, this, ex_.what() );
 				}
 			}
-			for ( auto paramsIt = params.begin(); paramsIt != params.end(); paramsIt++ ) {
-				input[(*paramsIt).first] = (*paramsIt).second;
+			if ( ! input.is_object() ) {
+				input = { { "data", input } };
+			}
+			for ( auto const &param : request->params ) {
+				input[param.first.str()] = param.second.str();
 			}
 
 			// If a username/password combination, or an authorization token was provided, match it with a user or
@@ -379,15 +720,14 @@ namespace micasa {
 			}
 			if (
 				user == nullptr
-				&& headers.find( "Authorization" ) != headers.end()
+				&& authorization
 			) {
 				try {
 					std::unique_lock<std::mutex> loginsLock( this->m_loginsMutex );
-					std::string token = headers.at( "Authorization" );
-					auto login = this->m_logins.at( token );
+					auto login = this->m_logins.at( token.str() );
 					if ( login.valid > system_clock::now() ) {
 						user = login.user;
-						input["_token"] = token;
+						input["_token"] = token.str();
 					}
 					loginsLock.unlock();
 				} catch( std::out_of_range ex_ ) {
@@ -401,78 +741,161 @@ namespace micasa {
 				{ "code", 204 }, // no content
 			};
 
-			try {
-				for ( auto &resource : this->m_resources ) {
-					std::regex pattern( resource.uri );
-					std::smatch match;
-					if (
-						std::regex_search( uri, match, pattern )
-						&& ( resource.methods & method ) == method
-					) {
-						// Add each matched paramter to the input for the callback to determine which individual
-						// resource was accessed.
-						for ( unsigned int i = 1; i < match.size(); i++ ) {
-							if ( match.str( i ).size() > 0 ) {
-								input["$" + std::to_string( i )] = match.str( i );
-							}
-						}
-						resource.callback( user, input, method, output );
-					}
-				}
-
-				// If no callbacks we're called the code should still be 204 and should be replaced with a 404
-				// indicating a resource not found error.
-				if ( output["code"].get<unsigned int>() == 204 ) {
-					output["result"] = "ERROR";
-					output["code"] = 404;
-					output["error"] = "Resource.Not.Found";
-					output["message"] = "The requested resource was not found.";
-				}
-
-			} catch( const ResourceException& exception_ ) {
-				output["result"] = "ERROR";
-				output["code"] = exception_.code;
-				output["error"] = exception_.error;
-				output["message"] = exception_.message;
-			} catch( std::exception& exception_ ) { // also catches json::exception
-				output["result"] = "ERROR";
-				output["code"] = 500;
-				output["error"] = "Resource.Failure";
-				output["message"] = "The requested resource failed to load.";
-				Logger::log( Logger::LogLevel::ERROR, this, exception_.what() );
-#ifndef _DEBUG
-			} catch( ... ) {
-				output["result"] = "ERROR";
-				output["code"] = 500;
-				output["error"] = "Resource.Failure";
-				output["message"] = "The requested resource failed to load.";
-#endif // _DEBUG
+			// Resources that support conditional requests are tagged with the current version of the api data. If the
+			// client already has the current version a 304 is returned without invoking the resource callback.
+			std::string etag;
+
+			// Resources with large results can supply a function that produces the rows of the data property instead
+			// of adding the rows to the output directly. These rows are then streamed to the client.
+			t_rowsFunc rows;
+
+			if ( ! this->_callResource( user, uri, method, input, output, rows, etag, request->getHeader( "If-None-Match" ) ) ) {
+				this->m_scheduler.schedule( 0, 1, this, [connection_,etag]( std::shared_ptr<Scheduler::Task<>> ) {
+					connection_->reply( "", 304, {
+						{ "Access-Control-Allow-Origin", "*" },
+						{ "Cache-Control", "no-cache, must-revalidate" },
+						{ "ETag", etag }
+					} );
+				} );
+				return;
 			}
 
 #ifdef _DEBUG
 			assert( output.find( "result" ) != output.end() && output["result"].is_string() && "API requests should contain a string result property." );
 			assert( output.find( "code" ) != output.end() && output["code"].is_number() && "API requests should contain a numeric code property." );
-			const std::string content = output.dump( 4 );
-#else
-			const std::string content = output.dump();
 #endif // _DEBUG
 
 			unsigned int code = output["code"].get<unsigned int>();
-			this->m_scheduler.schedule( code == 401 ? SCHEDULER_INTERVAL_3SEC : 0, 1, this, [connection_,content,code]( std::shared_ptr<Scheduler::Task<>> ) {
-				connection_->reply( content, code, {
-					{ "Content-Type", "Content-type: application/json" },
-					{ "Access-Control-Allow-Origin", "*" },
-					{ "Cache-Control", "no-cache, no-store, must-revalidate" }
+			std::map<std::string, std::string> replyHeaders = {
+				{ "Content-Type", "Content-type: application/json" },
+				{ "Access-Control-Allow-Origin", "*" },
+				{ "Cache-Control", "no-cache, no-store, must-revalidate" }
+			};
+			if (
+				! etag.empty()
+				&& code == 200
+			) {
+				replyHeaders["Cache-Control"] = "no-cache, must-revalidate";
+				replyHeaders["ETag"] = etag;
+			}
+
+			ContentEncoding encoding = ContentEncoding::IDENTITY;
+			if ( this->m_compressionLevel > 0 ) {
+				encoding = WebServer::_negotiateEncoding( request->getHeader( "Accept-Encoding" ) );
+			}
+
+			if (
+				rows != nullptr
+				&& code == 200
+			) {
+				if ( encoding != ContentEncoding::IDENTITY ) {
+					replyHeaders["Content-Encoding"] = WebServer::resolveTextContentEncoding( encoding );
+					replyHeaders["Vary"] = "Accept-Encoding";
+				}
+				this->m_scheduler.schedule( 0, 1, this, [this,connection_,output,rows,replyHeaders,encoding]( std::shared_ptr<Scheduler::Task<>> ) {
+					this->_streamJson( connection_, output, rows, replyHeaders, encoding );
 				} );
+				return;
+			}
+
+#ifdef _DEBUG
+			std::string content = output.dump( 4 );
+#else
+			std::string content = output.dump();
+#endif // _DEBUG
+
+			// Small responses are send as-is, the compression overhead outweighs the gain in size.
+			if (
+				encoding != ContentEncoding::IDENTITY
+				&& content.size() >= WEBSERVER_COMPRESSION_MIN_BYTES
+			) {
+				content = WebServer::_compress( content, encoding, this->m_compressionLevel );
+				replyHeaders["Content-Encoding"] = WebServer::resolveTextContentEncoding( encoding );
+				replyHeaders["Vary"] = "Accept-Encoding";
+			}
+			this->m_scheduler.schedule( code == 401 ? SCHEDULER_INTERVAL_3SEC : 0, 1, this, [connection_,content,code,replyHeaders]( std::shared_ptr<Scheduler::Task<>> ) {
+				connection_->reply( content, code, replyHeaders );
 			} );
 		}
 	};
 
+	bool WebServer::_callResource( std::shared_ptr<User> user_, const StringView& uri_, const Method& method_, json& input_, json& output_, t_rowsFunc& rows_, std::string& etag_, const StringView& ifNoneMatch_ ) {
+		// NOTE returns false if the resource is conditional and the client already has the current version, in which
+		// case the callback is not invoked. Errors are reported in the output json.
+		try {
+			std::vector<std::pair<unsigned int, std::string>> captures;
+			const t_route* route = this->_matchRoute( uri_, method_, captures );
+			if ( __likely( route != nullptr ) ) {
+				const_cast<t_route*>( route )->hits++;
+
+				const t_resource& resource = this->m_resources[route->resource];
+				if (
+					method_ == Method::GET
+					&& resource.conditional
+				) {
+					etag_ = "\"" + this->m_epoch + "-" + std::to_string( user_ != nullptr ? user_->getId() : 0 ) + "-" + std::to_string( this->m_version + g_controller->getVersion() ) + "\"";
+					if ( ifNoneMatch_ == etag_ ) {
+						return false;
+					}
+				}
+
+				// Add each captured paramter to the input for the callback to determine which individual resource
+				// was accessed.
+				for ( auto const &capture : captures ) {
+					input_["$" + std::to_string( capture.first )] = capture.second;
+				}
+				resource.callback( user_, input_, method_, output_, rows_ );
+
+				// Successful modifications through the api invalidate the tags of all conditional resources. Batches
+				// are posted but only invalidate the tags through the modifications they contain.
+				if (
+					method_ != Method::GET
+					&& resource.uri != "/api/batch"
+					&& output_["code"].get<unsigned int>() < 300
+				) {
+					this->m_version++;
+				}
+			} else {
+				this->m_routeMisses++;
+			}
+
+			// If no callbacks we're called the code should still be 204 and should be replaced with a 404
+			// indicating a resource not found error.
+			if ( output_["code"].get<unsigned int>() == 204 ) {
+				output_["result"] = "ERROR";
+				output_["code"] = 404;
+				output_["error"] = "Resource.Not.Found";
+				output_["message"] = "The requested resource was not found.";
+			}
+
+		} catch( const ResourceException& exception_ ) {
+			output_["result"] = "ERROR";
+			output_["code"] = exception_.code;
+			output_["error"] = exception_.error;
+			output_["message"] = exception_.message;
+		} catch( std::exception& exception_ ) { // also catches json::exception
+			output_["result"] = "ERROR";
+			output_["code"] = 500;
+			output_["error"] = "Resource.Failure";
+			output_["message"] = "The requested resource failed to load.";
+			Logger::log( Logger::LogLevel::ERROR, this, exception_.what() );
+#ifndef _DEBUG
+		} catch( ... ) {
+			output_["result"] = "ERROR";
+			output_["code"] = 500;
+			output_["error"] = "Resource.Failure";
+			output_["message"] = "The requested resource failed to load.";
+#endif // _DEBUG
+		}
+		return true;
+	};
+
 	void WebServer::_installPluginResourceHandler() {
-		this->m_resources[0] = {
-			"^/api/plugins(/([0-9,]+|settings))?$",
+		this->_addResource( {
+			"/api/plugins[/{2:ids|settings}]",
 			WebServer::Method::GET | WebServer::Method::POST | WebServer::Method::PUT | WebServer::Method::DELETE,
-			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+			true,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
 				if (
 					user_ == nullptr
 					|| user_->getRights() < User::Rights::INSTALLER
@@ -624,6 +1047,8 @@ namespace micasa {
 							for ( auto& plugin : plugins ) {
 								g_controller->removePlugin( plugin );
 							}
+							g_controller->invalidateScriptRoutes();
+							g_controller->invalidateLinkRoutes();
 							output_["code"] = 200;
 						}
 						break;
@@ -741,14 +1166,15 @@ namespace micasa {
 					default: break;
 				}
 			}
-		};
+		} );
 	};
 
 	void WebServer::_installDeviceResourceHandler() {
-		this->m_resources[1] = {
-			"^/api(/(plugins|scripts)/([0-9]+))?/devices(/([0-9,]+))?$",
+		this->_addResource( {
+			"/api[/{2:plugins|scripts}/{3:id}]/devices[/{5:ids}]",
 			WebServer::Method::GET | WebServer::Method::PUT | WebServer::Method::PATCH | WebServer::Method::DELETE,
-			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+			false,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
 				if (
 					user_ == nullptr
 					|| user_->getRights() < User::Rights::VIEWER
@@ -779,7 +1205,17 @@ namespace micasa {
 
 				switch( method_ ) {
 					case WebServer::Method::GET: {
-						auto find = input_.find( "$5" );
+						// The fields parameter limits the rendered json of each device to the requested fields.
+						std::vector<std::string> fields;
+						auto find = input_.find( "fields" );
+						if ( find != input_.end() ) {
+							fields = stringSplit( jsonGet<>( *find ), ',' );
+						}
+						auto requested = [&]( const std::string& field_ ) -> bool {
+							return fields.empty() || std::find( fields.begin(), fields.end(), field_ ) != fields.end();
+						};
+
+						find = input_.find( "$5" );
 						if ( __unlikely( find != input_.end() ) ) {
 							if ( scriptId > -1 ) {
 								return;
@@ -793,26 +1229,32 @@ namespace micasa {
 									device = g_controller->getDeviceById( std::stoi( deviceIds[0] ) );
 								}
 								if ( device ) {
-									output_["data"] = device->getJson();
+									output_["data"] = device->getJson( fields );
 									if ( user_->getRights() >= User::Rights::INSTALLER ) {
-										output_["data"]["settings"] = device->getSettingsJson();
-										output_["data"]["scripts"] = g_database->getQueryColumn<unsigned int>(
-											"SELECT s.`id` "
-											"FROM `scripts` s, `x_device_scripts` x "
-											"WHERE s.`id`=x.`script_id` "
-											"AND x.`device_id`=%d "
-											"ORDER BY s.`id` ASC",
-											device->getId()
-										);
-										output_["data"]["links"] = g_database->getQueryColumn<unsigned int>(
-											"SELECT DISTINCT CASE WHEN l.`device_id`=%d THEN l.`target_device_id` ELSE l.`device_id` END "
-											"FROM `links` l "
-											"WHERE l.`device_id`=%d "
-											"OR l.`target_device_id`=%d ",
-											device->getId(),
-											device->getId(),
-											device->getId()
-										);
+										if ( requested( "settings" ) ) {
+											output_["data"]["settings"] = device->getSettingsJson();
+										}
+										if ( requested( "scripts" ) ) {
+											output_["data"]["scripts"] = g_database->getQueryColumn<unsigned int>(
+												"SELECT s.`id` "
+												"FROM `scripts` s, `x_device_scripts` x "
+												"WHERE s.`id`=x.`script_id` "
+												"AND x.`device_id`=%d "
+												"ORDER BY s.`id` ASC",
+												device->getId()
+											);
+										}
+										if ( requested( "links" ) ) {
+											output_["data"]["links"] = g_database->getQueryColumn<unsigned int>(
+												"SELECT DISTINCT CASE WHEN l.`device_id`=%d THEN l.`target_device_id` ELSE l.`device_id` END "
+												"FROM `links` l "
+												"WHERE l.`device_id`=%d "
+												"OR l.`target_device_id`=%d ",
+												device->getId(),
+												device->getId(),
+												device->getId()
+											);
+										}
 									}
 								} else {
 									return; // 404
@@ -827,18 +1269,43 @@ namespace micasa {
 										device = g_controller->getDeviceById( std::stoi( deviceId ) );
 									}
 									if ( device != nullptr ) {
-										output_["data"] += device->getJson();
+										output_["data"] += device->getJson( fields );
 									} else {
 										return; // 404
 									}
 								}
 							}
 						} else {
-							output_["data"] = json::array();
+							// When a since sequence is provided only the devices that have changed after that sequence
+							// are returned, together with the ids of the devices that were removed (or are no longer
+							// part of the list). If the changelog no longer reaches back to the requested sequence the
+							// full list is returned instead. The current sequence is read first so that changes made
+							// while the list is being built are always included in the next sync. Changes that fall
+							// outside of a page would be lost, so a delta cannot be combined with pagination.
+							if (
+								input_.find( "since" ) != input_.end()
+								&& (
+									input_.find( "limit" ) != input_.end()
+									|| input_.find( "after" ) != input_.end()
+								)
+							) {
+								throw WebServer::ResourceException( 400, "Device.Invalid.Parameters", "The since parameter cannot be combined with limit or after." );
+							}
+							unsigned long long sequence = g_controller->getSequence();
+							std::unordered_set<unsigned int> changed;
+							std::vector<unsigned int> changedIds;
+							std::vector<unsigned int> removedIds;
+							bool delta = (
+								input_.find( "since" ) != input_.end()
+								&& g_controller->getDeviceChanges( jsonGet<unsigned long long>( input_, "since" ), changedIds, removedIds )
+							);
+							if ( delta ) {
+								changed.insert( changedIds.begin(), changedIds.end() );
+							}
+
+							std::vector<std::shared_ptr<Device>> devices;
 							if ( plugin != nullptr ) {
-								for ( auto& device : plugin->getAllDevices() ) {
-									output_["data"] += device->getJson();
-								}
+								devices = plugin->getAllDevices();
 							} else if ( scriptId > -1 ) {
 								auto deviceIds = g_database->getQueryColumn<unsigned int>(
 									"SELECT DISTINCT `device_id` "
@@ -848,15 +1315,135 @@ namespace micasa {
 									scriptId
 								);
 								for ( auto& deviceId : deviceIds ) {
-									output_["data"] += g_controller->getDeviceById( deviceId )->getJson();
+									auto device = g_controller->getDeviceById( deviceId );
+									if ( device != nullptr ) {
+										devices.push_back( device );
+									}
 								}
 							} else {
-								for ( auto& device : g_controller->getAllDevices() ) {
-									if ( device->isEnabled() ) {
-										output_["data"] += device->getJson();
+								devices = g_controller->getAllDevices();
+							}
+
+							// The list can be narrowed down by type, subtype, plugin and enabled state. All filters
+							// are evaluated on the devices directly, so the json is only rendered for the devices that
+							// end up in the response. Without an explicit enabled filter the list of all devices only
+							// contains enabled devices.
+							std::string type = jsonGet<>( input_, "type", std::string() );
+							std::string subtype = jsonGet<>( input_, "subtype", std::string() );
+							int pluginId = jsonGet<int>( input_, "plugin_id", -1 );
+							int enabled = ( plugin == nullptr && scriptId == -1 ) ? 1 : -1;
+							find = input_.find( "enabled" );
+							if ( find != input_.end() ) {
+								enabled = jsonGet<bool>( *find ) ? 1 : 0;
+							}
+							devices.erase( std::remove_if( devices.begin(), devices.end(), [&]( const std::shared_ptr<Device>& device_ ) -> bool {
+								return (
+									( ! type.empty() && Device::resolveTextType( device_->getType() ) != type )
+									|| ( ! subtype.empty() && device_->getSubType() != subtype )
+									|| ( pluginId > -1 && device_->getPlugin()->getId() != (unsigned int)pluginId )
+									|| ( enabled > -1 && device_->isEnabled() != ( enabled == 1 ) )
+									|| ( delta && changed.erase( device_->getId() ) == 0 ) // NOTE should be evaluated last
+								);
+							} ), devices.end() );
+
+							// Sorting is done on properties that are available without rendering the json, with the
+							// id of the device as tiebreaker so that the order is stable between requests. A minus
+							// sign in front of the field reverses the order. Paginated lists are always sorted.
+							bool paginate = (
+								input_.find( "limit" ) != input_.end()
+								|| input_.find( "after" ) != input_.end()
+							);
+							find = input_.find( "sort" );
+							if (
+								find != input_.end()
+								|| paginate
+							) {
+								std::string sort = ( find != input_.end() ) ? jsonGet<>( *find ) : "id";
+								bool descending = ( ! sort.empty() && sort.at( 0 ) == '-' );
+								if ( descending ) {
+									sort = sort.substr( 1 );
+								}
+								std::function<json( const Device& device_ )> key;
+								if ( sort == "id" ) {
+									key = []( const Device& device_ ) -> json { return device_.getId(); };
+								} else if ( sort == "name" ) {
+									key = []( const Device& device_ ) -> json { return device_.getName(); };
+								} else if ( sort == "label" ) {
+									key = []( const Device& device_ ) -> json { return device_.getLabel(); };
+								} else if ( sort == "type" ) {
+									key = []( const Device& device_ ) -> json { return Device::resolveTextType( device_.getType() ); };
+								} else if ( sort == "subtype" ) {
+									key = []( const Device& device_ ) -> json { return device_.getSubType(); };
+								} else if ( sort == "plugin_id" ) {
+									key = []( const Device& device_ ) -> json { return device_.getPlugin()->getId(); };
+								} else if ( sort == "sequence" ) {
+									key = []( const Device& device_ ) -> json { return g_controller->getDeviceSequence( device_.getId() ); };
+								} else if ( sort == "age" ) {
+									key = []( const Device& device_ ) -> json { return -duration_cast<microseconds>( device_.getUpdated().time_since_epoch() ).count(); };
+								} else {
+									throw WebServer::ResourceException( 400, "Device.Invalid.Sort", "The supplied sort field is invalid." );
+								}
+
+								std::vector<std::pair<json, std::shared_ptr<Device>>> keyed;
+								keyed.reserve( devices.size() );
+								for ( auto const& device : devices ) {
+									keyed.push_back( { key( *device ), device } );
+								}
+								auto less = [descending]( const std::pair<json, std::shared_ptr<Device>>& a_, const std::pair<json, std::shared_ptr<Device>>& b_ ) -> bool {
+									if ( a_.first != b_.first ) {
+										return descending ? b_.first < a_.first : a_.first < b_.first;
 									}
+									return a_.second->getId() < b_.second->getId();
+								};
+								std::sort( keyed.begin(), keyed.end(), less );
+
+								// The cursor is the id of the last device of the previous page. The page continues
+								// right after the position that device has in the sorted list.
+								auto begin = keyed.begin();
+								find = input_.find( "after" );
+								if ( find != input_.end() ) {
+									unsigned int after = jsonGet<unsigned int>( *find );
+									auto cursor = g_controller->getDeviceById( after );
+									if ( cursor != nullptr ) {
+										begin = std::upper_bound( keyed.begin(), keyed.end(), std::make_pair( key( *cursor ), cursor ), less );
+									} else if ( sort == "id" ) {
+										begin = std::upper_bound( keyed.begin(), keyed.end(), std::make_pair( json( after ), cursor ), [descending]( const std::pair<json, std::shared_ptr<Device>>& a_, const std::pair<json, std::shared_ptr<Device>>& b_ ) -> bool {
+											return descending ? b_.first < a_.first : a_.first < b_.first;
+										} );
+									} else {
+										throw WebServer::ResourceException( 400, "Device.Invalid.Cursor", "The supplied cursor is invalid." );
+									}
+								}
+								auto end = keyed.end();
+								unsigned int limit = jsonGet<unsigned int>( input_, "limit", 0 );
+								if (
+									limit > 0
+									&& (unsigned int)std::distance( begin, end ) > limit
+								) {
+									end = begin + limit;
+									output_["next"] = ( end - 1 )->second->getId();
+								}
+								output_["total"] = devices.size();
+
+								devices.clear();
+								for ( auto keyedIt = begin; keyedIt != end; keyedIt++ ) {
+									devices.push_back( keyedIt->second );
 								}
 							}
+
+							output_["data"] = json::array();
+							for ( auto const& device : devices ) {
+								output_["data"] += device->getJson( fields );
+							}
+
+							output_["sequence"] = sequence;
+							output_["delta"] = delta;
+							if ( delta ) {
+								// NOTE devices that changed but were not included in the list (for instance because they
+								// were disabled or moved out of scope) should be dropped by the client as well.
+								removedIds.insert( removedIds.end(), changed.begin(), changed.end() );
+								output_["removed"] = removedIds;
+							}
 						}
 						output_["code"] = 200;
 						break;
@@ -882,6 +1469,8 @@ namespace micasa {
 							}
 							for ( auto& device : devices ) {
 								device->getPlugin()->removeDevice( device );
+								g_controller->invalidateScriptRoutes( device->getId() );
+								g_controller->invalidateLinkRoutes( device->getId() );
 							}
 							output_["code"] = 200;
 						}
@@ -945,6 +1534,7 @@ namespace micasa {
 							if ( find != deviceData.end() ) {
 								auto scripts = jsonGet<std::vector<unsigned int>>( *find );
 								device->setScripts( scripts );
+								g_controller->invalidateScriptRoutes( device->getId() );
 								deviceData.erase( find );
 							}
 
@@ -953,6 +1543,7 @@ namespace micasa {
 							device->getSettings()->put( deviceData );
 							if ( device->getSettings()->isDirty() ) {
 								device->getSettings()->commit();
+								g_controller->indexDevice( device ); // name might have changed
 							}
 
 							output_["code"] = 200;
@@ -1007,12 +1598,13 @@ namespace micasa {
 					default: break;
 				}
 			}
-		};
+		} );
 
-		this->m_resources[2] = {
-			"^/api/devices/([0-9]+)/data$",
+		this->_addResource( {
+			"/api/devices/{1:id}/data",
 			WebServer::Method::GET | WebServer::Method::POST,
-			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+			false,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
 				if (
 					user_ == nullptr
 					|| user_->getRights() < User::Rights::VIEWER
@@ -1030,23 +1622,35 @@ namespace micasa {
 					}
 				}
 
+				// The history of a device can be quite large, so the rows are streamed directly from the database to the
+				// client. The parameters are validated up front because the streaming happens after this callback.
 				try {
+					unsigned int range = jsonGet<unsigned int>( input_, "range" );
+					std::string interval = jsonGet<>( input_, "interval" );
 					switch( device->getType() ) {
 						case Device::Type::SWITCH:
-							output_["data"] = std::static_pointer_cast<Switch>( device )
-								->getData( jsonGet<unsigned int>( input_, "range" ), jsonGet<>( input_, "interval" ) );
+							rows_ = [device,range,interval]( const std::function<void( const json& row_ )>& process_ ) {
+								std::static_pointer_cast<Switch>( device )->getData( range, interval, process_ );
+							};
 							break;
-						case Device::Type::COUNTER:
-							output_["data"] = std::static_pointer_cast<Counter>( device )
-								->getData( jsonGet<unsigned int>( input_, "range" ), jsonGet<>( input_, "interval" ), jsonGet<>( input_, "group" ) );
+						case Device::Type::COUNTER: {
+							std::string group = jsonGet<>( input_, "group" );
+							rows_ = [device,range,interval,group]( const std::function<void( const json& row_ )>& process_ ) {
+								std::static_pointer_cast<Counter>( device )->getData( range, interval, group, process_ );
+							};
 							break;
-						case Device::Type::LEVEL:
-							output_["data"] = std::static_pointer_cast<Level>( device )
-								->getData( jsonGet<unsigned int>( input_, "range" ), jsonGet<>( input_, "interval" ), jsonGet<>( input_, "group" ) );
+						}
+						case Device::Type::LEVEL: {
+							std::string group = jsonGet<>( input_, "group" );
+							rows_ = [device,range,interval,group]( const std::function<void( const json& row_ )>& process_ ) {
+								std::static_pointer_cast<Level>( device )->getData( range, interval, group, process_ );
+							};
 							break;
+						}
 						case Device::Type::TEXT:
-							output_["data"] = std::static_pointer_cast<Text>( device )
-								->getData( jsonGet<unsigned int>( input_, "range" ), jsonGet<>( input_, "interval" ) );
+							rows_ = [device,range,interval]( const std::function<void( const json& row_ )>& process_ ) {
+								std::static_pointer_cast<Text>( device )->getData( range, interval, process_ );
+							};
 							break;
 					}
 				} catch( ... ) {
@@ -1055,14 +1659,15 @@ namespace micasa {
 
 				output_["code"] = 200;
 			}
-		};
+		} );
 	};
 
 	void WebServer::_installLinkResourceHandler() {
-		this->m_resources[3] = {
-			"^/api(/devices/([0-9]+))?/links(/([0-9]+|settings))?$",
+		this->_addResource( {
+			"/api[/devices/{2:id}]/links[/{4:id|settings}]",
 			WebServer::Method::GET | WebServer::Method::PUT | WebServer::Method::POST | WebServer::Method::DELETE,
-			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+			true,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
 				if (
 					user_ == nullptr
 					|| user_->getRights() < User::Rights::INSTALLER
@@ -1071,11 +1676,7 @@ namespace micasa {
 				}
 
 				int deviceId = -1;
-				auto find = input_.find( "$1" );
-				if (
-					find != input_.end()
-					&& jsonGet<>( *find ).substr( 0, 8 ) == "/devices"
-				) {
+				if ( input_.find( "$2" ) != input_.end() ) {
 					deviceId = jsonGet<int>( input_, "$2" );
 				}
 
@@ -1197,7 +1798,7 @@ namespace micasa {
 
 				json link = json::object();
 				int linkId = -1;
-				find = input_.find( "$4" );
+				auto find = input_.find( "$4" );
 				if ( find != input_.end() ) {
 					try {
 						if (
@@ -1261,6 +1862,7 @@ namespace micasa {
 								"WHERE `id`=%d",
 								linkId
 							);
+							g_controller->invalidateLinkRoutes( link["device_id"].get<unsigned int>() );
 							output_["code"] = 200;
 						}
 						break;
@@ -1322,21 +1924,24 @@ namespace micasa {
 								linkData["clear"].is_null() ? 0 : ( linkData["clear"].get<bool>() ? 1 : 0 ),
 								linkId
 							);
+							g_controller->invalidateLinkRoutes( link["device_id"].get<unsigned int>() );
 							output_["code"] = 200;
 						}
+						g_controller->invalidateLinkRoutes( linkData["device_id"].get<unsigned int>() );
 						break;
 					}
 					default: break;
 				}
 			}
-		};
+		} );
 	};
 
 	void WebServer::_installScriptResourceHandler() {
-		this->m_resources[4] = {
-			"^/api/scripts(/([0-9]+|settings))?$",
+		this->_addResource( {
+			"/api/scripts[/{2:id|settings}]",
 			WebServer::Method::GET | WebServer::Method::POST | WebServer::Method::PUT | WebServer::Method::DELETE,
-			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+			false, // NOTE the statistics of the scripts change without bumping a version
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
 				if (
 					user_ == nullptr
 					|| user_->getRights() < User::Rights::INSTALLER
@@ -1407,6 +2012,7 @@ namespace micasa {
 						if ( scriptId != -1 ) {
 							output_["data"] = script;
 							output_["data"]["settings"] = fGetSettings();
+							output_["data"]["statistics"] = g_controller->getScriptStatistics( scriptId );
 							output_["data"]["device_ids"] = g_database->getQueryColumn<unsigned int>(
 								"SELECT DISTINCT `device_id` "
 								"FROM `x_device_scripts` "
@@ -1420,6 +2026,9 @@ namespace micasa {
 								"FROM `scripts` "
 								"ORDER BY `id` ASC"
 							);
+							for ( auto& script : output_["data"] ) {
+								script["statistics"] = g_controller->getScriptStatistics( script["id"].get<unsigned int>() );
+							}
 						}
 						output_["code"] = 200;
 						break;
@@ -1427,11 +2036,22 @@ namespace micasa {
 
 					case WebServer::Method::DELETE: {
 						if ( scriptId != -1 ) {
+							auto deviceIds = g_database->getQueryColumn<unsigned int>(
+								"SELECT DISTINCT `device_id` "
+								"FROM `x_device_scripts` "
+								"WHERE `script_id`=%d",
+								scriptId
+							);
 							g_database->putQuery(
 								"DELETE FROM `scripts` "
 								"WHERE `id`=%d",
 								scriptId
 							);
+							g_controller->invalidateScript( scriptId );
+							for ( auto& deviceId : deviceIds ) {
+								g_controller->invalidateScriptRoutes( deviceId );
+							}
+							g_controller->invalidateTimers();
 							output_["code"] = 200;
 						}
 						break;
@@ -1482,6 +2102,17 @@ namespace micasa {
 								scriptData["enabled"].get<bool>() ? 1 : 0,
 								scriptId
 							);
+							g_controller->invalidateScript( scriptId );
+							auto deviceIds = g_database->getQueryColumn<unsigned int>(
+								"SELECT DISTINCT `device_id` "
+								"FROM `x_device_scripts` "
+								"WHERE `script_id`=%d",
+								scriptId
+							);
+							for ( auto& deviceId : deviceIds ) {
+								g_controller->invalidateScriptRoutes( deviceId );
+							}
+							g_controller->invalidateTimers();
 							output_["code"] = 200;
 						}
 						break;
@@ -1490,14 +2121,15 @@ namespace micasa {
 					default: break;
 				}
 			}
-		};
+		} );
 	};
 
 	void WebServer::_installTimerResourceHandler() {
-		this->m_resources[5] = {
-			"^/api(/devices/([0-9]+))?/timers(/([0-9]+|settings))?$",
+		this->_addResource( {
+			"/api[/devices/{2:id}]/timers[/{4:id|settings}]",
 			WebServer::Method::GET | WebServer::Method::POST | WebServer::Method::PUT | WebServer::Method::DELETE,
-			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+			true,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
 				if (
 					user_ == nullptr
 					|| user_->getRights() < User::Rights::INSTALLER
@@ -1508,11 +2140,7 @@ namespace micasa {
 				// Timers can be associated with scripts or devices. If a timer is associated with a device, the url
 				// should contain the device.
 				int deviceId = -1;
-				auto find = input_.find( "$1" );
-				if (
-					find != input_.end()
-					&& jsonGet<>( *find ).substr( 0, 8 ) == "/devices"
-				) {
+				if ( input_.find( "$2" ) != input_.end() ) {
 					deviceId = jsonGet<int>( input_, "$2" );
 				}
 
@@ -1623,7 +2251,7 @@ namespace micasa {
 
 				json timer = json::object();
 				int timerId = -1;
-				find = input_.find( "$4" );
+				auto find = input_.find( "$4" );
 				if ( find != input_.end() ) {
 					try {
 						if (
@@ -1702,6 +2330,7 @@ namespace micasa {
 								"WHERE `id`=%d",
 								timerId
 							);
+							g_controller->invalidateTimers();
 							output_["code"] = 200;
 						}
 						break;
@@ -1783,19 +2412,21 @@ namespace micasa {
 								jsonGet<>( timerData, "scripts" ).c_str()
 							);
 						}
+						g_controller->invalidateTimers();
 					}
 
 					default: break;
 				}
 			}
-		};
+		} );
 	};
 
 	void WebServer::_installUserResourceHandler() {
-		this->m_resources[6] = {
-			"^/api/user/(login|refresh)$",
+		this->_addResource( {
+			"/api/user/{1:login|refresh}",
 			WebServer::Method::GET | WebServer::Method::POST,
-			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+			false,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
 				std::lock_guard<std::mutex> lock( this->m_loginsMutex );
 				if (
 					method_ == WebServer::Method::POST
@@ -1841,12 +2472,13 @@ namespace micasa {
 					{ "token", token }
 				};
 			}
-		};
+		} );
 
-		this->m_resources[7] = {
-			"^/api/users(/([0-9]+|settings))?$",
+		this->_addResource( {
+			"/api/users[/{2:id|settings}]",
 			WebServer::Method::GET | WebServer::Method::POST | WebServer::Method::PUT | WebServer::Method::DELETE,
-			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+			true,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
 				if (
 					user_ == nullptr
 					|| user_->getRights() < User::Rights::ADMIN
@@ -2061,12 +2693,13 @@ namespace micasa {
 					default: break;
 				}
 			}
-		};
+		} );
 
-		this->m_resources[8] = {
-			"^/api/user/state/([0-9a-z_]+)$",
+		this->_addResource( {
+			"/api/user/state/{1:key}",
 			WebServer::Method::GET | WebServer::Method::PUT | WebServer::Method::DELETE,
-			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+			true,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
 				if (
 					user_ == nullptr
 					|| user_->getRights() < User::Rights::VIEWER
@@ -2115,6 +2748,647 @@ namespace micasa {
 					default: break;
 				}
 			}
+		} );
+	};
+
+	void WebServer::_installSystemResourceHandler() {
+		this->_addResource( {
+			"/api/system/{1:events|startup|routes}",
+			WebServer::Method::GET,
+			false,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
+				if (
+					user_ == nullptr
+					|| user_->getRights() < User::Rights::ADMIN
+				) {
+					throw WebServer::ResourceException( 403, "Access.Denied", "Access to the requested resource was denied." );
+				}
+
+				if ( "events" == jsonGet<>( input_, "$1" ) ) {
+					output_["data"] = g_controller->getEventQueueJson();
+					output_["code"] = 200;
+				} else if ( "startup" == jsonGet<>( input_, "$1" ) ) {
+					output_["data"] = g_controller->getStartupJson();
+					output_["code"] = 200;
+				} else if ( "routes" == jsonGet<>( input_, "$1" ) ) {
+					output_["data"] = this->_getRoutesJson();
+					output_["code"] = 200;
+				}
+			}
+		} );
+	};
+
+	void WebServer::_installBatchResourceHandler() {
+		this->_addResource( {
+			"/api/batch",
+			WebServer::Method::POST,
+			false,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_, t_rowsFunc& rows_ ) {
+				if (
+					user_ == nullptr
+					|| user_->getRights() < User::Rights::VIEWER
+				) {
+					throw WebServer::ResourceException( 403, "Access.Denied", "Access to the requested resource was denied." );
+				}
+
+				auto find = input_.find( "data" );
+				if (
+					find == input_.end()
+					|| ! (*find).is_array()
+					|| (*find).size() == 0
+				) {
+					throw WebServer::ResourceException( 400, "Batch.Invalid.Requests", "The supplied batch of requests is invalid." );
+				}
+				if ( (*find).size() > WEBSERVER_BATCH_MAX_REQUESTS ) {
+					throw WebServer::ResourceException( 400, "Batch.Too.Large", "The supplied batch contains too many requests." );
+				}
+				const json& requests = *find;
+
+				// Each request in the batch is dispatched to the same resource callbacks as regular requests, using
+				// the user that was authenticated for the batch itself. The output of each request is collected as a
+				// separate item with it's own code.
+				std::vector<json> results( requests.size() );
+				auto execute = [&]( size_t index_ ) {
+					json& output = results[index_];
+					output = {
+						{ "result", "OK" },
+						{ "code", 204 }, // no content
+					};
+					try {
+						const json& request = requests[index_];
+						Method method = WebServer::resolveTextMethod( jsonGet<>( request, "method", std::string( "GET" ) ) );
+						std::string uri = jsonGet<>( request, "uri" );
+
+						json input = json::object();
+						auto body = request.find( "body" );
+						if ( body != request.end() ) {
+							input = (*body).is_object() ? *body : json( { { "data", *body } } );
+						}
+
+						// The query string of the uri is added to the input just like the query string of a regular
+						// request.
+						size_t separator = uri.find( '?' );
+						if ( separator != std::string::npos ) {
+							std::vector<char> decoded( uri.size() + 1 );
+							for ( auto const& param : stringSplit( uri.substr( separator + 1 ), '&' ) ) {
+								size_t assignment = param.find( '=' );
+								if ( assignment != std::string::npos ) {
+									int keyLength = mg_url_decode( param.data(), assignment, decoded.data(), decoded.size(), 1 );
+									std::string key( decoded.data(), std::max( 0, keyLength ) );
+									int valueLength = mg_url_decode( param.data() + assignment + 1, param.size() - assignment - 1, decoded.data(), decoded.size(), 1 );
+									input[key] = std::string( decoded.data(), std::max( 0, valueLength ) );
+								}
+							}
+							uri.resize( separator );
+						}
+						if ( uri == "/api/batch" ) {
+							throw WebServer::ResourceException( 400, "Batch.Invalid.Request", "Batches cannot be nested." );
+						}
+
+						std::string etag;
+						t_rowsFunc rows;
+						this->_callResource( user_, StringView( uri.data(), uri.size() ), method, input, output, rows, etag, StringView() );
+
+						// NOTE rows that are usually streamed to the client are collected in the data property.
+						if (
+							rows != nullptr
+							&& output["code"].get<unsigned int>() == 200
+						) {
+							json data = json::array();
+							rows( [&]( const json& row_ ) {
+								data += row_;
+							} );
+							output["data"] = data;
+						}
+					} catch( const ResourceException& exception_ ) {
+						output["result"] = "ERROR";
+						output["code"] = exception_.code;
+						output["error"] = exception_.error;
+						output["message"] = exception_.message;
+					} catch( ... ) { // thrown by jsonGet and resolveTextMethod
+						output["result"] = "ERROR";
+						output["code"] = 400;
+						output["error"] = "Batch.Invalid.Request";
+						output["message"] = "The supplied request is invalid.";
+					}
+				};
+
+				// Consecutive GET requests don't depend on eachother and are executed in parallel. Any other request
+				// might modify data used by the requests that follow, so these are executed in order. The parallel
+				// requests are executed by the calling thread itself, assisted by a few helper tasks. Helpers that
+				// start after all requests have been picked up return right away, so the calling thread never waits
+				// for a helper that didn't get a thread of it's own.
+				for ( size_t index = 0; index < requests.size(); ) {
+					size_t end = index;
+					while (
+						end < requests.size()
+						&& requests[end].is_object()
+						&& jsonGet<>( requests[end], "method", std::string( "GET" ) ) == "GET"
+					) {
+						end++;
+					}
+					if ( end - index > 1 ) {
+						auto run = std::make_shared<t_batchRun>();
+						run->next = index;
+						run->end = end;
+						run->helpers = 0;
+						auto work = [run,&execute]() {
+							std::unique_lock<std::mutex> runLock( run->mutex );
+							while ( run->next < run->end ) {
+								size_t next = run->next++;
+								runLock.unlock();
+								execute( next );
+								runLock.lock();
+							}
+						};
+						for ( size_t helper = 0; helper < std::min<size_t>( end - index - 1, WEBSERVER_BATCH_MAX_HELPERS ); helper++ ) {
+							// NOTE the tasks are not tagged with the webserver so that they're not erased while
+							// stopping.
+							this->m_scheduler.schedule( 0, 1, NULL, [run,work]( std::shared_ptr<Scheduler::Task<>> ) {
+								std::unique_lock<std::mutex> runLock( run->mutex );
+								if ( run->next >= run->end ) {
+									return;
+								}
+								run->helpers++;
+								runLock.unlock();
+								work();
+								runLock.lock();
+								run->helpers--;
+								run->condition.notify_all();
+							} );
+						}
+						work();
+						std::unique_lock<std::mutex> runLock( run->mutex );
+						run->condition.wait( runLock, [run]() -> bool { return run->helpers == 0; } );
+						index = end;
+					} else {
+						execute( index++ );
+					}
+				}
+
+				output_["data"] = results;
+				output_["code"] = 200;
+			}
+		} );
+	};
+
+	void WebServer::_streamJson( std::shared_ptr<Network::Connection> connection_, const json& output_, const t_rowsFunc& rows_, const std::map<std::string, std::string>& headers_, const ContentEncoding& encoding_ ) {
+		// The output is written without it's closing bracket, followed by the rows in the data property. The rows are
+		// collected into chunks and each chunk is send as soon as it's full. Sending blocks while the client is
+		// lagging behind, which keeps the memory usage bounded regardless of the size of the result.
+		std::string chunk = output_.dump();
+		chunk.pop_back();
+		chunk.append( ",\"data\":[" );
+		connection_->replyChunked( 200, headers_ );
+
+		// When compressing, each chunk is flushed through a single deflate stream so the client can start inflating
+		// before the response is complete.
+		z_stream stream;
+		memset( &stream, 0, sizeof( stream ) );
+		bool compress = false;
+		if ( encoding_ != ContentEncoding::IDENTITY ) {
+			compress = ( Z_OK == deflateInit2( &stream, this->m_compressionLevel, Z_DEFLATED, encoding_ == ContentEncoding::GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY ) );
+		}
+		auto send = [&]( int flush_ ) -> void {
+			if ( compress ) {
+				std::string compressed;
+				if ( ! WebServer::_deflate( stream, chunk, flush_, compressed ) ) {
+					throw std::runtime_error( "compression failed" );
+				}
+				chunk.swap( compressed );
+			}
+			if (
+				! chunk.empty()
+				&& ! connection_->sendChunk( chunk )
+			) {
+				throw std::runtime_error( "client is not accepting data" );
+			}
+			chunk.clear();
+		};
+
+		bool first = true;
+		try {
+			rows_( [&]( const json& row_ ) {
+				if ( ! first ) {
+					chunk.append( 1, ',' );
+				}
+				first = false;
+				chunk.append( row_.dump() );
+				if ( chunk.size() >= WEBSERVER_STREAM_CHUNK_SIZE ) {
+					send( Z_SYNC_FLUSH );
+				}
+			} );
+			chunk.append( "]}" );
+			send( Z_FINISH );
+			if ( ! connection_->sendChunk( "" ) ) {
+				throw std::runtime_error( "client is not accepting data" );
+			}
+		} catch( std::exception& exception_ ) {
+			// NOTE the response is incomplete and the client would be left waiting for the remaining chunks.
+			Logger::logr( Logger::LogLevel::WARNING, this, "Streaming response aborted (%s).", exception_.what() );
+			connection_->close();
+		}
+		if ( compress ) {
+			deflateEnd( &stream );
+		}
+	};
+
+	WebServer::ContentEncoding WebServer::_negotiateEncoding( const StringView& accept_ ) {
+		// The Accept-Encoding header holds a comma separated list of encodings, optionally followed by a quality
+		// value. Encodings with a quality of zero are explicitly refused by the client. Gzip is preferred over
+		// deflate because some older clients expect raw deflate data instead of a zlib stream.
+		bool deflate = false;
+		for ( size_t pos = 0; pos < accept_.size(); ) {
+			size_t next = accept_.find( ',', pos );
+			if ( next == std::string::npos ) {
+				next = accept_.size();
+			}
+			StringView encoding = accept_.substr( pos, next - pos );
+			pos = next + 1;
+
+			bool refused = false;
+			size_t separator = encoding.find( ';' );
+			if ( separator != std::string::npos ) {
+				StringView parameters = encoding.substr( separator + 1 );
+				size_t quality = parameters.find( '=' );
+				if ( quality != std::string::npos ) {
+					refused = std::atof( parameters.substr( quality + 1 ).str().c_str() ) <= 0;
+				}
+				encoding = encoding.substr( 0, separator );
+			}
+			while( ! encoding.empty() && isspace( (unsigned char)encoding[0] ) ) {
+				encoding = encoding.substr( 1 );
+			}
+			while( ! encoding.empty() && isspace( (unsigned char)encoding.back() ) ) {
+				encoding = encoding.substr( 0, encoding.size() - 1 );
+			}
+			if ( refused ) {
+				continue;
+			}
+			if ( encoding.equals( "gzip", true ) ) {
+				return ContentEncoding::GZIP;
+			} else if ( encoding.equals( "deflate", true ) ) {
+				deflate = true;
+			}
+		}
+		return deflate ? ContentEncoding::DEFLATE : ContentEncoding::IDENTITY;
+	};
+
+	bool WebServer::_deflate( z_stream& stream_, const std::string& input_, int flush_, std::string& output_ ) {
+		char buffer[WEBSERVER_STREAM_CHUNK_SIZE];
+		stream_.next_in = (Bytef*)input_.data();
+		stream_.avail_in = input_.size();
+		do {
+			stream_.next_out = (Bytef*)buffer;
+			stream_.avail_out = sizeof( buffer );
+			int result = deflate( &stream_, flush_ );
+			if (
+				result == Z_STREAM_ERROR
+				|| ( result == Z_BUF_ERROR && stream_.avail_in > 0 )
+			) {
+				return false;
+			}
+			output_.append( buffer, sizeof( buffer ) - stream_.avail_out );
+		} while( stream_.avail_out == 0 );
+		return true;
+	};
+
+	std::string WebServer::_compress( const std::string& input_, const ContentEncoding& encoding_, int level_ ) {
+		z_stream stream;
+		memset( &stream, 0, sizeof( stream ) );
+		if ( Z_OK != deflateInit2( &stream, level_, Z_DEFLATED, encoding_ == ContentEncoding::GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY ) ) {
+			throw std::runtime_error( "unable to initialize compression" );
+		}
+		std::string output;
+		output.reserve( deflateBound( &stream, input_.size() ) );
+		bool success = WebServer::_deflate( stream, input_, Z_FINISH, output );
+		deflateEnd( &stream );
+		if ( ! success ) {
+			throw std::runtime_error( "compression failed" );
+		}
+		return output;
+	};
+
+	size_t WebServer::_loadAssets( const std::string& root_, const std::string& path_, size_t size_ ) {
+		static const std::map<std::string, std::pair<std::string, bool>> types = {
+			// extension, content type, compressible
+			{ "html", { "text/html", true } },
+			{ "htm", { "text/html", true } },
+			{ "css", { "text/css", true } },
+			{ "js", { "application/javascript", true } },
+			{ "json", { "application/json", true } },
+			{ "map", { "application/json", true } },
+			{ "svg", { "image/svg+xml", true } },
+			{ "xml", { "text/xml", true } },
+			{ "txt", { "text/plain", true } },
+			{ "ts", { "text/plain", true } },
+			{ "appcache", { "text/cache-manifest", true } },
+			{ "ttf", { "application/x-font-ttf", true } },
+			{ "otf", { "application/x-font-opentype", true } },
+			{ "eot", { "application/vnd.ms-fontobject", true } },
+			{ "woff", { "application/font-woff", false } },
+			{ "woff2", { "font/woff2", false } },
+			{ "png", { "image/png", false } },
+			{ "jpg", { "image/jpeg", false } },
+			{ "jpeg", { "image/jpeg", false } },
+			{ "gif", { "image/gif", false } },
+			{ "ico", { "image/x-icon", false } }
+		};
+
+		DIR* dir = opendir( ( root_ + path_ ).c_str() );
+		if ( dir == NULL ) {
+			if ( path_.empty() ) {
+				Logger::logr( Logger::LogLevel::WARNING, this, "Unable to open %s for reading.", root_.c_str() );
+			}
+			return size_;
+		}
+		struct dirent* entry;
+		while( ( entry = readdir( dir ) ) != NULL ) {
+			std::string name = entry->d_name;
+			if ( name[0] == '.' ) {
+				continue;
+			}
+			std::string path = path_ + "/" + name;
+			if ( entry->d_type == DT_DIR ) {
+				size_ = this->_loadAssets( root_, path, size_ );
+				continue;
+			}
+
+			// Files of unknown type or files that do not fit in memory anymore are left to be served from disk.
+			std::vector<std::string> parts = stringSplit( name, '.' );
+			auto type = types.find( parts.back() );
+			if (
+				parts.size() < 2
+				|| type == types.end()
+			) {
+				continue;
+			}
+			std::ifstream file( root_ + path, std::ios::in | std::ios::binary );
+			std::stringstream data;
+			data << file.rdbuf();
+			if (
+				file.fail()
+				|| size_ + data.str().size() > WEBSERVER_ASSETS_MAX_BYTES
+			) {
+				continue;
+			}
+
+			t_asset& asset = this->m_assets[path];
+			asset.type = type->second.first;
+			asset.data = data.str();
+			asset.etag = stringFormat( "\"%08lx-%zx\"", crc32( 0, (const Bytef*)asset.data.data(), asset.data.size() ), asset.data.size() );
+			size_ += asset.data.size();
+
+			// Build tools add a hash of the content to the filename of assets that never change, for instance
+			// app.3f2a9c1b.min.js. These can be cached by the client indefinitely.
+			asset.immutable = false;
+			for ( unsigned int i = 1; i < parts.size() - 1; i++ ) {
+				if (
+					parts[i].size() >= 8
+					&& parts[i].find_first_not_of( "0123456789abcdefABCDEF" ) == std::string::npos
+				) {
+					asset.immutable = true;
+				}
+			}
+
+			if (
+				type->second.second
+				&& this->m_compressionLevel > 0
+				&& asset.data.size() >= WEBSERVER_COMPRESSION_MIN_BYTES
+			) {
+				try {
+					std::string compressed = WebServer::_compress( asset.data, ContentEncoding::GZIP, Z_BEST_COMPRESSION );
+					if ( compressed.size() < asset.data.size() ) {
+						asset.gzip = compressed;
+						size_ += asset.gzip.size();
+						Logger::logr( Logger::LogLevel::DEBUG, this, "Compressed %s from %zu to %zu bytes.", path.c_str(), asset.data.size(), asset.gzip.size() );
+					}
+				} catch( std::runtime_error& exception_ ) {
+					Logger::logr( Logger::LogLevel::WARNING, this, "Unable to compress %s (%s).", path.c_str(), exception_.what() );
+				}
+			}
+		}
+		closedir( dir );
+		return size_;
+	};
+
+	bool WebServer::_serveAsset( std::shared_ptr<Network::Connection> connection_ ) const {
+		// NOTE this method is called on the poll thread and should never block. Anything that is not a plain GET
+		// request for a known asset is left to the regular request handler.
+		auto request = connection_->getRequest();
+		if ( request->method != "GET" ) {
+			return false;
+		}
+
+		// NOTE the key buffer is reused to prevent an allocation for each request, this is safe because this method
+		// is only called from the poll thread.
+		static thread_local std::string key;
+		key.assign( request->uri.data(), request->uri.size() );
+		if ( ! key.empty() && key.back() == '/' ) {
+			key.append( "index.html" );
+		}
+		auto asset = this->m_assets.find( key );
+		if ( asset == this->m_assets.end() ) {
+			return false;
+		}
+
+		std::map<std::string, std::string> headers = {
+			{ "ETag", asset->second.etag },
+			{ "Cache-Control", asset->second.immutable ? "public, max-age=31536000, immutable" : "no-cache" }
+		};
+		if ( ! asset->second.gzip.empty() ) {
+			headers["Vary"] = "Accept-Encoding";
+		}
+
+		if ( request->getHeader( "If-None-Match" ) == asset->second.etag ) {
+			connection_->reply( "", 304, headers );
+		} else {
+			headers["Content-Type"] = asset->second.type;
+			if (
+				! asset->second.gzip.empty()
+				&& WebServer::_negotiateEncoding( request->getHeader( "Accept-Encoding" ) ) == ContentEncoding::GZIP
+			) {
+				headers["Content-Encoding"] = "gzip";
+				connection_->reply( asset->second.gzip, 200, headers );
+			} else {
+				connection_->reply( asset->second.data, 200, headers );
+			}
+		}
+		return true;
+	};
+
+	void WebServer::_addResource( const t_resource& resource_ ) {
+		size_t resource = this->m_resources.size();
+		this->m_resources.push_back( resource_ );
+
+		// The uri of a resource is a path where optional parts are enclosed in square brackets and captures are
+		// enclosed in curly brackets, for instance /api[/devices/{2:id}]/links. A capture holds the index of the
+		// parameter it is passed to the callback as, followed by a list of literals and/or types (id, ids or key). The
+		// optional parts are expanded first, resulting in a list of plain paths.
+		std::vector<std::string> uris = { resource_.uri };
+		for ( size_t i = 0; i < uris.size(); ) {
+			size_t open = uris[i].find( '[' );
+			if ( open == std::string::npos ) {
+				i++;
+				continue;
+			}
+			size_t close = open;
+			for ( int depth = 0; close < uris[i].size(); close++ ) {
+				if ( uris[i][close] == '[' ) {
+					depth++;
+				} else if ( uris[i][close] == ']' && --depth == 0 ) {
+					break;
+				}
+			}
+#ifdef _DEBUG
+			assert( close < uris[i].size() && "Optional parts in resource uri should be closed." );
+#endif // _DEBUG
+			std::string uri = uris[i];
+			uris[i] = uri.substr( 0, open ) + uri.substr( close + 1 );
+			uris.push_back( uri.substr( 0, open ) + uri.substr( open + 1, close - open - 1 ) + uri.substr( close + 1 ) );
+		}
+
+		// Each path is then added to the trie segment by segment. Captures with multiple alternatives branch out into
+		// multiple nodes, so a set of current nodes is maintained while walking the segments.
+		for ( auto const &uri : uris ) {
+			this->m_routes.emplace_back();
+			t_route& route = this->m_routes.back();
+			route.uri = uri;
+			route.resource = resource;
+			route.hits = 0;
+
+			std::vector<size_t> nodes = { 0 };
+			for ( auto const &segment : stringSplit( uri.substr( 1 ), '/' ) ) {
+				std::vector<t_routeEdge> edges;
+				if (
+					segment.size() > 2
+					&& segment.front() == '{'
+					&& segment.back() == '}'
+				) {
+					auto parts = stringSplit( segment.substr( 1, segment.size() - 2 ), ':' );
+					unsigned int capture = std::stoi( parts[0] );
+					for ( auto const &alternative : stringSplit( parts[1], '|' ) ) {
+						if ( alternative == "id" ) {
+							edges.push_back( { RouteSegment::ID, "", capture, 0 } );
+						} else if ( alternative == "ids" ) {
+							edges.push_back( { RouteSegment::IDS, "", capture, 0 } );
+						} else if ( alternative == "key" ) {
+							edges.push_back( { RouteSegment::KEY, "", capture, 0 } );
+						} else {
+							edges.push_back( { RouteSegment::LITERAL, alternative, capture, 0 } );
+						}
+					}
+				} else {
+					edges.push_back( { RouteSegment::LITERAL, segment, 0, 0 } );
+				}
+
+				std::vector<size_t> next;
+				for ( auto const &node : nodes ) {
+					for ( auto const &edge : edges ) {
+						auto& existing = this->m_routeNodes[node].edges;
+						auto find = std::find_if( existing.begin(), existing.end(), [&edge]( const t_routeEdge& edge_ ) {
+							return edge_.type == edge.type && edge_.literal == edge.literal && edge_.capture == edge.capture;
+						} );
+						if ( find != existing.end() ) {
+							next.push_back( find->node );
+						} else {
+							t_routeEdge child = edge;
+							child.node = this->m_routeNodes.size();
+							this->m_routeNodes[node].edges.push_back( child );
+							this->m_routeNodes.emplace_back();
+							next.push_back( child.node );
+						}
+					}
+				}
+				nodes = next;
+			}
+			for ( auto const &node : nodes ) {
+				this->m_routeNodes[node].routes.push_back( &route );
+			}
+		}
+	};
+
+	const WebServer::t_route* WebServer::_matchRoute( const StringView& uri_, const Method& method_, std::vector<std::pair<unsigned int, std::string>>& captures_ ) const {
+		if ( uri_.empty() || uri_[0] != '/' ) {
+			return nullptr;
+		}
+
+		// The segments of the uri are stored as offsets into the uri to prevent copying.
+		std::vector<std::pair<size_t, size_t>> segments;
+		for ( size_t begin = 1, end; begin <= uri_.size(); begin = end + 1 ) {
+			end = uri_.find( '/', begin );
+			if ( end == std::string::npos ) {
+				end = uri_.size();
+			}
+			segments.push_back( { begin, end - begin } );
+		}
+
+		// The trie is walked depth-first. Literals are always tried before typed captures because the edges are
+		// tried in order of insertion and backtracking only occurs when a literal turned out to be a dead end.
+		std::function<const t_route*( size_t, size_t )> walk = [&]( size_t node_, size_t segment_ ) -> const t_route* {
+			const t_routeNode& node = this->m_routeNodes[node_];
+			if ( segment_ == segments.size() ) {
+				for ( auto const &route : node.routes ) {
+					if ( ( this->m_resources[route->resource].methods & method_ ) == method_ ) {
+						return route;
+					}
+				}
+				return nullptr;
+			}
+
+			const char* segment = uri_.data() + segments[segment_].first;
+			size_t length = segments[segment_].second;
+			for ( auto const &edge : node.edges ) {
+				bool match = length > 0;
+				switch( edge.type ) {
+					case RouteSegment::LITERAL:
+						match = ( edge.literal.size() == length && edge.literal.compare( 0, length, segment, length ) == 0 );
+						break;
+					case RouteSegment::ID:
+						for ( size_t i = 0; match && i < length; i++ ) {
+							match = isdigit( (unsigned char)segment[i] );
+						}
+						break;
+					case RouteSegment::IDS:
+						for ( size_t i = 0; match && i < length; i++ ) {
+							match = isdigit( (unsigned char)segment[i] ) || segment[i] == ',';
+						}
+						break;
+					case RouteSegment::KEY:
+						for ( size_t i = 0; match && i < length; i++ ) {
+							match = isdigit( (unsigned char)segment[i] ) || islower( (unsigned char)segment[i] ) || segment[i] == '_';
+						}
+						break;
+				}
+				if ( match ) {
+					if ( edge.capture > 0 ) {
+						captures_.push_back( { edge.capture, std::string( segment, length ) } );
+					}
+					const t_route* route = walk( edge.node, segment_ + 1 );
+					if ( route != nullptr ) {
+						return route;
+					}
+					if ( edge.capture > 0 ) {
+						captures_.pop_back();
+					}
+				}
+			}
+			return nullptr;
+		};
+		return walk( 0, 0 );
+	};
+
+	json WebServer::_getRoutesJson() const {
+		json routes = json::array();
+		for ( auto const &route : this->m_routes ) {
+			routes += {
+				{ "uri", route.uri },
+				{ "hits", route.hits.load() }
+			};
+		}
+		return {
+			{ "routes", routes },
+			{ "misses", this->m_routeMisses.load() }
 		};
 	};
 
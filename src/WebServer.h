@@ -1,9 +1,14 @@
 #pragma once
 
 #include <mutex>
+#include <condition_variable>
 #include <chrono>
 #include <map>
 #include <vector>
+#include <set>
+#include <unordered_map>
+#include <list>
+#include <atomic>
 #include <ostream>
 
 #include "Utils.h"
@@ -12,10 +17,24 @@
 
 #include "json.hpp"
 
+#include <zlib.h>
+
 #define WEBSERVER_TOKEN_DEFAULT_VALID_DURATION_MINUTES 30 * 24 * 60
 #define WEBSERVER_USER_WEBCLIENT_SETTING_PREFIX "_web_"
 #define WEBSERVER_SETTING_HASH_PEPPER "_hash_pepper"
 
+#define WEBSERVER_BROADCAST_INTERVAL_MSEC 10
+#define WEBSERVER_BROADCAST_BATCH_SIZE 64 * 1024
+#define WEBSERVER_STREAM_CHUNK_SIZE 16 * 1024
+
+#define WEBSERVER_SETTING_COMPRESSION_LEVEL "_compression_level"
+#define WEBSERVER_COMPRESSION_DEFAULT_LEVEL 4
+#define WEBSERVER_COMPRESSION_MIN_BYTES 1024
+#define WEBSERVER_ASSETS_MAX_BYTES 16 * 1024 * 1024
+
+#define WEBSERVER_BATCH_MAX_REQUESTS 64
+#define WEBSERVER_BATCH_MAX_HELPERS 3
+
 namespace micasa {
 
 	class User;
@@ -35,7 +54,7 @@ namespace micasa {
 
 		void start();
 		void stop();
-		void broadcast( const std::string& message_ );
+		void broadcast( const std::string& event_, const nlohmann::json& data_, const unsigned int& pluginId_ = 0, const unsigned int& deviceId_ = 0 );
 
 	private:
 		enum class Method: unsigned short {
@@ -59,18 +78,92 @@ namespace micasa {
 		static const std::map<Method, std::string> MethodText;
 		ENUM_UTIL_W_TEXT( Method, MethodText );
 
+		enum class SocketEncoding: unsigned short {
+			JSON = 1,
+			MSGPACK,
+			CBOR
+		}; // enum class SocketEncoding
+		static const std::map<SocketEncoding, std::string> SocketEncodingText;
+		ENUM_UTIL_W_TEXT( SocketEncoding, SocketEncodingText );
+
+		static const std::vector<std::string> SocketDictionary;
+
+		enum class ContentEncoding: unsigned short {
+			IDENTITY = 1,
+			GZIP,
+			DEFLATE
+		}; // enum class ContentEncoding
+		static const std::map<ContentEncoding, std::string> ContentEncodingText;
+		ENUM_UTIL_W_TEXT( ContentEncoding, ContentEncodingText );
+
 		struct t_login {
 			std::chrono::system_clock::time_point valid;
 			std::shared_ptr<User> user;
 			std::vector<std::weak_ptr<Network::Connection>> sockets;
 		}; // struct t_login
 
+		struct t_socket {
+			std::weak_ptr<Network::Connection> connection;
+			std::string token;
+			SocketEncoding encoding;
+			std::string batch;
+			unsigned long count;
+			std::set<std::string> events;
+			std::set<unsigned int> devices;
+			std::set<unsigned int> plugins;
+			unsigned long sequence;
+		}; // struct t_socket
+
+		typedef std::function<void( const std::function<void( const nlohmann::json& row_ )>& process_ )> t_rowsFunc;
+
 		struct t_resource {
 			std::string uri;
 			Method methods;
-			std::function<void( std::shared_ptr<User>, const nlohmann::json&, const Method&, nlohmann::json& )> callback;
+			bool conditional; // supports conditional get requests
+			std::function<void( std::shared_ptr<User>, const nlohmann::json&, const Method&, nlohmann::json&, t_rowsFunc& )> callback;
 		}; // struct t_resource
 
+		enum class RouteSegment: unsigned short {
+			LITERAL = 1,
+			ID,
+			IDS,
+			KEY
+		}; // enum class RouteSegment
+
+		struct t_route {
+			std::string uri;
+			size_t resource;
+			std::atomic<unsigned long> hits;
+		}; // struct t_route
+
+		struct t_routeEdge {
+			RouteSegment type;
+			std::string literal;
+			unsigned int capture;
+			size_t node;
+		}; // struct t_routeEdge
+
+		struct t_routeNode {
+			std::vector<t_routeEdge> edges;
+			std::vector<t_route*> routes;
+		}; // struct t_routeNode
+
+		struct t_asset {
+			std::string type;
+			std::string data;
+			std::string gzip;
+			std::string etag;
+			bool immutable; // the filename contains a fingerprint of the content
+		}; // struct t_asset
+
+		struct t_batchRun {
+			std::mutex mutex;
+			std::condition_variable condition;
+			size_t next;
+			size_t end;
+			unsigned int helpers; // the number of helpers that are executing requests
+		}; // struct t_batchRun
+
 		class ResourceException: public std::runtime_error {
 		public:
 			ResourceException( unsigned int code_, std::string error_, std::string message_ ) : runtime_error( message_ ), code( code_ ), error( error_ ), message( message_ ) { };
@@ -90,10 +183,37 @@ namespace micasa {
 		std::map<std::string, t_login> m_logins;
 		mutable std::mutex m_loginsMutex;
 
+		std::map<const Network::Connection*, t_socket> m_sockets;
+		std::set<t_socket*> m_socketsUnfiltered;
+		std::unordered_map<unsigned int, std::set<t_socket*>> m_socketsByDevice;
+		std::unordered_map<unsigned int, std::set<t_socket*>> m_socketsByPlugin;
+		unsigned long m_broadcastSequence;
+		std::weak_ptr<Scheduler::Task<>> m_broadcastTask;
+
 		std::vector<t_resource> m_resources;
+		std::vector<t_routeNode> m_routeNodes;
+		std::list<t_route> m_routes;
+		std::atomic<unsigned long> m_routeMisses;
+		std::atomic<unsigned long> m_version;
+		const std::string m_epoch;
+		int m_compressionLevel;
+		std::unordered_map<std::string, t_asset> m_assets;
 
 		std::string _hash( const std::string& data_ ) const;
 		void _processRequest( std::shared_ptr<Network::Connection> connection_ );
+		bool _callResource( std::shared_ptr<User> user_, const StringView& uri_, const Method& method_, nlohmann::json& input_, nlohmann::json& output_, t_rowsFunc& rows_, std::string& etag_, const StringView& ifNoneMatch_ );
+		void _scheduleBroadcasts();
+		void _flushBroadcasts();
+		void _processSocket( std::shared_ptr<Network::Connection> connection_ );
+		void _subscribeSocket( t_socket& socket_, const nlohmann::json& subscription_, bool subscribe_ );
+		void _indexSocket( t_socket& socket_, bool index_ );
+		void _removeSocket( const Network::Connection* connection_ );
+		void _streamJson( std::shared_ptr<Network::Connection> connection_, const nlohmann::json& output_, const t_rowsFunc& rows_, const std::map<std::string, std::string>& headers_, const ContentEncoding& encoding_ );
+		void _addResource( const t_resource& resource_ );
+		const t_route* _matchRoute( const StringView& uri_, const Method& method_, std::vector<std::pair<unsigned int, std::string>>& captures_ ) const;
+		nlohmann::json _getRoutesJson() const;
+		size_t _loadAssets( const std::string& root_, const std::string& path_ = "", size_t size_ = 0 );
+		bool _serveAsset( std::shared_ptr<Network::Connection> connection_ ) const;
 
 		void _installPluginResourceHandler();
 		void _installDeviceResourceHandler();
@@ -101,7 +221,13 @@ namespace micasa {
 		void _installScriptResourceHandler();
 		void _installTimerResourceHandler();
 		void _installUserResourceHandler();
+		void _installSystemResourceHandler();
+		void _installBatchResourceHandler();
 
+		static nlohmann::json _compactJson( const nlohmann::json& input_ );
+		static ContentEncoding _negotiateEncoding( const StringView& accept_ );
+		static bool _deflate( z_stream& stream_, const std::string& input_, int flush_, std::string& output_ );
+		static std::string _compress( const std::string& input_, const ContentEncoding& encoding_, int level_ );
 		static bool _validateSettings( const nlohmann::json&, nlohmann::json&, const nlohmann::json&, std::vector<std::string>*, std::vector<std::string>*, std::vector<std::string>* );
 
 	}; // class WebServer
@@ -51,7 +51,6 @@ namespace micasa {
 	Counter::Counter( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ ) :
 		Device( plugin_, id_, reference_, label_, enabled_ ),
 		m_value( 0 ),
-		m_updated( system_clock::now() ),
 		m_rateLimiter( { 0, Device::resolveUpdateSource( 0 ) } )
 	{
 		try {
@@ -113,18 +112,26 @@ namespace micasa {
 			return;
 		}
 
+		// When the device is overloaded pending updates are coalesced into the latest value, just like a configured
+		// rate limit would do.
+		bool overloaded = this->_isOverloaded();
 		if (
-			this->m_settings->contains( "rate_limit" )
+			( overloaded || this->m_settings->contains( "rate_limit" ) )
 			&& this->getPlugin()->getState() >= Plugin::State::READY
 		) {
-			unsigned long rateLimit = 1000 * this->m_settings->get<double>( "rate_limit" );
+			unsigned long rateLimit = 1000 * this->m_settings->get<double>( "rate_limit", 0. );
+			if ( overloaded ) {
+				rateLimit = std::max( rateLimit, (unsigned long)DEVICE_OVERLOAD_INTERVAL_MSEC );
+			}
 			system_clock::time_point now = system_clock::now();
 			system_clock::time_point next = this->m_updated + milliseconds( rateLimit );
 			if ( next > now ) {
 				this->m_rateLimiter.source = source_;
 				this->m_rateLimiter.value = value_;
 				auto task = this->m_rateLimiter.task.lock();
-				if ( ! task ) {
+				if ( task ) {
+					this->m_coalesced++;
+				} else {
 					this->m_rateLimiter.task = this->m_scheduler.schedule( next, 0, 1, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
 						this->_processValue( this->m_rateLimiter.source, this->m_rateLimiter.value );
 					} );
@@ -141,16 +148,20 @@ namespace micasa {
 		this->updateValue( source_, std::max( this->m_value, this->m_rateLimiter.value ) + value_ );
 	};
 
-	json Counter::getJson() const {
-		json result = Device::getJson();
-
+	json Counter::formatValue( const t_value& value_ ) const {
 		double divider = this->m_settings->get<double>( "divider", 1 );
+		std::string unit = this->m_settings->get( "unit", this->m_settings->get( DEVICE_SETTING_DEFAULT_UNIT, "" ) );
+		return std::stod( stringFormat( Counter::UnitFormat.at( Counter::resolveTextUnit( unit ) ), value_ / divider ) );
+	};
+
+	json Counter::_getJson() const {
+		json result = Device::_getJson();
+
 		std::string unit = this->m_settings->get( "unit", this->m_settings->get( DEVICE_SETTING_DEFAULT_UNIT, "" ) );
 
-		result["value"] = std::stod( stringFormat( Counter::UnitFormat.at( Counter::resolveTextUnit( unit ) ), this->m_value / divider ) );
+		result["value"] = this->formatValue( this->m_value );
 		result["raw_value"] = this->m_value;
 		result["source"] = Device::resolveUpdateSource( this->m_source );
-		result["age"] = duration_cast<seconds>( system_clock::now() - this->m_updated ).count();
 		result["type"] = "counter";
 		result["subtype"] = this->m_settings->get( "subtype", this->m_settings->get( DEVICE_SETTING_DEFAULT_SUBTYPE, "generic" ) );
 		result["unit"] = unit;
@@ -296,9 +307,17 @@ namespace micasa {
 	};
 
 	json Counter::getData( unsigned int range_, const std::string& interval_, const std::string& group_ ) const {
+		json result = json::array();
+		this->getData( range_, interval_, group_, [&result]( const json& row_ ) {
+			result += row_;
+		} );
+		return result;
+	};
+
+	void Counter::getData( unsigned int range_, const std::string& interval_, const std::string& group_, const std::function<void( const json& row_ )>& process_ ) const {
 		std::vector<std::string> validIntervals = { "hour", "day", "week", "month", "year" };
 		if ( std::find( validIntervals.begin(), validIntervals.end(), interval_ ) == validIntervals.end() ) {
-			return json::array();
+			return;
 		}
 		std::string interval = interval_;
 		if ( interval == "week" ) {
@@ -308,7 +327,7 @@ namespace micasa {
 
 		std::vector<std::string> validGroups = { "hour", "day", "month", "year" };
 		if ( std::find( validGroups.begin(), validGroups.end(), group_ ) == validGroups.end() ) {
-			return json::array();
+			return;
 		}
 
 		std::string unit = this->m_settings->get( "unit", this->m_settings->get( DEVICE_SETTING_DEFAULT_UNIT, "" ) );
@@ -331,23 +350,37 @@ namespace micasa {
 			groupFormat = "%Y";
 			start = "'start of year'";
 		}
-		return g_database->getQuery<json>(
-			"SELECT CAST( printf( %Q, sum( `diff` ) / %.6f ) AS REAL ) AS `value`, CAST( strftime( '%%s', strftime( %Q, MAX( `date` ) ) ) AS INTEGER ) AS `timestamp`, strftime( %Q, MAX( `date` ) ) AS `date` "
-			"FROM `device_counter_trends` "
-			"WHERE `device_id` = %d "
-			"AND `date` >= datetime( 'now', '-%d %s', %s ) "
-			"GROUP BY strftime( %Q, `date` ) "
-			"ORDER BY `date` ASC ",
-			format.c_str(),
-			divider,
-			dateFormat.c_str(),
-			dateFormat.c_str(),
-			this->m_id,
-			range_,
-			interval.c_str(),
-			start.c_str(),
-			groupFormat.c_str()
-		);
+
+		// NOTE the start of the window is determined once so that it doesn't move between pages. Each page continues
+		// after the last complete group of the previous page.
+		std::string from = g_database->getQueryValue<std::string>( "SELECT datetime( 'now', '-%d %s', %s )", range_, interval.c_str(), start.c_str() );
+		std::string last = "";
+		g_database->getQueryPages( [&]() -> json {
+			json rows = g_database->getQuery<json>(
+				"SELECT CAST( printf( %Q, sum( `diff` ) / %.6f ) AS REAL ) AS `value`, CAST( strftime( '%%s', strftime( %Q, MAX( `date` ) ) ) AS INTEGER ) AS `timestamp`, strftime( %Q, MAX( `date` ) ) AS `date`, MAX( `date` ) AS `last_date` "
+				"FROM `device_counter_trends` "
+				"WHERE `device_id` = %d "
+				"AND `date` >= %Q "
+				"AND `date` > %Q "
+				"GROUP BY strftime( %Q, `date` ) "
+				"ORDER BY `last_date` ASC "
+				"LIMIT %d",
+				format.c_str(),
+				divider,
+				dateFormat.c_str(),
+				dateFormat.c_str(),
+				this->m_id,
+				from.c_str(),
+				last.c_str(),
+				groupFormat.c_str(),
+				DATABASE_ROWS_PAGE_SIZE
+			);
+			for ( auto& row : rows ) {
+				last = row["last_date"].get<std::string>();
+				row.erase( "last_date" );
+			}
+			return rows;
+		}, process_ );
 	};
 
 	void Counter::_processValue( const Device::UpdateSource& source_, const t_value& value_ ) {
@@ -359,7 +392,7 @@ namespace micasa {
 		// If the update originates from the plugin it is not send back to the plugin again.
 		bool success = true;
 		bool apply = true;
-		for ( auto const& plugin : g_controller->getAllPlugins() ) {
+		for ( auto const& plugin : g_controller->getDevicePlugins( Device::shared_from_this() ) ) {
 			if (
 				plugin != this->getPlugin()
 				|| ( source_ & Device::UpdateSource::PLUGIN ) != Device::UpdateSource::PLUGIN
@@ -401,6 +434,7 @@ namespace micasa {
 			}
 			this->m_source = source_;
 			this->m_updated = system_clock::now();
+			this->_changed();
 			if (
 				this->m_enabled
 				&& this->getPlugin()->getState() >= Plugin::State::READY
@@ -409,7 +443,9 @@ namespace micasa {
 			}
 			Logger::logr( Logger::LogLevel::NORMAL, this, "New value %.3lf.", this->m_value );
 		} else {
+			// NOTE the json of the device might have been rendered with the rejected value in the meantime.
 			this->m_value = previous;
+			this->m_version++;
 		}
 	};
 
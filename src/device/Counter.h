@@ -36,19 +36,22 @@ namespace micasa {
 		void updateValue( Device::UpdateSource source_, t_value value_ );
 		void incrementValue( Device::UpdateSource source_, t_value value_ = 1.0f );
 		t_value getValue() const { return this->m_value; };
+		nlohmann::json formatValue( const t_value& value_ ) const;
 		nlohmann::json getData( unsigned int range_, const std::string& interval_, const std::string& group_ ) const;
+		void getData( unsigned int range_, const std::string& interval_, const std::string& group_, const std::function<void( const nlohmann::json& row_ )>& process_ ) const;
 
 		void start() override;
 		void stop() override;
 		Device::Type getType() const override { return Counter::type; };
-		nlohmann::json getJson() const override;
 		nlohmann::json getSettingsJson() const override;
 		void putSettingsJson( const nlohmann::json& settings_ ) override;
 
+	protected:
+		nlohmann::json _getJson() const override;
+
 	private:
 		t_value m_value;
 		Device::UpdateSource m_source;
-		std::chrono::system_clock::time_point m_updated;
 		struct {
 			t_value value;
 			Device::UpdateSource source;
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "Level.h"
 
 #include "../Logger.h"
@@ -76,7 +78,6 @@ namespace micasa {
 	Level::Level( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ ) :
 		Device( plugin_, id_, reference_, label_, enabled_ ),
 		m_value( 0 ),
-		m_updated( system_clock::now() ),
 		m_rateLimiter( { 0, 0, Device::resolveUpdateSource( 0 ) } )
 	{
 		try {
@@ -154,11 +155,17 @@ namespace micasa {
 			return;
 		}
 
+		// When the device is overloaded pending updates are coalesced into their average, just like a configured
+		// rate limit would do.
+		bool overloaded = this->_isOverloaded();
 		if (
-			this->m_settings->contains( "rate_limit" )
+			( overloaded || this->m_settings->contains( "rate_limit" ) )
 			&& this->getPlugin()->getState() >= Plugin::State::READY
 		) {
-			unsigned long rateLimit = 1000 * this->m_settings->get<double>( "rate_limit" );
+			unsigned long rateLimit = 1000 * this->m_settings->get<double>( "rate_limit", 0. );
+			if ( overloaded ) {
+				rateLimit = std::max( rateLimit, (unsigned long)DEVICE_OVERLOAD_INTERVAL_MSEC );
+			}
 			system_clock::time_point now = system_clock::now();
 			system_clock::time_point next = this->m_updated + milliseconds( rateLimit );
 			if ( next > now ) {
@@ -167,11 +174,15 @@ namespace micasa {
 					this->m_rateLimiter.value = value_;
 				} else {
 					this->m_rateLimiter.value += value_;
+					this->m_coalesced++;
 				}
 				this->m_rateLimiter.count++;
 				auto task = this->m_rateLimiter.task.lock();
 				if ( ! task ) {
 					this->m_rateLimiter.task = this->m_scheduler.schedule( next, 0, 1, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
+						if ( this->m_rateLimiter.count > 1 ) {
+							Logger::logr( Logger::LogLevel::VERBOSE, this, "Coalesced %lu updates.", this->m_rateLimiter.count );
+						}
 						this->_processValue( this->m_rateLimiter.source, this->m_rateLimiter.value / this->m_rateLimiter.count );
 						this->m_rateLimiter.count = 0;
 					} );
@@ -184,17 +195,21 @@ namespace micasa {
 		}
 	};
 
-	json Level::getJson() const {
-		json result = Device::getJson();
-
+	json Level::formatValue( const t_value& value_ ) const {
 		std::string unit = this->m_settings->get( "unit", this->m_settings->get( DEVICE_SETTING_DEFAULT_UNIT, "" ) );
 		double divider = this->m_settings->get<double>( "divider", 1 );
 		double offset = this->m_settings->get<double>( "offset", 0 );
+		return std::stod( stringFormat( Level::UnitFormat.at( Level::resolveTextUnit( unit ) ), ( value_ / divider ) + offset ) );
+	};
+
+	json Level::_getJson() const {
+		json result = Device::_getJson();
+
+		std::string unit = this->m_settings->get( "unit", this->m_settings->get( DEVICE_SETTING_DEFAULT_UNIT, "" ) );
 
-		result["value"] = std::stod( stringFormat( Level::UnitFormat.at( Level::resolveTextUnit( unit ) ), ( this->m_value / divider ) + offset ) );
+		result["value"] = this->formatValue( this->m_value );
 		result["raw_value"] = this->m_value;
 		result["source"] = Device::resolveUpdateSource( this->m_source );
-		result["age"] = duration_cast<seconds>( system_clock::now() - this->m_updated ).count();
 		result["type"] = "level";
 		result["subtype"] = this->m_settings->get( "subtype", this->m_settings->get( DEVICE_SETTING_DEFAULT_SUBTYPE, "generic" ) );
 		result["unit"] = unit;
@@ -377,9 +392,17 @@ namespace micasa {
 	};
 
 	json Level::getData( unsigned int range_, const std::string& interval_, const std::string& group_ ) const {
+		json result = json::array();
+		this->getData( range_, interval_, group_, [&result]( const json& row_ ) {
+			result += row_;
+		} );
+		return result;
+	};
+
+	void Level::getData( unsigned int range_, const std::string& interval_, const std::string& group_, const std::function<void( const json& row_ )>& process_ ) const {
 		std::vector<std::string> validIntervals = { "hour", "day", "week", "month", "year" };
 		if ( std::find( validIntervals.begin(), validIntervals.end(), interval_ ) == validIntervals.end() ) {
-			return json::array();
+			return;
 		}
 		std::string interval = interval_;
 		if ( interval == "week" ) {
@@ -389,7 +412,7 @@ namespace micasa {
 
 		std::vector<std::string> validGroups = { "5min", "hour", "day", "month", "year" };
 		if ( std::find( validGroups.begin(), validGroups.end(), group_ ) == validGroups.end() ) {
-			return json::array();
+			return;
 		}
 
 		std::string unit = this->m_settings->get( "unit", this->m_settings->get( DEVICE_SETTING_DEFAULT_UNIT, "" ) );
@@ -397,22 +420,36 @@ namespace micasa {
 		double divider = this->m_settings->get<double>( "divider", 1 );
 		double offset = this->m_settings->get<double>( "offset", 0 );
 
+		// NOTE the start of the window is determined once so that it doesn't move between pages. Each page continues
+		// after the last row (or complete group) of the previous page.
 		if ( group_ == "5min" ) {
 			std::string dateFormat = "%Y-%m-%d %H:%M:00";
-			return g_database->getQuery<json>(
-				"SELECT CAST( printf( %Q, ( `value` / %.6f ) + %.6f ) AS REAL ) AS `value`, CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `timestamp`, strftime( %Q, `date` ) AS `date` "
-				"FROM `device_level_history` "
-				"WHERE `device_id` = %d "
-				"AND `date` >= datetime( 'now', '-%d %s' ) "
-				"ORDER BY `date` ASC ",
-				format.c_str(),
-				divider,
-				offset,
-				dateFormat.c_str(),
-				this->m_id,
-				range_,
-				interval.c_str()
-			);
+			std::string from = g_database->getQueryValue<std::string>( "SELECT datetime( 'now', '-%d %s' )", range_, interval.c_str() );
+			std::string last = "";
+			g_database->getQueryPages( [&]() -> json {
+				json rows = g_database->getQuery<json>(
+					"SELECT CAST( printf( %Q, ( `value` / %.6f ) + %.6f ) AS REAL ) AS `value`, CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `timestamp`, strftime( %Q, `date` ) AS `date`, `date` AS `last_date` "
+					"FROM `device_level_history` "
+					"WHERE `device_id` = %d "
+					"AND `date` >= %Q "
+					"AND `date` > %Q "
+					"ORDER BY `last_date` ASC "
+					"LIMIT %d",
+					format.c_str(),
+					divider,
+					offset,
+					dateFormat.c_str(),
+					this->m_id,
+					from.c_str(),
+					last.c_str(),
+					DATABASE_ROWS_PAGE_SIZE
+				);
+				for ( auto& row : rows ) {
+					last = row["last_date"].get<std::string>();
+					row.erase( "last_date" );
+				}
+				return rows;
+			}, process_ );
 		} else {
 			std::string dateFormat = "%Y-%m-%d %H:30:00";
 			std::string groupFormat = "%Y-%m-%d-%H";
@@ -430,35 +467,48 @@ namespace micasa {
 				groupFormat = "%Y";
 				start = "'start of year'";
 			}
-			return g_database->getQuery<json>(
-				"SELECT "
-					"CAST( printf( %Q, ( avg( `average` ) / %.6f ) +  %.6f ) AS REAL ) AS `value`, "
-					"CAST( printf( %Q, ( max( `max` ) / %.6f ) +  %.6f ) AS REAL ) AS `maximum`, "
-					"CAST( printf( %Q, ( min( `min` ) / %.6f ) +  %.6f ) AS REAL ) AS `minimum`, "
-					"CAST( strftime( '%%s', strftime( %Q, MAX( `date` ) ) ) AS INTEGER ) AS `timestamp`, "
-					"strftime( %Q, MAX( `date` ) ) AS `date` "
-				"FROM `device_level_trends` "
-				"WHERE `device_id` = %d "
-				"AND `date` >= datetime( 'now', '-%d %s', %s ) "
-				"GROUP BY strftime( %Q, `date` ) "
-				"ORDER BY `date` ASC ",
-				format.c_str(),
-				divider,
-				offset,
-				format.c_str(),
-				divider,
-				offset,
-				format.c_str(),
-				divider,
-				offset,
-				dateFormat.c_str(),
-				dateFormat.c_str(),
-				this->m_id,
-				range_,
-				interval.c_str(),
-				start.c_str(),
-				groupFormat.c_str()
-			);
+
+			std::string from = g_database->getQueryValue<std::string>( "SELECT datetime( 'now', '-%d %s', %s )", range_, interval.c_str(), start.c_str() );
+			std::string last = "";
+			g_database->getQueryPages( [&]() -> json {
+				json rows = g_database->getQuery<json>(
+					"SELECT "
+						"CAST( printf( %Q, ( avg( `average` ) / %.6f ) +  %.6f ) AS REAL ) AS `value`, "
+						"CAST( printf( %Q, ( max( `max` ) / %.6f ) +  %.6f ) AS REAL ) AS `maximum`, "
+						"CAST( printf( %Q, ( min( `min` ) / %.6f ) +  %.6f ) AS REAL ) AS `minimum`, "
+						"CAST( strftime( '%%s', strftime( %Q, MAX( `date` ) ) ) AS INTEGER ) AS `timestamp`, "
+						"strftime( %Q, MAX( `date` ) ) AS `date`, "
+						"MAX( `date` ) AS `last_date` "
+					"FROM `device_level_trends` "
+					"WHERE `device_id` = %d "
+					"AND `date` >= %Q "
+					"AND `date` > %Q "
+					"GROUP BY strftime( %Q, `date` ) "
+					"ORDER BY `last_date` ASC "
+					"LIMIT %d",
+					format.c_str(),
+					divider,
+					offset,
+					format.c_str(),
+					divider,
+					offset,
+					format.c_str(),
+					divider,
+					offset,
+					dateFormat.c_str(),
+					dateFormat.c_str(),
+					this->m_id,
+					from.c_str(),
+					last.c_str(),
+					groupFormat.c_str(),
+					DATABASE_ROWS_PAGE_SIZE
+				);
+				for ( auto& row : rows ) {
+					last = row["last_date"].get<std::string>();
+					row.erase( "last_date" );
+				}
+				return rows;
+			}, process_ );
 		}
 	};
 
@@ -471,7 +521,7 @@ namespace micasa {
 		// If the update originates from the plugin it is not send back to the plugin again.
 		bool success = true;
 		bool apply = true;
-		for ( auto const& plugin : g_controller->getAllPlugins() ) {
+		for ( auto const& plugin : g_controller->getDevicePlugins( Device::shared_from_this() ) ) {
 			if (
 				plugin != this->getPlugin()
 				|| ( source_ & Device::UpdateSource::PLUGIN ) != Device::UpdateSource::PLUGIN
@@ -512,6 +562,7 @@ namespace micasa {
 			}
 			this->m_source = source_;
 			this->m_updated = system_clock::now();
+			this->_changed();
 			if (
 				this->m_enabled
 				&& this->getPlugin()->getState() >= Plugin::State::READY
@@ -520,7 +571,9 @@ namespace micasa {
 			}
 			Logger::logr( Logger::LogLevel::NORMAL, this, "New value %.3lf.", this->m_value );
 		} else {
+			// NOTE the json of the device might have been rendered with the rejected value in the meantime.
 			this->m_value = previous;
+			this->m_version++;
 		}
 	};
 
@@ -122,7 +122,6 @@ namespace micasa {
 	Switch::Switch( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ ) :
 		Device( plugin_, id_, reference_, label_, enabled_ ),
 		m_value( Option::OFF ),
-		m_updated( system_clock::now() ),
 		m_rateLimiter( { Option::OFF, Device::resolveUpdateSource( 0 ) } )
 	{
 		try {
@@ -196,7 +195,23 @@ namespace micasa {
 			return;
 		}
 
+		// When the device is overloaded repeated updates with the current value are coalesced. Updates that change
+		// the value are always processed to preserve the edges. Actions have no state so they're never coalesced.
 		if (
+			this->_isOverloaded()
+			&& ! this->m_settings->contains( "rate_limit" )
+			&& subtype != Switch::SubType::ACTION
+			&& this->getPlugin()->getState() >= Plugin::State::READY
+		) {
+			if (
+				this->m_value == value_
+				&& ! this->m_rateLimiter.task.lock()
+			) {
+				this->m_coalesced++;
+				return;
+			}
+			this->_processValue( source_, value_ );
+		} else if (
 			this->m_settings->contains( "rate_limit" )
 			&& this->getPlugin()->getState() >= Plugin::State::READY
 		) {
@@ -229,12 +244,11 @@ namespace micasa {
 		Logger::logr( Logger::LogLevel::ERROR, this, "Invalid value %s.", value_.c_str() );
 	};
 
-	json Switch::getJson() const {
-		json result = Device::getJson();
+	json Switch::_getJson() const {
+		json result = Device::_getJson();
 
 		result["value"] = this->getValue();
 		result["source"] = Device::resolveUpdateSource( this->m_source );
-		result["age"] = duration_cast<seconds>( system_clock::now() - this->m_updated ).count();
 		result["type"] = "switch";
 		std::string subtype = this->m_settings->get( "subtype", this->m_settings->get( DEVICE_SETTING_DEFAULT_SUBTYPE, "generic" ) );
 		result["subtype"] = subtype;
@@ -307,25 +321,53 @@ namespace micasa {
 	};
 
 	json Switch::getData( unsigned int range_, const std::string& interval_ ) const {
+		json result = json::array();
+		this->getData( range_, interval_, [&result]( const json& row_ ) {
+			result += row_;
+		} );
+		return result;
+	};
+
+	void Switch::getData( unsigned int range_, const std::string& interval_, const std::function<void( const json& row_ )>& process_ ) const {
 		std::vector<std::string> validIntervals = { "hour", "day", "week", "month", "year" };
 		if ( std::find( validIntervals.begin(), validIntervals.end(), interval_ ) == validIntervals.end() ) {
-			return json::array();
+			return;
 		}
 		std::string interval = interval_;
 		if ( interval == "week" ) {
 			interval = "day";
 			range_ *= 7;
 		}
-		return g_database->getQuery<json>(
-			"SELECT `value`, CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `timestamp` "
-			"FROM `device_switch_history` "
-			"WHERE `device_id` = %d "
-			"AND `date` >= datetime( 'now', '-%d %s' ) "
-			"ORDER BY `date` ASC ",
-			this->m_id,
-			range_,
-			interval.c_str()
-		);
+
+		// NOTE the start of the window is determined once so that it doesn't move between pages. History rows don't
+		// have a unique date, so each page continues after the date and rowid of the last row of the previous page.
+		std::string from = g_database->getQueryValue<std::string>( "SELECT datetime( 'now', '-%d %s' )", range_, interval.c_str() );
+		std::string last = "";
+		int lastRowId = 0;
+		g_database->getQueryPages( [&]() -> json {
+			json rows = g_database->getQuery<json>(
+				"SELECT `value`, CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `timestamp`, `date` AS `last_date`, `rowid` AS `last_rowid` "
+				"FROM `device_switch_history` "
+				"WHERE `device_id` = %d "
+				"AND `date` >= %Q "
+				"AND ( `date` > %Q OR ( `date` = %Q AND `rowid` > %d ) ) "
+				"ORDER BY `date` ASC, `rowid` ASC "
+				"LIMIT %d",
+				this->m_id,
+				from.c_str(),
+				last.c_str(),
+				last.c_str(),
+				lastRowId,
+				DATABASE_ROWS_PAGE_SIZE
+			);
+			for ( auto& row : rows ) {
+				last = row["last_date"].get<std::string>();
+				lastRowId = row["last_rowid"].get<int>();
+				row.erase( "last_date" );
+				row.erase( "last_rowid" );
+			}
+			return rows;
+		}, process_ );
 	};
 
 	void Switch::_processValue( const Device::UpdateSource& source_, const Option& value_ ) {
@@ -337,7 +379,7 @@ namespace micasa {
 		// If the update originates from the plugin it is not send back to the plugin again.
 		bool success = true;
 		bool apply = true;
-		for ( auto const& plugin : g_controller->getAllPlugins() ) {
+		for ( auto const& plugin : g_controller->getDevicePlugins( Device::shared_from_this() ) ) {
 			if (
 				plugin != this->getPlugin()
 				|| ( source_ & Device::UpdateSource::PLUGIN ) != Device::UpdateSource::PLUGIN
@@ -359,6 +401,7 @@ namespace micasa {
 			}
 			this->m_source = source_;
 			this->m_updated = system_clock::now();
+			this->_changed();
 			if (
 				this->getPlugin()->getState() >= Plugin::State::READY
 				&& (
@@ -377,7 +420,9 @@ namespace micasa {
 				Logger::logr( Logger::LogLevel::NORMAL, this, "New value %s.", Switch::OptionText.at( this->m_value ).c_str() );
 			}
 		} else {
+			// NOTE the json of the device might have been rendered with the rejected value in the meantime.
 			this->m_value = previous;
+			this->m_version++;
 		}
 	};
 
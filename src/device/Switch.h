@@ -59,18 +59,21 @@ namespace micasa {
 		void updateValue( Device::UpdateSource source_, t_value value_ );
 		Option getValueOption() const { return this->m_value; };
 		t_value getValue() const { return OptionText.at( this->m_value ); };
+		nlohmann::json formatValue( const t_value& value_ ) const { return value_; };
 		nlohmann::json getData( unsigned int range_, const std::string& interval_ ) const;
+		void getData( unsigned int range_, const std::string& interval_, const std::function<void( const nlohmann::json& row_ )>& process_ ) const;
 
 		void start() override;
 		void stop() override;
 		Device::Type getType() const override { return Switch::type; };
-		nlohmann::json getJson() const override;
 		nlohmann::json getSettingsJson() const override;
 
+	protected:
+		nlohmann::json _getJson() const override;
+
 	private:
 		Option m_value;
 		Device::UpdateSource m_source;
-		std::chrono::system_clock::time_point m_updated;
 		struct {
 			Option value;
 			Device::UpdateSource source;
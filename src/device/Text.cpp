@@ -27,7 +27,6 @@ namespace micasa {
 	Text::Text( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ ) :
 		Device( plugin_, id_, reference_, label_, enabled_ ),
 		m_value( "" ),
-		m_updated( system_clock::now() ),
 		m_rateLimiter( { "", Device::resolveUpdateSource( 0 ) } )
 	{
 		try {
@@ -86,6 +85,8 @@ namespace micasa {
 			return;
 		}
 
+		// NOTE texts are often discrete messages, so unlike other devices they're never coalesced when the device is
+		// overloaded. Only an explicitly configured rate limit replaces pending updates with the latest value.
 		if (
 			this->m_settings->contains( "rate_limit" )
 			&& this->getPlugin()->getState() >= Plugin::State::READY
@@ -97,7 +98,9 @@ namespace micasa {
 				this->m_rateLimiter.source = source_;
 				this->m_rateLimiter.value = value_;
 				auto task = this->m_rateLimiter.task.lock();
-				if ( ! task ) {
+				if ( task ) {
+					this->m_coalesced++;
+				} else {
 					this->m_rateLimiter.task = this->m_scheduler.schedule( next, 0, 1, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
 						this->_processValue( this->m_rateLimiter.source, this->m_rateLimiter.value );
 					} );
@@ -110,12 +113,11 @@ namespace micasa {
 		}
 	};
 
-	json Text::getJson() const {
-		json result = Device::getJson();
+	json Text::_getJson() const {
+		json result = Device::_getJson();
 
 		result["value"] = this->m_value;
 		result["source"] = Device::resolveUpdateSource( this->m_source );
-		result["age"] = duration_cast<seconds>( system_clock::now() - this->m_updated ).count();
 		result["type"] = "text";
 		result["subtype"] = this->m_settings->get( "subtype", this->m_settings->get( DEVICE_SETTING_DEFAULT_SUBTYPE, "generic" ) );
 		result["history_retention"] = this->m_settings->get<int>( "history_retention", DEVICE_TEXT_DEFAULT_HISTORY_RETENTION );
@@ -179,25 +181,53 @@ namespace micasa {
 	};
 
 	json Text::getData( unsigned int range_, const std::string& interval_ ) const {
+		json result = json::array();
+		this->getData( range_, interval_, [&result]( const json& row_ ) {
+			result += row_;
+		} );
+		return result;
+	};
+
+	void Text::getData( unsigned int range_, const std::string& interval_, const std::function<void( const json& row_ )>& process_ ) const {
 		std::vector<std::string> validIntervals = { "hour", "day", "week", "month", "year" };
 		if ( std::find( validIntervals.begin(), validIntervals.end(), interval_ ) == validIntervals.end() ) {
-			return json::array();
+			return;
 		}
 		std::string interval = interval_;
 		if ( interval == "week" ) {
 			interval = "day";
 			range_ *= 7;
 		}
-		return g_database->getQuery<json>(
-			"SELECT `value`, CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `timestamp` "
-			"FROM `device_text_history` "
-			"WHERE `device_id` = %d "
-			"AND `date` >= datetime( 'now', '-%d %s' ) "
-			"ORDER BY `date` ASC ",
-			this->m_id,
-			range_,
-			interval.c_str()
-		);
+
+		// NOTE the start of the window is determined once so that it doesn't move between pages. History rows don't
+		// have a unique date, so each page continues after the date and rowid of the last row of the previous page.
+		std::string from = g_database->getQueryValue<std::string>( "SELECT datetime( 'now', '-%d %s' )", range_, interval.c_str() );
+		std::string last = "";
+		int lastRowId = 0;
+		g_database->getQueryPages( [&]() -> json {
+			json rows = g_database->getQuery<json>(
+				"SELECT `value`, CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `timestamp`, `date` AS `last_date`, `rowid` AS `last_rowid` "
+				"FROM `device_text_history` "
+				"WHERE `device_id` = %d "
+				"AND `date` >= %Q "
+				"AND ( `date` > %Q OR ( `date` = %Q AND `rowid` > %d ) ) "
+				"ORDER BY `date` ASC, `rowid` ASC "
+				"LIMIT %d",
+				this->m_id,
+				from.c_str(),
+				last.c_str(),
+				last.c_str(),
+				lastRowId,
+				DATABASE_ROWS_PAGE_SIZE
+			);
+			for ( auto& row : rows ) {
+				last = row["last_date"].get<std::string>();
+				lastRowId = row["last_rowid"].get<int>();
+				row.erase( "last_date" );
+				row.erase( "last_rowid" );
+			}
+			return rows;
+		}, process_ );
 	};
 
 	void Text::_processValue( const Device::UpdateSource& source_, const t_value& value_ ) {
@@ -209,7 +239,7 @@ namespace micasa {
 		// If the update originates from the plugin it is not send back to the plugin again.
 		bool success = true;
 		bool apply = true;
-		for ( auto const& plugin : g_controller->getAllPlugins() ) {
+		for ( auto const& plugin : g_controller->getDevicePlugins( Device::shared_from_this() ) ) {
 			if (
 				plugin != this->getPlugin()
 				|| ( source_ & Device::UpdateSource::PLUGIN ) != Device::UpdateSource::PLUGIN
@@ -231,6 +261,7 @@ namespace micasa {
 			}
 			this->m_source = source_;
 			this->m_updated = system_clock::now();
+			this->_changed();
 			if (
 				this->m_enabled
 				&& this->getPlugin()->getState() >= Plugin::State::READY
@@ -239,7 +270,9 @@ namespace micasa {
 			}
 			Logger::logr( Logger::LogLevel::NORMAL, this, "New value %s.", this->m_value.c_str() );
 		} else {
+			// NOTE the json of the device might have been rendered with the rejected value in the meantime.
 			this->m_value = previous;
+			this->m_version++;
 		}
 	};
 
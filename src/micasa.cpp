@@ -19,13 +19,14 @@ namespace micasa {
 	std::unique_ptr<Controller> g_controller;
 
 	const char g_usage[] =
-		"Usage: micasa [-p|--port <port>] [-sslp|--sslport <port>] [-l|--loglevel <loglevel>]\n"
+		"Usage: micasa [-p|--port <port>] [-sslp|--sslport <port>] [-l|--loglevel <loglevel>] [-sc|--scriptcontexts <count>]\n"
 		"\t-p|--port <port>\n\t\tSets the port for web connections (defaults to 80).\n"
 		"\t-sslp|--sslport <port>\n\t\tSets the port for secure web connections (defaults to no ssl).\n"
 		"\t-l|--loglevel <loglevel>\n\t\tSets the level of logging:\n"
 		"\t\t\t0 = default\n"
 		"\t\t\t1 = verbose\n"
 		"\t\t\t99 = debug\n"
+		"\t-sc|--scriptcontexts <count>\n\t\tSets the number of scripts that can run in parallel (defaults to the number of cores).\n"
 	;
 
 	static volatile bool g_shutdown = false;
@@ -77,6 +78,13 @@ int main( int argc_, char* argv_[] ) {
 	}
 	auto logger = Logger::addReceiver<ConsoleLogger>( logLevel );
 
+	unsigned int scriptContexts = std::max( 1U, std::thread::hardware_concurrency() );
+	if ( arguments.exists( "-sc" ) ) {
+		scriptContexts = atoi( arguments.get( "-sc" ).c_str() );
+	} else if ( arguments.exists( "--scriptcontexts" ) ) {
+		scriptContexts = atoi( arguments.get( "--scriptcontexts" ).c_str() );
+	}
+
 	// See if the datadir is read- and writable.
 	struct stat info;
 	if (
@@ -93,12 +101,14 @@ int main( int argc_, char* argv_[] ) {
 	sigaction( SIGINT, &action, NULL );
 	sigaction( SIGTERM, &action, NULL );
 
+	auto databaseBegin = std::chrono::steady_clock::now();
 	g_database = std::unique_ptr<Database>( new Database );
 
 	// The database might take some time to initialize (due to the VACUUM call). An additional shutdown check is done.
 	if ( ! g_shutdown ) {
 		g_settings = std::unique_ptr<Settings<>>( new Settings<> );
-		g_controller = std::unique_ptr<Controller>( new Controller );
+		g_controller = std::unique_ptr<Controller>( new Controller( scriptContexts ) );
+		g_controller->addStartupTiming( "database", "open", databaseBegin );
 		g_webServer = std::unique_ptr<WebServer>( new WebServer( port, sslport ) );
 
 		g_controller->start();
@@ -237,7 +237,10 @@ namespace micasa {
 							len >= (2 + length + 16 )
 							&& memcmp( (void*)verify, (void*)&packet[2 + length], 16 ) == 0
 						) {
-							if ( mg_parse_http( decrypted, length, &connection_->m_http, true ) > 0 ) {
+							http_message http;
+							if ( mg_parse_http( decrypted, length, &http, true ) > 0 ) {
+								http.body.len = std::min( http.body.len, (size_t)( decrypted + length - http.body.p ) );
+								connection_->_parse( http );
 								this->_processRequest( session );
 							} else {
 								Logger::log( Logger::LogLevel::ERROR, this, "Unable to parse session http message." );
@@ -356,6 +359,19 @@ namespace micasa {
 			}
 		} );
 
+		// Only devices that have HomeKit enabled are of interest to this plugin. The devices are looked up in the
+		// database because they might not have been declared by their plugin yet.
+		auto deviceIds = g_database->getQueryColumn<unsigned int>(
+			"SELECT `device_id` "
+			"FROM `device_settings` "
+			"WHERE `key`=%Q "
+			"AND `value` IN ( 'true', '1', 'yes' )",
+			( "enable_homekit_" + this->getReference() ).c_str()
+		);
+		for ( auto const &deviceId : deviceIds ) {
+			g_controller->subscribeDevice( this->shared_from_this(), deviceId );
+		}
+
 		// As long as there's no connection from the controller (an iOS device) we remain in disconnected state.
 		this->setState( Plugin::State::DISCONNECTED );
 	};
@@ -391,7 +407,7 @@ namespace micasa {
 		Plugin::stop();
 	};
 
-	bool HomeKit::updateDevice( const Device::UpdateSource& source_, std::shared_ptr<Device> device_, bool owned_, bool& apply_ ) {
+	void HomeKit::afterUpdateDevice( std::shared_ptr<Device> device_, const Device::UpdateSource& source_, bool owned_ ) {
 		if ( device_->getSettings()->get<bool>( "enable_homekit_" + this->getReference(), false ) ) {
 
 			// Events for this device are only sent to sessions that have specificially asked for this device to be
@@ -481,7 +497,6 @@ namespace micasa {
 				}
 			}
 		}
-		return true;
 	};
 
 	json HomeKit::getJson() const {
@@ -579,6 +594,15 @@ namespace micasa {
 		if ( increaseConfig ) {
 			this->_increaseConfig( true );
 		}
+
+		if (
+			json_.find( setting ) != json_.end()
+			&& jsonGet<bool>( json_[setting] )
+		) {
+			g_controller->subscribeDevice( this->shared_from_this(), device_->getId() );
+		} else {
+			g_controller->unsubscribeDevice( this->shared_from_this(), device_->getId() );
+		}
 	};
 
 	void HomeKit::beforeRemoveDevice( const std::shared_ptr<Device> device_ ) {
@@ -44,7 +44,7 @@ namespace micasa {
 		void start() override;
 		void stop() override;
 		std::string getLabel() const override { return HomeKit::label; };
-		bool updateDevice( const Device::UpdateSource& source_, std::shared_ptr<Device> device_, bool owned_, bool& apply_ ) override;
+		void afterUpdateDevice( std::shared_ptr<Device> device_, const Device::UpdateSource& source_, bool owned_ ) override;
 		nlohmann::json getJson() const override;
 		nlohmann::json getSettingsJson() const override;
 		static nlohmann::json getEmptySettingsJson( bool advanced_ = false );
@@ -5,6 +5,7 @@
 #include "ZWave/CommandClasses.h"
 
 #include "../Logger.h"
+#include "../Controller.h"
 #include "../User.h"
 
 #include "../device/Level.h"
@@ -33,6 +34,8 @@ namespace micasa {
 	using namespace nlohmann;
 	using namespace OpenZWave;
 
+	extern std::unique_ptr<Controller> g_controller;
+
 	const char* ZWaveNode::label = "Z-Wave Node";
 
 	ZWaveNode::ZWaveNode( const unsigned int id_, const Plugin::Type type_, const std::string reference_, const std::shared_ptr<Plugin> parent_ ) :
@@ -952,6 +955,9 @@ namespace micasa {
 				}
 
 				this->m_configuration[reference] = setting;
+
+				// NOTE the configuration is part of the json of the plugin and is changed outside of the api.
+				g_controller->invalidateDeviceJson();
 				break;
 			}
 
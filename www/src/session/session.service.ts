@@ -101,8 +101,13 @@ export class SessionService {
 					var url: string = ( ( loc.protocol === 'https:' ) ? 'wss://' : 'ws://' ) + loc.hostname + ( !! loc.port ? ':' + loc.port : '' ) + '/live/' + session_.token;
 					this._socket = new WebSocket( url );
 					this._socket.onmessage = event_ => {
+						// NOTE the server batches events into a single frame holding an array of events.
 						let data: any = JSON.parse( event_.data );
-						this._events.next( data );
+						if ( Array.isArray( data ) ) {
+							data.forEach( ( event: any ) => this._events.next( event ) );
+						} else {
+							this._events.next( data );
+						}
 					};
 				}
 			} )